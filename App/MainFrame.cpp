@@ -20,9 +20,15 @@
 #include "MainFrame.h"
 #include "wx/colordlg.h"
 
+/* progressive rendering stops once the frame has this many samples per pixel */
+static const int s_progressiveMaxSamples = 256;
+/* samples added on each pass, and how often the timer checks if they are done (ms) */
+static const int s_progressiveSamplesPerPass = 4;
+static const int s_progressiveInterval = 30;
+
 
 MainFrame::MainFrame(const wxString& title, const wxPoint& pos, const wxSize& size, long style)
-: wxFrame(NULL, wxID_ANY, title, pos, size, style)
+: wxFrame(NULL, wxID_ANY, title, pos, size, style), m_progressiveTimer(this, ProgressiveTimer)
 {	
 
 	/* create top menu bar*/
@@ -128,6 +134,10 @@ MainFrame::MainFrame(const wxString& title, const wxPoint& pos, const wxSize& si
 
 	m_FXAAbutton = new wxCheckBox(panel, wxID_ANY, "FXAA");
 	renderAreaSizer->Add(m_FXAAbutton, wxCENTER);
+
+	/* keeps adding samples to the frame after the first one, FXAA is not needed then */
+	m_progressiveButton = new wxCheckBox(panel, wxID_ANY, "Progressive");
+	renderAreaSizer->Add(m_progressiveButton, wxCENTER);
 	
 	wxBoxSizer* resoSizer = new wxStaticBoxSizer(new wxStaticBox(panel, wxID_ANY, "Resolution"), wxVERTICAL);
 	renderAreaSizer->Add(resoSizer, 0, wxALL);
@@ -189,6 +199,8 @@ MainFrame::MainFrame(const wxString& title, const wxPoint& pos, const wxSize& si
 	this->Connect(LoadModelButton, wxEVT_COMMAND_BUTTON_CLICKED, wxCommandEventHandler(MainFrame::OnLoadModel));
 	this->Connect(RenderButton, wxEVT_COMMAND_BUTTON_CLICKED, wxCommandEventHandler(MainFrame::OnRenderButton));
 	this->Connect(ReleaseButton, wxEVT_COMMAND_BUTTON_CLICKED, wxCommandEventHandler(MainFrame::OnReleaseButton));
+	this->Connect(ProgressiveTimer, wxEVT_TIMER, wxTimerEventHandler(MainFrame::OnProgressiveTimer));
+	this->Connect(RenderDoneEvent, wxEVT_THREAD, wxThreadEventHandler(MainFrame::OnRenderDone));
 	this->Connect(wxID_SELECT_COLOR, wxEVT_COMMAND_BUTTON_CLICKED, wxCommandEventHandler(MainFrame::OnSetColorButton));
 	this->Connect(ShowRenderViewMenu, wxEVT_MENU, wxCommandEventHandler(MainFrame::OnShowRenderFrame));
 	this->Connect(wxID_ABOUT, wxEVT_MENU, wxCommandEventHandler(MainFrame::OnAbout));
@@ -300,6 +312,8 @@ void MainFrame::OnLoadModel(wxCommandEvent& WXUNUSED(event))
 	if (openFileDialog.ShowModal() == wxID_CANCEL)
 		return; // the user has pressed cancel
 
+	m_progressiveTimer.Stop();
+
 	SceneManager& manager = SceneManager::GetSharedManager();
 	manager.ClearScene();
 	manager.LoadSceneFromOBJ(openFileDialog.GetPath().ToStdString());
@@ -366,27 +380,92 @@ void MainFrame::OnRenderButton(wxCommandEvent& WXUNUSED(event))
 	light.Ks = 0.2;
 	light.Ka = 0.0;
 
+	/* a new render replaces the progressive one going on */
+	m_progressiveTimer.Stop();
+	m_frameResolution = wxSize(width, height);
+
+	if (m_progressiveButton->GetValue())
+	{
+		m_progressiveCamera = camera;
+		m_progressiveLight = light;
+
+		/* the first sample is shown as soon as it's ready, the timer adds the next ones */
+		if (!shared.AddSamples(width, height, camera, light))
+			return;
+		m_progressiveTimer.Start(s_progressiveInterval);
+
+		m_renderFrame->Show();
+		m_renderFrame->Raise();
+		m_windowMenu->Check(ShowRenderViewMenu, true);
+		return;
+	}
+
 	AntiAliasingMethod AA;
 	if (m_FXAAbutton->GetValue())
 		AA = FXAA;
 	else AA = noAA;
 
-	// render
-	if (!shared.Render(width, height, camera, light, AA))
+	// render, the UI keeps responding until the frame is ready
+	this->SetStatusText("Rendering...");
+	shared.RenderAsync(width, height, camera, light, AA, &MainFrame::OnFrameReady, this);
+}
+
+void MainFrame::OnFrameReady(const cl_uchar4* WXUNUSED(frame), int WXUNUSED(width), int WXUNUSED(height), void* userData)
+{
+	/* this is not the UI thread, the frame is shown by OnRenderDone */
+	MainFrame* mainFrame = (MainFrame*)userData;
+	wxQueueEvent(mainFrame, new wxThreadEvent(wxEVT_THREAD, RenderDoneEvent));
+}
+
+void MainFrame::OnRenderDone(wxThreadEvent& WXUNUSED(event))
+{
+	RenderGirlShared& shared = RenderGirlShared::GetRenderGirlShared();
+
+	/* the device may be gone already, or showing samples of a progressive render */
+	if (shared.GetSelectedDevice() == NULL || m_progressiveTimer.IsRunning())
+		return;
+	if (!shared.FinishFrame())
 		return;
 
 	// get data back
 	const cl_uchar4* frame = shared.GetFrame();
 
-	m_renderFrame->SetImage(frame, wxSize(width, height));
+	this->SetStatusText("RenderGirl ready!");
+	m_renderFrame->SetImage(frame, m_frameResolution);
+	/* only written while a view of it is selected on the render frame */
+	if (shared.GetTraversalCost() != NULL)
+		m_renderFrame->SetTraversalCost(shared.GetTraversalCost(), m_frameResolution);
 	m_renderFrame->Show();
 	m_renderFrame->Raise();
 	m_windowMenu->Check(ShowRenderViewMenu, true);
 }
 
+void MainFrame::OnProgressiveTimer(wxTimerEvent& WXUNUSED(event))
+{
+	RenderGirlShared& shared = RenderGirlShared::GetRenderGirlShared();
+
+	/* the UI keeps responding while the device works on the samples */
+	if (!shared.IsFrameReady())
+		return;
+
+	m_renderFrame->SetImage(shared.GetFrame(), m_frameResolution);
+	this->SetStatusText(std::to_string(shared.GetSampleCount()) + " samples per pixel");
+
+	if (shared.GetSampleCount() >= s_progressiveMaxSamples)
+	{
+		m_progressiveTimer.Stop();
+		return;
+	}
+
+	Camera camera = m_progressiveCamera;
+	if (!shared.AddSamples(m_frameResolution.x, m_frameResolution.y, camera, m_progressiveLight, s_progressiveSamplesPerPass))
+		m_progressiveTimer.Stop();
+}
+
 void MainFrame::OnReleaseButton(wxCommandEvent& WXUNUSED(event))
 {
 	RenderGirlShared& shared = RenderGirlShared::GetRenderGirlShared();
+	m_progressiveTimer.Stop();
 	//release this device
 	shared.ReleaseDevice();
 	
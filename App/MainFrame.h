@@ -69,6 +69,7 @@ private:
 	wxButton* m_releaseButton;
 	/* checkbox button */
 	wxCheckBox* m_FXAAbutton;
+	wxCheckBox* m_progressiveButton;
 	/* menus */
 	wxMenu* m_windowMenu;
 
@@ -88,12 +89,24 @@ private:
 	/* light's color*/
 	wxColor m_lightColor;
 
+	/* progressive rendering, the timer adds samples while the frame shown is not good enough.
+		The camera is kept as typed, the core changes the one it receives */
+	wxTimer m_progressiveTimer;
+	Camera m_progressiveCamera;
+	Light m_progressiveLight;
+	// resolution of the frame on the device
+	wxSize m_frameResolution;
+
 	/*callback functions*/
 	void OnPlatformSelect(wxCommandEvent& event);
 	void OnDeviceSelect(wxCommandEvent& event);
 	void OnSelectButtonPressed(wxCommandEvent& event);
 	void OnLoadModel(wxCommandEvent& event);
 	void OnRenderButton(wxCommandEvent& event);
+	void OnProgressiveTimer(wxTimerEvent& event);
+	void OnRenderDone(wxThreadEvent& event);
+	/* called by the core once the frame of RenderAsync is on the host */
+	static void OnFrameReady(const cl_uchar4* frame, int width, int height, void* userData);
 	void OnReleaseButton(wxCommandEvent& event);
 	void OnSetColorButton(wxCommandEvent& event);
 	void OnShowRenderFrame(wxCommandEvent& event);
@@ -20,6 +20,7 @@
 
 #include "RenderFrame.h"
 #include "MainFrame.h"
+#include <algorithm>
 
 
 RenderFrame::RenderFrame(wxWindow* parent, const wxString& title, const wxPoint& pos, const wxSize& size, long style)
@@ -42,6 +43,13 @@ RenderFrame::RenderFrame(wxWindow* parent, const wxString& title, const wxPoint&
 	m_imageMenu->Enable(wxID_SAVE, false);
 	
 	menuBar->Append(m_imageMenu, "Image");
+
+	/* false colour views of the traversal cost of each pixel, they make the renderer write it */
+	m_viewMenu = new wxMenu();
+	m_viewMenu->AppendRadioItem(ViewImageMenu, "Image", "Show the rendered image");
+	m_viewMenu->AppendRadioItem(ViewNodesVisitedMenu, "Nodes visited", "Show the BVH nodes visited on each pixel, from blue to red");
+	m_viewMenu->AppendRadioItem(ViewFacesTestedMenu, "Faces tested", "Show the faces tested on each pixel, from blue to red");
+	menuBar->Append(m_viewMenu, "View");
 	this->SetMenuBar(menuBar);
 
 	/* set best size based on image resolution */
@@ -49,6 +57,7 @@ RenderFrame::RenderFrame(wxWindow* parent, const wxString& title, const wxPoint&
 
 
 	this->Connect(wxID_SAVE, wxEVT_MENU, wxCommandEventHandler(RenderFrame::OnSaveImage));
+	this->Connect(ViewImageMenu, ViewFacesTestedMenu, wxEVT_MENU, wxCommandEventHandler(RenderFrame::OnViewMenu));
 
 }
 
@@ -73,7 +82,9 @@ void RenderFrame::OnPaint(wxPaintEvent& event)
 	wxImage blackBackground(m_sizer->GetSize());
 	dc.DrawBitmap(blackBackground, 0, 0);
 
-	if (m_render.IsOk())
+	if (!m_viewMenu->IsChecked(ViewImageMenu) && m_costImage.IsOk())
+		dc.DrawBitmap(m_costImage, 0, 0);
+	else if (m_render.IsOk())
 		dc.DrawBitmap(m_render, 0, 0);
 }
 
@@ -85,6 +96,11 @@ void RenderFrame::SetImage(const cl_uchar4 *frame, wxSize& resolution)
 
 	m_imageMenu->Enable(wxID_SAVE, true);
 
+	/* the traversal cost of the previous image is gone */
+	m_cost.clear();
+	if (m_costImage.IsOk())
+		m_costImage.Destroy();
+
 	/* copy to local data */
 	long size = resolution.x * resolution.y;
 	unsigned char* frameRGBData = (unsigned char*)malloc(size * 3);
@@ -109,6 +125,60 @@ void RenderFrame::SetImage(const cl_uchar4 *frame, wxSize& resolution)
 	this->Refresh();
 }
 
+void RenderFrame::SetTraversalCost(const cl_uint2 *cost, wxSize& resolution)
+{
+	m_cost.assign(cost, cost + resolution.x * resolution.y);
+	m_costResolution = resolution;
+
+	this->UpdateCostImage();
+	this->Refresh();
+}
+
+/* False colour of t in [0, 1], from blue on the cheapest pixels through cyan, green and yellow to red on the most expensive ones */
+static void CostColor(const float t, unsigned char* rgb)
+{
+	float red = std::min(std::max(4.0f * t - 2.0f, 0.0f), 1.0f);
+	float green = std::min(std::min(4.0f * t, 4.0f - 4.0f * t), 1.0f);
+	float blue = std::min(std::max(2.0f - 4.0f * t, 0.0f), 1.0f);
+	rgb[0] = (unsigned char)(red * 255.0f);
+	rgb[1] = (unsigned char)(green * 255.0f);
+	rgb[2] = (unsigned char)(blue * 255.0f);
+}
+
+void RenderFrame::UpdateCostImage()
+{
+	if (m_costImage.IsOk())
+		m_costImage.Destroy();
+	if (m_cost.empty() || m_viewMenu->IsChecked(ViewImageMenu))
+		return;
+
+	/* nodes visited on x, faces tested on y */
+	int component = m_viewMenu->IsChecked(ViewNodesVisitedMenu) ? 0 : 1;
+
+	/* the colours go up to the most expensive pixel of this image */
+	cl_uint maxCost = 1;
+	for (unsigned int a = 0; a < m_cost.size(); a++)
+		maxCost = std::max(maxCost, m_cost[a].s[component]);
+
+	// wx will take care of freeing it
+	unsigned char* costRGBData = (unsigned char*)malloc(m_cost.size() * 3);
+	for (unsigned int a = 0; a < m_cost.size(); a++)
+	{
+		CostColor((float)m_cost[a].s[component] / (float)maxCost, &costRGBData[a * 3]);
+	}
+
+	m_costImage.Create(m_costResolution, costRGBData, false);
+}
+
+void RenderFrame::OnViewMenu(wxCommandEvent& WXUNUSED(event))
+{
+	/* the renderer only writes the traversal cost while a view of it is selected, it shows up on the next render */
+	RenderGirlShared::GetRenderGirlShared().SetTraversalCost(!m_viewMenu->IsChecked(ViewImageMenu));
+
+	this->UpdateCostImage();
+	this->Refresh();
+}
+
 void RenderFrame::OnSaveImage(wxCommandEvent& WXUNUSED(event))
 {
 	/* ask for the user to select a file name and a file format to save */
@@ -117,6 +187,9 @@ void RenderFrame::OnSaveImage(wxCommandEvent& WXUNUSED(event))
 	if (saveFileDialog.ShowModal() == wxID_CANCEL)
 		return; // the user has pressed cancel
 
-	//..got here, save image
-	m_render.SaveFile(saveFileDialog.GetPath());
+	//..got here, save image, or the false colour view being shown
+	if (!m_viewMenu->IsChecked(ViewImageMenu) && m_costImage.IsOk())
+		m_costImage.SaveFile(saveFileDialog.GetPath());
+	else
+		m_render.SaveFile(saveFileDialog.GetPath());
 }
\ No newline at end of file
@@ -21,6 +21,8 @@
 #ifndef __RENDERGIRLAPP_RENDERFRAME__
 #define __RENDERGIRLAPP_RENDERFRAME__
 
+#include <vector>
+
 #include "wx\wx.h"
 #include "WindowsIDs.h"
 #include "CL\cl.h"
@@ -40,13 +42,27 @@ public:
 	/* Set a image to render on the frame and update the UI, this function will make a copy of the frame */
 	void SetImage(const cl_uchar4 *frame, wxSize& resolution);
 
+	/* Set the traversal cost of each pixel of the image, shown in false colour by the View menu. Call it after SetImage,
+		this function will make a copy of the cost too */
+	void SetTraversalCost(const cl_uint2 *cost, wxSize& resolution);
+
 private:
 
 	void OnSaveImage(wxCommandEvent& event);
+	void OnViewMenu(wxCommandEvent& event);
+
+	/* build m_costImage from the traversal cost for the view selected */
+	void UpdateCostImage();
 
 	wxMenu* m_imageMenu;
+	wxMenu* m_viewMenu;
 	// the generated image
 	wxImage m_render;
+	// nodes visited and faces tested on each pixel of it, empty if the renderer didn't write them
+	std::vector<cl_uint2> m_cost;
+	wxSize m_costResolution;
+	// the false colour view of one of them
+	wxImage m_costImage;
 	// sizer to calculate the best fitting size
 	wxBoxSizer* m_sizer;
 	/* boolean control when there's a image to render */
@@ -33,13 +33,17 @@ enum MainFrameEvents /* Window identifiers for MainFrame */
 	LoadModelButton,
 	ReleaseButton,
 	RenderButton,
-	ShowRenderViewMenu
+	ShowRenderViewMenu,
+	ProgressiveTimer,
+	RenderDoneEvent
 };
 
 
 enum RenderFrameEvents /* Window identifiers for render frame */
 {
-	// = RenderButton + 1 // id of render frame window starts where the main frame ids ends
+	ViewImageMenu = RenderDoneEvent + 1, // id of render frame window starts where the main frame ids ends
+	ViewNodesVisitedMenu,
+	ViewFacesTestedMenu
 };
 
 
@@ -17,6 +17,7 @@
 from ctypes import *
 import os
 import sys
+import time
 import bpy
 
 from mathutils import Vector
@@ -37,6 +38,8 @@ class RenderGirl:
         self.session = None
         # positive number means some device is ready to render
         self.device_selected = -1
+        # shadows setting the device was prepared with
+        self.shadows = False
         RenderGirl.instance = self
 
 
@@ -149,15 +152,10 @@ class RenderGirl:
         return ret
 
 
-    def render(self, width, height, camera, light):
-        """ Render a frmae using the currently loaded objects on the core
-        @param width width of the frame in pixels
-        @param height height of the frame in pixels
-        @param camera camera to be used on rendering
-        @param light object representing the light (only one supported so far)
-        @return list with height * width pixels
+    def prepare_device(self):
+        """ Select and prepare the device picked on the UI if needed
+        @return -1 on error
         """
-
         # first step is to check if we need to select and prepare a
         # device before rendering. A -1 device means there's no device
         # currently selected. Positive values means some device was
@@ -165,19 +163,28 @@ class RenderGirl:
         # user dind't pick a different device before hitting render
         # button, in this case we should change the selected device as
         # well. Since the UI never returns -1, this condition cover
-        # all these cases.
+        # all these cases. Shadows are compiled into the kernel, so
+        # toggling them prepares the device again too.
         if (self.device_selected !=
-            int(bpy.context.scene.rgirl_settings.device)):
+            int(bpy.context.scene.rgirl_settings.device) or
+            self.shadows != bpy.context.scene.rgirl_settings.shadows):
             index = int(bpy.context.scene.rgirl_settings.device)
             efficiency_info = bpy.context.scene.rgirl_settings.efficiency_info
-            ret = self.render_girl_shared.SelectDevice(index,efficiency_info)
+            shadows = bpy.context.scene.rgirl_settings.shadows
+            ret = self.render_girl_shared.SelectDevice(index,efficiency_info,
+                                                        shadows)
             if ret == -1:
                 self.device_selected = -1
-                return None
+                return -1
             self.device_selected = index
+            self.shadows = shadows
+        return 0
 
-        pixel_count = width * height
-
+    def view_arguments(self, camera, light):
+        """ Convert camera and light to the C types expected by the core
+        @return tuple with camera position, up, direction, light
+        position and light color
+        """
         # extract positions from world matrix
         cam_pos = camera.matrix_world.translation.xzy
         light_pos = light.matrix_world.translation.xzy
@@ -197,25 +204,13 @@ class RenderGirl:
         c_light_pos = (c_float * 3)(*light_pos)
         c_light_color = (c_float * 3)(*light_color)
 
-        # alloc the frame buffer
-        c_frame_size = pixel_count * 4
-        c_out_frame = (c_ubyte * c_frame_size)()
-
-        # fxaa option
-        fxaa = bpy.context.scene.rgirl_settings.fxaa
-
-        ret = self.render_girl_shared.Render(width, height, c_cam_pos,
-                                             c_cam_up, c_cam_dir,
-                                             c_light_pos,
-                                             c_light_color,
-                                             byref(c_out_frame),
-                                             fxaa)
-
-        if ret == -1:
-            return None
+        return (c_cam_pos, c_cam_up, c_cam_dir, c_light_pos, c_light_color)
 
+    def convert_frame(self, c_out_frame, c_frame_size):
+        """ Copy a frame of the core to the format accepted by blender
+        @return list with a list of RGBA values for each pixel
+        """
         frame = []
-        # copy frame to format accepted by blender
         for i in range(0,c_frame_size,4):
             pixel = []
             pixel.append(c_out_frame[i] / 256.0) # red
@@ -226,12 +221,125 @@ class RenderGirl:
 
         return frame
 
+    def render(self, width, height, camera, light, wait=None):
+        """ Render a frmae using the currently loaded objects on the core
+        @param width width of the frame in pixels
+        @param height height of the frame in pixels
+        @param camera camera to be used on rendering
+        @param light object representing the light (only one supported so far)
+        @param wait function called over and over while the device
+        renders, returning False stops the rendering
+        @return list with height * width pixels, empty if wait stopped
+        it, None on error
+        """
+        if self.prepare_device() == -1:
+            return None
+
+        pixel_count = width * height
+
+        view = self.view_arguments(camera, light)
+
+        # fxaa option
+        fxaa = bpy.context.scene.rgirl_settings.fxaa
 
+        ret = self.render_girl_shared.RenderAsync(width, height, *view,
+                                                  fxaa)
+        if ret == -1:
+            return None
+
+        # alloc the frame buffer while the device renders
+        c_frame_size = pixel_count * 4
+        c_out_frame = (c_ubyte * c_frame_size)()
+
+        # poll the frame instead of waiting for it, so the caller
+        # stays responsive while the device renders
+        if wait is not None:
+            while True:
+                ready = self.render_girl_shared.IsFrameReady()
+                if ready == -1:
+                    return None
+                if ready == 1:
+                    break
+                if not wait():
+                    self.render_girl_shared.FinishFrame()
+                    return []
+                time.sleep(0.01)
+
+        ret = self.render_girl_shared.FetchFrame(width, height,
+                                                 byref(c_out_frame))
+        if ret == -1:
+            return None
+
+        return self.convert_frame(c_out_frame, c_frame_size)
+
+    def render_progressive(self, width, height, camera, light, samples,
+                           update):
+        """ Render a frame progressively, tracing more samples of each
+        pixel on every pass. The device works on the next pass while
+        the frame of the previous one is converted and shown.
+        @param samples total amount of samples of each pixel
+        @param update function called with the list of pixels and the
+        amount of samples after every pass, returning False stops the
+        rendering
+        @return -1 on error
+        """
+        if self.prepare_device() == -1:
+            return -1
+
+        view = self.view_arguments(camera, light)
+
+        c_frame_size = width * height * 4
+        c_out_frame = (c_ubyte * c_frame_size)()
+
+        # the first pass is a single sample, so there's something to
+        # show as soon as possible, the next ones trace a few at once
+        ret = self.render_girl_shared.AddSamples(width, height, *view, 1)
+        if ret == -1:
+            return -1
+        added = 1
+
+        while True:
+            done = self.render_girl_shared.FetchSamples(width, height,
+                                                        byref(c_out_frame))
+            if done == -1:
+                return -1
+
+            # the device works on the next pass while this one is shown
+            if added < samples:
+                pass_samples = min(4, samples - added)
+                ret = self.render_girl_shared.AddSamples(width, height,
+                                                         *view, pass_samples)
+                if ret == -1:
+                    return -1
+                added += pass_samples
+
+            if not update(self.convert_frame(c_out_frame, c_frame_size),
+                          done):
+                # the next pass is still on the device, the scene can't
+                # be cleared before it's done
+                if self.render_girl_shared.FinishFrame() == -1:
+                    return -1
+                break
+            if done >= samples:
+                break
+
+        return 0
 
     def clear_scene(self):
         " Clear all geometry loaded on the core "
         self.render_girl_shared.ClearScene()
 
+    def start_trace(self):
+        " Start recording a timeline of everything the core does "
+        self.render_girl_shared.StartTrace()
+
+    def stop_trace(self, path):
+        """ Stop recording the timeline and write it as JSON
+        @param path Path of the file, open it with chrome://tracing
+        @return -1 on error
+        """
+        return self.render_girl_shared.StopTrace(path.encode("utf-8"))
+
 
     def log_callback(self, message, error):
         """Called from RenderGirlCore when there's a new message to be printed
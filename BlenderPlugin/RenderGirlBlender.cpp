@@ -22,6 +22,7 @@
 #include "RenderGirlShared.h"
 #include "Log.h"
 #include "OCLProgram.h"
+#include "Trace.h"
 
 
 /*
@@ -126,7 +127,7 @@ void FetchDevicesName(char const ** devices_out)
 	}
 }
 
-int SelectDevice(const int device, const bool efficiency_info)
+int SelectDevice(const int device, const bool efficiency_info, const bool shadows)
 {
 	RenderGirlShared& shared = RenderGirlShared::GetRenderGirlShared();
 
@@ -165,7 +166,7 @@ int SelectDevice(const int device, const bool efficiency_info)
 		return -1;
 	}
 
-	if (!shared.PrepareRaytracer(efficiency_info))
+	if (!shared.PrepareRaytracer(efficiency_info, StacklessLayout, shadows))
 	{
 		return -1;
 	}
@@ -245,14 +246,10 @@ void ClearScene()
 	manager.ClearScene();
 }
 
-int Render(const int width, const int height,
-	const float camera_pos[3], const float camera_up[3], const float camera_dir[3],
-	const float light_pos[3], const float color[3],
-	unsigned char* frame_out, const bool fxaa)
+/* Build the light and the camera from the arguments coming from Python */
+static void BuildLightAndCamera(const float camera_pos[3], const float camera_up[3], const float camera_dir[3],
+	const float light_pos[3], const float color[3], Light& light, Camera& cam)
 {
-
-	Light light;
-
 	light.pos.s[0] = light_pos[0];
 	light.pos.s[1] = light_pos[1];
 	light.pos.s[2] = light_pos[2];
@@ -265,7 +262,6 @@ int Render(const int width, const int height,
 	light.color.s[1] = color[1];
 	light.color.s[2] = color[2];
 
-	Camera cam;	
 	// set up vector to the be just pointing up
 	cam.up.s[0] = camera_up[0];
 	cam.up.s[1] = -camera_up[1]; // TODO: find out why this is necessary
@@ -280,24 +276,15 @@ int Render(const int width, const int height,
 	cam.dir.s[2] = camera_dir[2];
 
 	cam.from_lookAt = false;
+}
 
+/* copy the frame of the core to frame_out */
+static void CopyFrame(const int width, const int height, unsigned char* frame_out)
+{
 	RenderGirlShared& shared = RenderGirlShared::GetRenderGirlShared();
 
-	AntiAliasingMethod antiAlias = noAA;
-	if (fxaa == true)
-		antiAlias = FXAA;
-	
-
-	bool ret = shared.Render(width, height, cam, light, antiAlias);
-
-	if (!ret)
-	{ 
-		return -1;
-	}
-
 	int frame_size = width * height;
 	const cl_uchar4* frame = shared.GetFrame();
-	/* copy frame to frame_out */
 	for (int a = 0, b = 0; a < frame_size; a++, b+=4)
 	{
 		/* red */
@@ -309,6 +296,109 @@ int Render(const int width, const int height,
 		/* alpha */
 		frame_out[b + 3] = frame[a].s[3];
 	}
+}
+
+int Render(const int width, const int height,
+	const float camera_pos[3], const float camera_up[3], const float camera_dir[3],
+	const float light_pos[3], const float color[3],
+	unsigned char* frame_out, const bool fxaa)
+{
+
+	Light light;
+	Camera cam;	
+	BuildLightAndCamera(camera_pos, camera_up, camera_dir, light_pos, color, light, cam);
+
+	RenderGirlShared& shared = RenderGirlShared::GetRenderGirlShared();
+
+	AntiAliasingMethod antiAlias = noAA;
+	if (fxaa == true)
+		antiAlias = FXAA;
+	
+
+	bool ret = shared.Render(width, height, cam, light, antiAlias);
+
+	if (!ret)
+	{ 
+		return -1;
+	}
+
+	CopyFrame(width, height, frame_out);
+
+	return 0;
+}
+
+int RenderAsync(const int width, const int height,
+	const float camera_pos[3], const float camera_up[3], const float camera_dir[3],
+	const float light_pos[3], const float color[3], const bool fxaa)
+{
+	Light light;
+	Camera cam;
+	BuildLightAndCamera(camera_pos, camera_up, camera_dir, light_pos, color, light, cam);
+
+	RenderGirlShared& shared = RenderGirlShared::GetRenderGirlShared();
+
+	AntiAliasingMethod antiAlias = noAA;
+	if (fxaa == true)
+		antiAlias = FXAA;
+
+	if (!shared.RenderAsync(width, height, cam, light, antiAlias))
+		return -1;
+
+	return 0;
+}
+
+int IsFrameReady()
+{
+	RenderGirlShared& shared = RenderGirlShared::GetRenderGirlShared();
+	if (shared.IsFrameReady())
+		return 1;
+
+	/* a failed frame is finished too, it's not on the device anymore */
+	return shared.IsFrameOnDevice() ? 0 : -1;
+}
+
+int FetchFrame(const int width, const int height, unsigned char* frame_out)
+{
+	RenderGirlShared& shared = RenderGirlShared::GetRenderGirlShared();
+	if (!shared.FinishFrame())
+		return -1;
+
+	CopyFrame(width, height, frame_out);
+
+	return 0;
+}
+
+int AddSamples(const int width, const int height,
+	const float camera_pos[3], const float camera_up[3], const float camera_dir[3],
+	const float light_pos[3], const float color[3], const int samples)
+{
+	Light light;
+	Camera cam;
+	BuildLightAndCamera(camera_pos, camera_up, camera_dir, light_pos, color, light, cam);
+
+	RenderGirlShared& shared = RenderGirlShared::GetRenderGirlShared();
+	if (!shared.AddSamples(width, height, cam, light, samples))
+		return -1;
+
+	return 0;
+}
+
+int FetchSamples(const int width, const int height, unsigned char* frame_out)
+{
+	RenderGirlShared& shared = RenderGirlShared::GetRenderGirlShared();
+	if (!shared.FinishFrame())
+		return -1;
+
+	CopyFrame(width, height, frame_out);
+
+	return shared.GetSampleCount();
+}
+
+int FinishFrame()
+{
+	RenderGirlShared& shared = RenderGirlShared::GetRenderGirlShared();
+	if (!shared.FinishFrame())
+		return -1;
 
 	return 0;
 }
@@ -327,6 +417,16 @@ void FinishLogSystem()
 	Log::RemoveAllListeners();
 }
 
+void StartTrace()
+{
+	Trace::Start();
+}
+
+int StopTrace(const char* path)
+{
+	return Trace::Stop(std::string(path)) ? 0 : -1;
+}
+
 void SetSourcePath(const char* path)
 {
 	// set to global path of RenderGirl
@@ -60,9 +60,10 @@ extern "C" // make it callable from Ctypes
 	/* Select an OpenCL capalable device
 	device parameter is the index of the device within the "devices_out" argument from FetchDevices function
 	efficiency_info controls if RenderGirl should print efficiency information on the log
+	shadows controls if RenderGirl should trace shadow rays towards the light
 	return 0 if the selection was successfully, return -1 for error
 	*/
-	int SelectDevice(const int device, const bool efficiency_info);
+	int SelectDevice(const int device, const bool efficiency_info, const bool shadows);
 
 	/* Add a scenegroup to rendergirl core.
 		To keep arguments simple, pointers do not point to array objects, instead
@@ -111,12 +112,53 @@ extern "C" // make it callable from Ctypes
 		const bool fxaa // if FXAA post-processing should be applied
 		);
 
+	/* Same as Render, but it doesn't wait for the frame, so the caller can do something else meanwhile.
+		Call FetchFrame to get it. Return 0 for no errror, -1 otherwise. */
+	int RenderAsync(const int width, const int height,
+		const float camera_pos[3], const float camera_up[3], const float camera_dir[3],
+		const float light_pos[3], const float color[3], const bool fxaa);
+
+	/* Return 1 if the frame of RenderAsync or the samples of AddSamples are done, so FetchFrame or FetchSamples
+		won't wait for them, 0 if the device is still working on them, -1 if they failed */
+	int IsFrameReady();
+
+	/* Wait for the frame of RenderAsync and copy it to frame_out, same format of Render.
+		Return 0 for no errror, -1 otherwise. */
+	int FetchFrame(const int width, const int height, unsigned char* frame_out);
+
+	/* Progressive rendering, trace more samples of every pixel of the scene and average them with the ones 
+		traced before. Arguments are the same of Render. This call doesn't wait for the samples, call FetchSamples 
+		to get the frame with them. Changes on the scene, camera or light start over from the first sample.
+		Return 0 for no errror, -1 otherwise.
+	*/
+	int AddSamples(const int width, const int height,
+		const float camera_pos[3], const float camera_up[3], const float camera_dir[3],
+		const float light_pos[3], const float color[3],
+		const int samples // amount of samples of each pixel to trace on this call
+		);
+
+	/* Wait for the samples added by AddSamples and copy the frame with their average to frame_out, 
+		same format of Render. Return the amount of samples of each pixel on the frame, -1 for an error */
+	int FetchSamples(const int width, const int height, unsigned char* frame_out);
+
+	/* Wait for the frame of RenderAsync or the samples of AddSamples without copying them. The scene must not be
+		cleared while they are on the device, call this before ClearScene when they are not fetched.
+		Return 0 for no errror, -1 otherwise. */
+	int FinishFrame();
+
 	/* Finish RenderGirl and release resources from OpenCL devices */
 	void FinishRenderGirl();
 
 	/* Finish log system*/
 	void FinishLogSystem();
 
+	/* Start recording a timeline of everything RenderGirl does, from loading the scene to the readback of the frames */
+	void StartTrace();
+
+	/* Stop recording the timeline and write it at path as a JSON file for chrome://tracing.
+		Return 0 for no errror, -1 otherwise. */
+	int StopTrace(const char* path);
+
 	/* Set source path where RenderGirl will look for the .cl source files */
 	void SetSourcePath(const char* path);
 }
@@ -19,7 +19,8 @@ from bpy.props import (BoolProperty,
                        EnumProperty,
                        FloatProperty,
                        IntProperty,
-                       PointerProperty)
+                       PointerProperty,
+                       StringProperty)
 from .RenderGirl import RenderGirl
 
 
@@ -60,6 +61,20 @@ class RenderGirlRenderSettings(bpy.types.PropertyGroup):
         cls.efficiency_info = BoolProperty(name="Efficiency information",
                 description="If enabled, RenderGirl will print efficiency information on the console. May degrade performance. It will only takes effect after a device change or first render.")
 
+        cls.shadows = BoolProperty(name="Shadows",
+                description="Trace a shadow ray towards the light from every surface hit")
+
+        cls.progressive = BoolProperty(name="Progressive",
+                description="Keep tracing jittered samples of every pixel and show the frame after each pass, anti-aliasing it without FXAA")
+
+        cls.samples = IntProperty(name="Samples",
+                description="Amount of samples of every pixel on progressive rendering",
+                default=64, min=1, max=4096)
+
+        cls.trace_path = StringProperty(name="Trace",
+                description="Write a timeline of the render at this path, open it with chrome://tracing. Leave it empty to disable",
+                subtype='FILE_PATH')
+
     @classmethod
     def unregister(cls):
         del bpy.types.Scene.rgirl_settings
@@ -85,3 +100,8 @@ def render_girl_render_options(self, context):
     if context.scene.render.engine == 'RenderGirl':
         self.layout.prop(context.scene.rgirl_settings,"device")
         self.layout.prop(context.scene.rgirl_settings,"efficiency_info")
+        self.layout.prop(context.scene.rgirl_settings,"shadows")
+        self.layout.prop(context.scene.rgirl_settings,"progressive")
+        if context.scene.rgirl_settings.progressive:
+            self.layout.prop(context.scene.rgirl_settings,"samples")
+        self.layout.prop(context.scene.rgirl_settings,"trace_path")
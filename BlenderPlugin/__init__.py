@@ -51,6 +51,19 @@ class RenderGirlBlender(bpy.types.RenderEngine):
         RenderGirl.instance.session = None
 
     def render(self, scene):
+        trace_path = scene.rgirl_settings.trace_path
+        if not trace_path:
+            self.render_scene(scene)
+            return
+
+        # record a timeline of the whole render, from the upload of the meshes
+        RenderGirl.instance.start_trace()
+        try:
+            self.render_scene(scene)
+        finally:
+            RenderGirl.instance.stop_trace(bpy.path.abspath(trace_path))
+
+    def render_scene(self, scene):
         scale = scene.render.resolution_percentage / 100.0
         size_x = int(scene.render.resolution_x * scale)
         size_y = int(scene.render.resolution_y * scale)
@@ -113,18 +126,47 @@ class RenderGirlBlender(bpy.types.RenderEngine):
                 break
 
         # objects set up, now render
+        if scene.rgirl_settings.progressive:
+            def update(rect, samples):
+                # show every pass as soon as it's done
+                result = self.begin_result(0, 0, size_x, size_y)
+                result.layers[0].passes[0].rect = rect
+                self.end_result(result)
+                self.update_stats("", "Samples: {0}".format(samples))
+                self.update_progress(samples / scene.rgirl_settings.samples)
+                return not self.test_break()
+
+            ret = RenderGirl.instance.render_progressive(size_x, size_y,
+                                        scene.camera, light,
+                                        scene.rgirl_settings.samples, update)
+            RenderGirl.instance.clear_scene()
+            if ret == -1:
+                raise ValueError("Error rendering frame, please check the logs")
+            return
+
+        def wait():
+            # blender keeps drawing and can stop the rendering while the
+            # device works on the frame
+            self.update_progress(0.0)
+            return not self.test_break()
+
         rect = RenderGirl.instance.render(size_x, size_y,
-                                                    scene.camera, light)
+                                                    scene.camera, light, wait)
 
         if rect == None:
             RenderGirl.instance.clear_scene()
             raise ValueError("Error rendering frame, please check the logs")
+        if not rect:
+            # stopped by the user
+            RenderGirl.instance.clear_scene()
+            return
 
         # Here we write the pixel values to the RenderResult
         result = self.begin_result(0, 0, size_x, size_y)
         layer = result.layers[0]
         layer.passes[0].rect = rect
         self.end_result(result)
+        self.update_progress(1.0)
 
         # clear all geometry of this rendering
         # this will be removed as soon as we have a cache mechanism
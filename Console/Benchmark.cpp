@@ -0,0 +1,156 @@
+/*
+	RenderGirl - OpenCL raytracer renderer
+	Copyright (c) 2016, Henrique Jung, All rights reserved.
+
+	This program is free software; you can redistribute it and/or
+	modify it under the terms of the GNU Lesser General Public
+	License as published by the Free Software Foundation; either
+	version 3.0 of the License, or any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+	Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public
+	License along with this program.
+*/
+
+#include "Benchmark.h"
+#include <algorithm>
+
+Benchmark::Benchmark(const std::string &scene, const std::string &device, const int width, const int height,
+	const long long raysPerFrame)
+{
+	m_scene = scene;
+	m_device = device;
+	m_width = width;
+	m_height = height;
+	m_raysPerFrame = raysPerFrame;
+}
+
+void Benchmark::AddFrame(const double frameTime, const FrameTiming &timing)
+{
+	m_frameTimes.push_back(frameTime);
+	/* a stage without commands on this frame didn't run, a time of 0 would pull its statistics down */
+	for (int s = 0; s < ProfilingStageCount; s++)
+	{
+		if (timing.stages[s].commands > 0)
+			m_stageTimes[s].push_back(timing.stages[s].busy / 1000000.0);
+	}
+}
+
+Benchmark::Statistics Benchmark::ComputeStatistics(std::vector<double> times)
+{
+	Statistics statistics = { 0.0, 0.0, 0.0 };
+	if (times.empty())
+		return statistics;
+
+	std::sort(times.begin(), times.end());
+	size_t size = times.size();
+	statistics.median = size % 2 == 1 ? times[size / 2] : (times[size / 2 - 1] + times[size / 2]) / 2.0;
+	/* nearest rank, the smallest time not beaten by 95% of the frames */
+	size_t rank = (size * 95 + 99) / 100;
+	statistics.p95 = times[std::max<size_t>(rank, 1) - 1];
+	statistics.min = times[0];
+	return statistics;
+}
+
+double Benchmark::RaysPerSecond(const double time) const
+{
+	if (time <= 0.0)
+		return 0.0;
+	return m_raysPerFrame / (time / 1000.0);
+}
+
+/* text goes between quotes on CSV, quotes inside are doubled */
+static std::string QuoteCSV(const std::string &text)
+{
+	std::string quoted = "\"";
+	for (unsigned int c = 0; c < text.size(); c++)
+	{
+		if (text[c] == '"')
+			quoted += '"';
+		quoted += text[c];
+	}
+	return quoted + "\"";
+}
+
+/* and on JSON, where the backslashes of the paths of Windows are escaped too */
+static std::string QuoteJSON(const std::string &text)
+{
+	std::string quoted = "\"";
+	for (unsigned int c = 0; c < text.size(); c++)
+	{
+		if (text[c] == '"' || text[c] == '\\')
+			quoted += '\\';
+		quoted += text[c];
+	}
+	return quoted + "\"";
+}
+
+bool Benchmark::WriteCSV(std::ostream &out) const
+{
+	if (m_frameTimes.empty())
+		return false;
+
+	out << "scene,device,width,height,frames,stage,median_ms,p95_ms,min_ms,primary_rays_per_second" << std::endl;
+	std::string prefix = QuoteCSV(m_scene) + "," + QuoteCSV(m_device) + "," + std::to_string(m_width) + "," +
+		std::to_string(m_height) + ",";
+
+	/* the primary rays per second of the whole frame and of the kernels tracing it, empty on the other stages.
+		frames is the amount of frames where the stage ran */
+	Statistics frame = ComputeStatistics(m_frameTimes);
+	out << prefix << m_frameTimes.size() << ",Frame," << frame.median << "," << frame.p95 << "," << frame.min << "," <<
+		RaysPerSecond(frame.median) << std::endl;
+	for (int s = 0; s < ProfilingStageCount; s++)
+	{
+		if (m_stageTimes[s].empty())
+			continue;
+
+		Statistics stage = ComputeStatistics(m_stageTimes[s]);
+		out << prefix << m_stageTimes[s].size() << "," << OCLContext::GetProfilingStageName((ProfilingStage)s) << "," <<
+			stage.median << "," << stage.p95 << "," << stage.min << ",";
+		if (s == RaytraceStage)
+			out << RaysPerSecond(stage.median);
+		out << std::endl;
+	}
+
+	return true;
+}
+
+bool Benchmark::WriteJSON(std::ostream &out) const
+{
+	if (m_frameTimes.empty())
+		return false;
+
+	Statistics frame = ComputeStatistics(m_frameTimes);
+	out << "{" << std::endl;
+	out << "\t\"scene\": " << QuoteJSON(m_scene) << "," << std::endl;
+	out << "\t\"device\": " << QuoteJSON(m_device) << "," << std::endl;
+	out << "\t\"width\": " << m_width << "," << std::endl;
+	out << "\t\"height\": " << m_height << "," << std::endl;
+	out << "\t\"frames\": " << m_frameTimes.size() << "," << std::endl;
+	out << "\t\"primary_rays_per_frame\": " << m_raysPerFrame << "," << std::endl;
+	out << "\t\"primary_rays_per_second\": " << RaysPerSecond(frame.median) << "," << std::endl;
+	out << "\t\"stages\": [" << std::endl;
+	out << "\t\t{ \"stage\": \"Frame\", \"frames\": " << m_frameTimes.size() << ", \"median_ms\": " << frame.median <<
+		", \"p95_ms\": " << frame.p95 << ", \"min_ms\": " << frame.min << " }";
+	for (int s = 0; s < ProfilingStageCount; s++)
+	{
+		if (m_stageTimes[s].empty())
+			continue;
+
+		Statistics stage = ComputeStatistics(m_stageTimes[s]);
+		out << "," << std::endl << "\t\t{ \"stage\": " << QuoteJSON(OCLContext::GetProfilingStageName((ProfilingStage)s)) <<
+			", \"frames\": " << m_stageTimes[s].size() << ", \"median_ms\": " << stage.median << ", \"p95_ms\": " <<
+			stage.p95 << ", \"min_ms\": " << stage.min;
+		if (s == RaytraceStage)
+			out << ", \"primary_rays_per_second\": " << RaysPerSecond(stage.median);
+		out << " }";
+	}
+	out << std::endl << "\t]" << std::endl;
+	out << "}" << std::endl;
+
+	return true;
+}
@@ -0,0 +1,73 @@
+/*
+	RenderGirl - OpenCL raytracer renderer
+	Copyright (c) 2016, Henrique Jung, All rights reserved.
+
+	This program is free software; you can redistribute it and/or
+	modify it under the terms of the GNU Lesser General Public
+	License as published by the Free Software Foundation; either
+	version 3.0 of the License, or any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+	Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public
+	License along with this program.
+*/
+
+#ifndef __RENDERGIRLCONSOLE_BENCHMARK__
+#define __RENDERGIRLCONSOLE_BENCHMARK__
+
+#include <string>
+#include <vector>
+#include <ostream>
+
+#include "RenderGirlCore.h"
+
+/* Times of the frames rendered by a benchmark run and the report of their statistics. Each frame has the time the
+	host waited for it and the time the device was busy on each stage of the pipeline, see SetProfiling */
+class Benchmark
+{
+public:
+	/* raysPerFrame is the amount of primary rays traced on each frame, used for the rays per second. Shadow
+		rays are left out, their amount depends on the hits of each frame */
+	Benchmark(const std::string &scene, const std::string &device, const int width, const int height, const long long raysPerFrame);
+
+	/* Add a frame measured, frameTime in milliseconds */
+	void AddFrame(const double frameTime, const FrameTiming &timing);
+
+	/* Write the median, the 95th percentile and the minimum time of the frames and of each stage as CSV, one line
+		for each, with a header line. The statistics of a stage only cover the frames where it ran, and
+		their amount is on the frames column. Return FALSE if there are no frames */
+	bool WriteCSV(std::ostream &out) const;
+
+	/* Same as WriteCSV, as a JSON object */
+	bool WriteJSON(std::ostream &out) const;
+
+private:
+	struct Statistics
+	{
+		double median;
+		double p95;
+		double min;
+	};
+
+	// times in milliseconds, sorted on a copy
+	static Statistics ComputeStatistics(std::vector<double> times);
+
+	// primary rays per second at time in milliseconds, 0 if time is 0
+	double RaysPerSecond(const double time) const;
+
+	std::string m_scene;
+	std::string m_device;
+	int m_width;
+	int m_height;
+	long long m_raysPerFrame;
+
+	// times of the frames in milliseconds, and of each stage on the device on the frames it had commands
+	std::vector<double> m_frameTimes;
+	std::vector<double> m_stageTimes[ProfilingStageCount];
+};
+
+#endif // __RENDERGIRLCONSOLE_BENCHMARK__
@@ -18,61 +18,366 @@
 
 
 
-/* 
+/*
 	RenderGirlConsole is an interface for RenderGirl that does not contain any GUI elements
 	and it's suppose to be clean and simple. There's no image output.
-	
-	It's also useful to capture printf from the kernel on Intel platforms 
+
+	It renders a scene several times without asking anything and reports how long the frames took,
+	so the performance of a fixed set of scenes can be tracked across releases. The report goes to the
+	standard output, or to a file, and the log goes to the standard error. It fails if rendering again
+	creates memory objects, or if a smaller frame creates more than the ones sized by the frame.
+
+	It's also useful to capture printf from the kernel on Intel platforms
 	(outputed to stdout)
+
+	Run it without arguments for the options. Instead of an OBJ file it can render one of the scenes
+	generated by SceneGenerator.h at any size, like -generate plane:1M for a plane of a million faces.
+	The camera file has one line for each of the vectors it sets, the missing ones keep the default
+	camera, or the camera of the generated scene:
+		pos 0 0 -10
+		lookAt 0 0 0
+		up 0 1 0
+		light 1 1 -10
 */
 
 #include <vector>
 #include <iostream>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <algorithm>
 
 #include "RenderGirlCore.h"
 #include "OBJLoader.h"
+#include "Benchmark.h"
 
 
 class LogOutput : public LogListener
 {
 public:
+	/* the standard output is for the report */
 	void PrintLog(const char * message)
 	{
-		std::cout << message << std::endl;
+		std::cerr << message << std::endl;
 	}
 	void PrintError(const char * error)
 	{
-		std::cout << error << std::endl;
+		std::cerr << error << std::endl;
 	}
 };
 
-int main()
+/* what the benchmark renders and how, see PrintUsage */
+struct Options
 {
-	// register log class
-	LogOutput* listenerOutput = new LogOutput();
-	Log::AddListener(listenerOutput);
+	std::string scene; // the OBJ file, or name:size of a generated scene
+	bool generate;
+	StressScene generatedScene;
+	int generatedSize;
+	std::string cameraPath;
+	std::string outputPath;
+	std::string format;
+	std::string tracePath;
+	std::string costPath;
+	int width;
+	int height;
+	int platform;
+	int device;
+	int warmup;
+	int iterations;
+	BVHLayout layout;
+	bool shadows;
+	bool fxaa;
+	int tileWidth; // -1 keeps the tile size of the renderer
+	int tileHeight;
+	bool listDevices;
+};
 
+static void PrintUsage()
+{
+	std::cerr << "Usage: RenderGirlConsole -scene file.obj [options]" << std::endl <<
+		"       RenderGirlConsole -generate name:size [options]" << std::endl <<
+		"  -generate name:size  render a generated scene instead of a file, size may end in k or M:" << std::endl <<
+		"                       spheres:N  N instances of a sphere of 1104 faces" << std::endl <<
+		"                       plane:N    a plane of N faces" << std::endl <<
+		"                       box:N      a hall crowded with thin columns and sheets, N faces" << std::endl <<
+		"                       slivers:N  N long thin faces crossing the center, all overlapping" << std::endl <<
+		"                       layers:N   N faces stacked at almost the same depth" << std::endl <<
+		"  -resolution WxH      size of the frames, 256x256 by default" << std::endl <<
+		"  -camera file         camera and light, see the top of Console/Main.cpp" << std::endl <<
+		"  -platform N          index of the OpenCL platform, 0 by default" << std::endl <<
+		"  -device N            index of the device on the platform, 0 by default" << std::endl <<
+		"  -list                list the platforms and devices and quit" << std::endl <<
+		"  -warmup N            frames rendered before the measured ones, 2 by default" << std::endl <<
+		"  -iterations N        frames measured, 10 by default" << std::endl <<
+		"  -layout name         stackless, ordered, wide or compressed BVH, stackless by default" << std::endl <<
+		"  -shadows             trace shadow rays" << std::endl <<
+		"  -fxaa                anti-alias the frames with FXAA" << std::endl <<
+		"  -tile WxH            pixels of each work-group, 0x0 lets OpenCL choose" << std::endl <<
+		"  -format csv|json     format of the report, csv by default" << std::endl <<
+		"  -output file         write the report there instead of the standard output" << std::endl <<
+		"  -trace file.json     write a timeline of the whole run, open it with chrome://tracing" << std::endl <<
+		"  -cost file           write the traversal cost of each pixel of the last frame, one pixel" << std::endl <<
+		"                       per line as \"x y nodes_visited faces_tested\"" << std::endl;
+}
 
-	// calls for the singleton RenderGirlShared for the first time, creating it
+/* read WxH into width and height */
+static bool ParseSize(const std::string &text, int &width, int &height)
+{
+	return sscanf(text.c_str(), "%dx%d", &width, &height) == 2 && width >= 0 && height >= 0;
+}
+
+/* read name:size of a generated scene, the size may end in k or M for thousands or millions */
+static bool ParseGeneratedScene(const std::string &text, StressScene &scene, int &size)
+{
+	size_t colon = text.find(':');
+	if (colon == std::string::npos || !FindStressScene(text.substr(0, colon), scene))
+		return false;
+
+	const char* number = text.c_str() + colon + 1;
+	char* end;
+	double amount = strtod(number, &end);
+	if (end == number)
+		return false;
+	if (*end == 'k' || *end == 'K')
+	{
+		amount *= 1000.0;
+		end++;
+	}
+	else if (*end == 'm' || *end == 'M')
+	{
+		amount *= 1000000.0;
+		end++;
+	}
+	// nothing may follow the suffix
+	if (*end != '\0')
+		return false;
+
+	// written this way so NaN fails too
+	if (!(amount >= 1.0 && amount <= 2147483647.0))
+		return false;
+	size = (int)amount;
+	return true;
+}
+
+/* Return FALSE if an option is wrong, after telling which one */
+static bool ParseOptions(int argc, char* argv[], Options &options)
+{
+	options.format = "csv";
+	options.width = options.height = 256;
+	options.platform = options.device = 0;
+	options.warmup = 2;
+	options.iterations = 10;
+	options.layout = StacklessLayout;
+	options.shadows = options.fxaa = options.listDevices = false;
+	options.tileWidth = options.tileHeight = -1;
+	options.generate = false;
+
+	for (int a = 1; a < argc; a++)
+	{
+		std::string option = argv[a];
+		/* options without a value */
+		if (option == "-shadows")
+		{
+			options.shadows = true;
+			continue;
+		}
+		if (option == "-fxaa")
+		{
+			options.fxaa = true;
+			continue;
+		}
+		if (option == "-list")
+		{
+			options.listDevices = true;
+			continue;
+		}
+
+		if (a + 1 >= argc)
+		{
+			std::cerr << "Missing the value of " << option << std::endl;
+			return false;
+		}
+		std::string value = argv[++a];
+		bool ok = true;
+
+		if (option == "-scene")
+		{
+			options.scene = value;
+			options.generate = false;
+		}
+		else if (option == "-generate")
+		{
+			options.scene = value;
+			options.generate = true;
+			ok = ParseGeneratedScene(value, options.generatedScene, options.generatedSize);
+		}
+		else if (option == "-camera")
+			options.cameraPath = value;
+		else if (option == "-output")
+			options.outputPath = value;
+		else if (option == "-trace")
+			options.tracePath = value;
+		else if (option == "-cost")
+			options.costPath = value;
+		else if (option == "-format")
+		{
+			options.format = value;
+			ok = value == "csv" || value == "json";
+		}
+		else if (option == "-resolution")
+			ok = ParseSize(value, options.width, options.height) && options.width > 0 && options.height > 0;
+		else if (option == "-tile")
+			ok = ParseSize(value, options.tileWidth, options.tileHeight);
+		else if (option == "-platform")
+			ok = sscanf(value.c_str(), "%d", &options.platform) == 1 && options.platform >= 0;
+		else if (option == "-device")
+			ok = sscanf(value.c_str(), "%d", &options.device) == 1 && options.device >= 0;
+		else if (option == "-warmup")
+			ok = sscanf(value.c_str(), "%d", &options.warmup) == 1 && options.warmup >= 0;
+		else if (option == "-iterations")
+			ok = sscanf(value.c_str(), "%d", &options.iterations) == 1 && options.iterations > 0;
+		else if (option == "-layout")
+		{
+			if (value == "stackless")
+				options.layout = StacklessLayout;
+			else if (value == "ordered")
+				options.layout = OrderedLayout;
+			else if (value == "wide")
+				options.layout = WideLayout;
+			else if (value == "compressed")
+				options.layout = CompressedLayout;
+			else
+				ok = false;
+		}
+		else
+		{
+			std::cerr << "Unknown option " << option << std::endl;
+			return false;
+		}
+
+		if (!ok)
+		{
+			std::cerr << "Invalid value " << value << " for " << option << std::endl;
+			return false;
+		}
+	}
+
+	if (options.scene.empty() && !options.listDevices)
+		return false;
+
+	return true;
+}
+
+/* Read the vectors given by the camera file over the default ones, return FALSE if it can't be read */
+static bool LoadCamera(const std::string &path, Camera &camera, Light &light)
+{
+	std::ifstream file(path.c_str());
+	if (!file)
+	{
+		std::cerr << "Couldn't open the camera file " << path << std::endl;
+		return false;
+	}
+
+	std::string line;
+	while (std::getline(file, line))
+	{
+		std::istringstream fields(line);
+		std::string name;
+		float x, y, z;
+		if (!(fields >> name) || name[0] == '#')
+			continue; // empty line or comment
+		if (!(fields >> x >> y >> z))
+		{
+			std::cerr << "Invalid line on the camera file: " << line << std::endl;
+			return false;
+		}
+
+		cl_float3* vector;
+		if (name == "pos")
+			vector = &camera.pos;
+		else if (name == "lookAt")
+			vector = &camera.lookAt;
+		else if (name == "up")
+			vector = &camera.up;
+		else if (name == "light")
+			vector = &light.pos;
+		else
+		{
+			std::cerr << "Unknown vector " << name << " on the camera file" << std::endl;
+			return false;
+		}
+		vector->s[0] = x;
+		vector->s[1] = y;
+		vector->s[2] = z;
+	}
+
+	return true;
+}
+
+/* Write the nodes visited and the faces tested on each pixel of the last frame */
+static bool WriteTraversalCost(const std::string &path, const cl_uint2* cost, const int width, const int height)
+{
+	std::ofstream costFile(path.c_str());
+	for (int y = 0; y < height; y++)
+	{
+		for (int x = 0; x < width; x++)
+		{
+			const cl_uint2 &pixel = cost[y * width + x];
+			costFile << x << " " << y << " " << pixel.s[0] << " " << pixel.s[1] << "\n";
+		}
+	}
+
+	if (!costFile)
+	{
+		std::cerr << "Couldn't write the traversal cost to " << path << std::endl;
+		return false;
+	}
+	return true;
+}
+
+/* Render one more frame at half the resolution. Only the buffers sized by the frame must be created again:
+	the frame itself, the anti-aliased frame and the traversal cost. Return FALSE if there were others */
+static bool CheckResizeAllocations(const Options &options, const Camera &camera, const Light &light)
+{
 	RenderGirlShared& shared = RenderGirlShared::GetRenderGirlShared();
-	SceneManager& scene_m = SceneManager::GetSharedManager();
+	int width = std::max(options.width / 2, 1);
+	int height = std::max(options.height / 2, 1);
+	if (width == options.width && height == options.height)
+		return true;
 
-	/* Just search for OpenCL capable devices on all platforms */
-	shared.InitPlatforms();
-	shared.InitDevices();
+	int expected = 1 + (options.fxaa ? 1 : 0) + (options.costPath.empty() ? 0 : 1);
+	int allocations = shared.GetAllocationCount();
+	Camera frameCamera = camera;
+	Light frameLight = light;
+	if (!shared.Render(width, height, frameCamera, frameLight, options.fxaa ? FXAA : noAA))
+		return false;
+	int created = shared.GetAllocationCount() - allocations;
+	if (created != expected)
+	{
+		Log::Error("Resizing the frame created " + std::to_string(created) + " memory objects instead of " +
+			std::to_string(expected));
+		return false;
+	}
+	return true;
+}
+
+/* Render the frames of the benchmark and write the report, return FALSE for an error */
+static bool RunBenchmark(const Options &options, const OCLDevice* device)
+{
+	RenderGirlShared& shared = RenderGirlShared::GetRenderGirlShared();
+	SceneManager& scene_m = SceneManager::GetSharedManager();
 
 	/* Fill up camera information */
 	Camera camera;
-	camera.pos.s[0] = camera.lookAt.s[1] = 0.0;
+	memset(&camera, 0, sizeof(Camera));
 	camera.pos.s[2] = -10.0;
-	camera.lookAt.s[0] = camera.lookAt.s[1] = camera.lookAt.s[2] = 0.0;
 
 	// set up vector to the be just pointing up
-	camera.up.s[0] = 0.0;
 	camera.up.s[1] = 1.0;
-	camera.up.s[2] = 0.0;
+	camera.from_lookAt = true;
 
 	Light light;
+	memset(&light, 0, sizeof(Light));
 	light.pos.s[0] = light.pos.s[1] = 1.0;
 	light.pos.s[2] = -10.0;
 
@@ -81,38 +386,144 @@ int main()
 	light.Ks = 0.2;
 	light.Ka = 0.0;
 
-	// select list of platforms
-	std::vector<OCLPlatform*> platforms = shared.ReturnPlatforms();
-	// get first device on first platform
-	std::vector<OCLDevice*> devices = platforms[0]->GetDevices();
-	shared.SelectDevice(devices[0]);
+	if (!shared.SelectDevice(device))
+		return false;
+	// the time of each stage of the frames comes from the profiling of the commands
+	shared.SetProfiling(true);
 	// load kernel code and compile raytracer
-	shared.PrepareRaytracer();
+	if (!shared.PrepareRaytracer(false, options.layout, options.shadows))
+		return false;
+	if (options.tileWidth >= 0)
+		shared.SetTileSize(options.tileWidth, options.tileHeight);
+	shared.SetTraversalCost(!options.costPath.empty());
+
+	if (options.generate)
+	{
+		if (!scene_m.GenerateScene(options.generatedScene, options.generatedSize, camera, light))
+			return false;
+	}
+	// using the provided OBJ loader
+	else if (!scene_m.LoadSceneFromOBJ(options.scene))
+	{
+		std::cerr << "The program can't load the scene located at " << options.scene << std::endl;
+		return false;
+	}
+
+	// the camera file goes over the camera of a generated scene
+	if (!options.cameraPath.empty() && !LoadCamera(options.cameraPath, camera, light))
+		return false;
+
+	AntiAliasingMethod AA = options.fxaa ? FXAA : noAA;
+	/* the first frames build the BVH and upload the scene */
+	for (int f = 0; f < options.warmup; f++)
+	{
+		Camera frameCamera = camera;
+		if (!shared.Render(options.width, options.height, frameCamera, light, AA))
+			return false;
+	}
+
+	/* every buffer is in place after the first frame, the next ones must not create any */
+	int allocations = options.warmup > 0 ? shared.GetAllocationCount() : -1;
+	Benchmark benchmark(options.scene, device->GetName(), options.width, options.height, (long long)options.width * options.height);
+	for (int f = 0; f < options.iterations; f++)
+	{
+		Camera frameCamera = camera; // Render changes the camera
+		auto start = std::chrono::high_resolution_clock::now();
+		if (!shared.Render(options.width, options.height, frameCamera, light, AA))
+			return false;
+		std::chrono::duration<double, std::milli> frameTime = std::chrono::high_resolution_clock::now() - start;
+
+		benchmark.AddFrame(frameTime.count(), shared.GetFrameTiming());
+		if (allocations < 0)
+			allocations = shared.GetAllocationCount();
+	}
 
-	std::string path;
+	if (shared.GetAllocationCount() != allocations)
+	{
+		Log::Error("Rendering the same scene again created " + std::to_string(shared.GetAllocationCount() - allocations) +
+			" memory objects");
+		return false;
+	}
 
-	std::cout << "Please type the path of an OBJ file: ";
-	std::cin >> path;
-	
+	if (shared.GetTraversalCost() != NULL && !WriteTraversalCost(options.costPath, shared.GetTraversalCost(), options.width, options.height))
+		return false;
 
-	if (!path.empty())
+	if (!CheckResizeAllocations(options, camera, light))
+		return false;
+
+	std::ofstream outputFile;
+	if (!options.outputPath.empty())
 	{
-		// using the provided OBJ loader
-		if (scene_m.LoadSceneFromOBJ(path))
+		outputFile.open(options.outputPath.c_str());
+		if (!outputFile)
 		{
-			// call the render function
-			shared.Render(256, 256, camera, light);
+			std::cerr << "Couldn't write the report to " << options.outputPath << std::endl;
+			return false;
 		}
-		else
+	}
+	std::ostream &output = options.outputPath.empty() ? std::cout : outputFile;
+
+	if (options.format == "json")
+		return benchmark.WriteJSON(output);
+	return benchmark.WriteCSV(output);
+}
+
+int main(int argc, char* argv[])
+{
+	Options options;
+	if (!ParseOptions(argc, argv, options))
+	{
+		PrintUsage();
+		return 1;
+	}
+
+	// register log class
+	LogOutput* listenerOutput = new LogOutput();
+	Log::AddListener(listenerOutput);
+
+	if (!options.tracePath.empty())
+		Trace::Start();
+
+	// calls for the singleton RenderGirlShared for the first time, creating it
+	RenderGirlShared& shared = RenderGirlShared::GetRenderGirlShared();
+
+	/* Just search for OpenCL capable devices on all platforms */
+	shared.InitPlatforms();
+	shared.InitDevices();
+
+	// select list of platforms
+	std::vector<OCLPlatform*> platforms = shared.ReturnPlatforms();
+	if (options.listDevices)
+	{
+		for (unsigned int p = 0; p < platforms.size(); p++)
 		{
-			std::cout << "The program can't find the file located at " << path << std::endl;
+			std::vector<OCLDevice*> devices = platforms[p]->GetDevices();
+			for (unsigned int d = 0; d < devices.size(); d++)
+				std::cout << "-platform " << p << " -device " << d << ": " << devices[d]->GetName() << std::endl;
 		}
+		Log::RemoveAllListeners();
+		return 0;
+	}
+
+	int result = 1;
+	if (options.platform >= (int)platforms.size() || options.device >= (int)platforms[options.platform]->GetDevices().size())
+	{
+		std::cerr << "There's no device " << options.device << " on the platform " << options.platform <<
+			", use -list to see the devices" << std::endl;
+	}
+	else if (RunBenchmark(options, platforms[options.platform]->GetDevices()[options.device]))
+	{
+		result = 0;
 	}
 
+	if (!options.tracePath.empty())
+		Trace::Stop(options.tracePath);
+
 	// dealloc the OpenCL driver and all memory used in the process.
-	shared.ReleaseDevice();
+	if (shared.GetSelectedDevice() != NULL)
+		shared.ReleaseDevice();
 
 	Log::RemoveAllListeners();
 
-	return 0;
-}
\ No newline at end of file
+	return result;
+}
@@ -33,6 +33,19 @@ AABB::AABB(const std::vector<cl_float3>& vertices)
 	this->Create(vertices);
 }
 
+AABB::AABB(const cl_float3& v1, const cl_float3& v2, const cl_float3& v3)
+{
+	m_point_max.s[0] = std::max(v1.s[0], std::max(v2.s[0], v3.s[0]));
+	m_point_max.s[1] = std::max(v1.s[1], std::max(v2.s[1], v3.s[1]));
+	m_point_max.s[2] = std::max(v1.s[2], std::max(v2.s[2], v3.s[2]));
+
+	m_point_min.s[0] = std::min(v1.s[0], std::min(v2.s[0], v3.s[0]));
+	m_point_min.s[1] = std::min(v1.s[1], std::min(v2.s[1], v3.s[1]));
+	m_point_min.s[2] = std::min(v1.s[2], std::min(v2.s[2], v3.s[2]));
+
+	this->ComputeCenter();
+}
+
 AABB AABB::operator+(const AABB& other) const
 {
 	AABB result;
@@ -32,6 +32,9 @@ public:
 	/* Constructor that also generated the AABB itself (same as create function) */
 	AABB(const std::vector<cl_float3>& vertices);
 
+	/* Constructor that generates the AABB of a single triangle */
+	AABB(const cl_float3& v1, const cl_float3& v2, const cl_float3& v3);
+
 	~AABB();
 
 	/* Join two AABB together and the resulting AABB can fit both */
@@ -53,6 +56,15 @@ public:
 		return m_center;
 	}
 
+	/* Return the surface area of this AABB */
+	inline float GetSurfaceArea() const
+	{
+		float x = m_point_max.s[0] - m_point_min.s[0];
+		float y = m_point_max.s[1] - m_point_min.s[1];
+		float z = m_point_max.s[2] - m_point_min.s[2];
+		return 2.0f * (x * y + y * z + z * x);
+	}
+
 private:
 	/* the maxium XYZ from all vertices of a given object */
 	cl_float3 m_point_min;
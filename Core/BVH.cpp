@@ -17,6 +17,23 @@
 */
 
 #include "BVH.h"
+#include "SceneGroup.h"
+#include "TaskPool.h"
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include <queue>
+
+/* amount of bins used on each axis by the binned SAH */
+static const int s_sahBins = 16;
+/* relative cost of testing a ray against a node and against a primitive */
+static const float s_traversalCost = 1.0f;
+static const float s_intersectionCost = 1.0f;
+/* ranges with at least this amount of primitives have their left child built by another thread */
+static const int s_parallelSubtreeSize = 4096;
+/* ranges with at least this amount of primitives have their bounds, bins and partition
+ * computed by several threads, this only happens on the top levels of the tree */
+static const int s_parallelRangeSize = 65536;
 
 
 BVH::BVH()
@@ -24,8 +41,11 @@ BVH::BVH()
 	m_left = nullptr;
 	m_right = nullptr;
 	m_object_index = -1;
+	m_first = -1;
+	m_count = 0;
 	m_x_split = true; /* root node will perform an X split */
 	nodes_amount = 1; /* this BVH has at least its own node */
+	leaves_amount = 0;
 }
 
 
@@ -37,87 +57,424 @@ BVH::~BVH()
 		delete m_right;
 }
 
-AABB BVH::Create(const std::vector<SceneGroup*>& objects, std::vector<int>& objects_index)
+AABB BVH::Create(const std::vector<SceneGroup*>& objects, const std::vector<AABB>& instances,
+	std::vector<int>& objects_index, const BVHBuildMethod method)
+{
+	/* at the object level every primitive is a whole SceneGroup or an instance of one,
+	 * so we build the list of primitives from their AABBs. Groups that are only 
+	 * rendered through their instances are not on objects_index */
+	std::vector<AABB> primitives(objects.size() + instances.size());
+	for (int i = 0; i < objects_index.size(); i++)
+	{
+		int index = objects_index[i];
+		primitives[index] = index < objects.size() ? 
+			objects[index]->GetAABB() : instances[index - objects.size()];
+	}
+
+	/* leaves of the object level will be replaced by the triangle level
+	 * BVH of each group, so each one of them must hold a single object */
+	return this->Create(primitives, objects_index, 0, objects_index.size(), 1, method);
+}
+
+AABB BVH::Create(const std::vector<AABB>& primitives, std::vector<int>& primitives_index,
+	const int start, const int end, const int max_leaf_size, const BVHBuildMethod method)
 {
 	/* 
 	
-	This function implements the partitioning scheme proposed by Kay and Kajiya
-	in their paper "Ray Tracing Complex Scenes" (1986). At each level, objects 
-	are sorted either by their X position or Y position. From this sorted list, 
-	we split the objects in half, and each of the two subsets of objects are
-	send to the child nodes (two new BVH objects) until it reaches a BVH that
-	has only one object (a leaf node).
+	The primitives covered by this node are split in two subsets, each one of them
+	is send to the child nodes (two new BVH objects) until it reaches a BVH that
+	should not be split any further (a leaf node). The split itself is performed 
+	by SplitMedian or SplitBinnedSAH, depending on the method.
+
+	The split is done in place over primitives_index, so when the construction
+	is over the primitives of each leaf node are contiguous on that vector.
 
 	*/
 
-	assert(objects_index.size() > 0 && "At lest one object is necessary");
+	assert(end - start > 0 && "At lest one primitive is necessary");
+	assert(max_leaf_size > 0 && "Leaf nodes must hold at least one primitive");
 	assert(m_left == nullptr && "BVH can only be created once");
 	assert(m_right == nullptr && "BVH can only be created once");
 
+	int split = -1;
+	if (method == BinnedSAH)
+	{
+		if (end - start > 1)
+			split = this->SplitBinnedSAH(primitives, primitives_index, start, end, max_leaf_size);
+	}
+	else if (end - start > max_leaf_size)
+	{
+		split = this->SplitMedian(primitives, primitives_index, start, end);
+	}
 
-	/* if we have more than one object on this vector, it means we are not
+	/* if the primitives were split, it means we are not
 		on a leaf node and the BVH contruction must preceed downwards */
-	if (objects_index.size() > 1)
+	if (split != -1)
 	{
 		m_left = new BVH();
 		m_right = new BVH();
 
-		/* sort objects_index */
-		if (m_x_split)
+		/* next split alternates the axis (only used by the median split) */
+		m_left->m_x_split = !m_x_split;
+		m_right->m_x_split = !m_x_split;
+
+		/* generate the two child nodes */
+		AABB left_aabb;
+		AABB right_aabb;
+
+		/* the child nodes work on disjoint ranges of primitives_index, so big subtrees can be
+		 * built in parallel. The resulting tree does not depend on the amount of threads */
+		if (end - start >= s_parallelSubtreeSize)
 		{
-			/* this is a root node or middle node with an X split, 
-			 * so we must sort the objects in objects_index vector in X position */
-			std::sort(objects_index.begin(), objects_index.end(), 
-				[&](const int a, const int b)
+			TaskPool& pool = TaskPool::GetSharedPool();
+			TaskGroup group;
+			pool.Run(group, [&]()
 			{
-				return objects[a]->GetAABB().GetCenterPoint().s[0] < 
-					objects[b]->GetAABB().GetCenterPoint().s[0];
+				left_aabb = m_left->Create(primitives, primitives_index, start, split, max_leaf_size, method);
 			});
-			/* next split is an Y split */
-			m_left->m_x_split = false;
-			m_right->m_x_split = false;
+			right_aabb = m_right->Create(primitives, primitives_index, split, end, max_leaf_size, method);
+			pool.Wait(group);
 		}
 		else
 		{
-			/* this is a middle node with an Y split,
-		     * so we must sort the objects in objects_index vector in Y position */
-			std::sort(objects_index.begin(), objects_index.end(),
-				[&](const int a, const int b)
-			{
-				return objects[a]->GetAABB().GetCenterPoint().s[1] <
-					objects[b]->GetAABB().GetCenterPoint().s[1];
-			});
-			/* next split is an X split, so no action must be done on m_left and m_right */
+			left_aabb = m_left->Create(primitives, primitives_index, start, split, max_leaf_size, method);
+			right_aabb = m_right->Create(primitives, primitives_index, split, end, max_leaf_size, method);
 		}
 
-		/* time for split the objects */
-		std::size_t half_size = objects_index.size() / 2;
-		std::vector<int> left_objects(objects_index.begin(), objects_index.begin() + half_size);
-		std::vector<int> right_objects(objects_index.begin() + half_size, objects_index.end());
-
-		/* generate the two child nodes */
-		AABB left_aabb;
-		AABB right_aabb;
-
-		left_aabb = m_left->Create(objects, left_objects);
-		right_aabb = m_right->Create(objects, right_objects);
-
 		/* combining the two childs node AABBs yields an AABB fiting all geometry of this level */
 		m_aabb = left_aabb + right_aabb;
 		nodes_amount = m_left->nodes_amount + m_right->nodes_amount + 1; /* +1 for this own node */
+		leaves_amount = m_left->leaves_amount + m_right->leaves_amount;
 	}
 
-	else // this is a leaf node, m_object_index is valid
+	else // this is a leaf node, m_first and m_count are valid
 	{
-		m_object_index = objects_index[0];
+		m_first = start;
+		m_count = end - start;
+		m_object_index = primitives_index[start];
+		leaves_amount = 1;
+
 		/* get AABB and return it to parent node */
-		m_aabb = objects[m_object_index]->GetAABB();
+		m_aabb = primitives[primitives_index[start]];
+		for (int i = start + 1; i < end; i++)
+		{
+			m_aabb = m_aabb + primitives[primitives_index[i]];
+		}
 	}
 
 	return m_aabb;
 }
 
-void BVH::BuildTraversal(BVHTreeNode* traversal_array, int& offset)const
+int BVH::SplitMedian(const std::vector<AABB>& primitives, std::vector<int>& primitives_index,
+	const int start, const int end)
+{
+	/*
+
+	This function implements the partitioning scheme proposed by Kay and Kajiya
+	in their paper "Ray Tracing Complex Scenes" (1986). At each level, primitives
+	are sorted either by their X position or Y position. From this sorted list,
+	we split the primitives in half.
+
+	*/
+
+	/* this is a root node or middle node with an X split, so we must sort the 
+	 * primitives in X position, otherwise it's an Y split. Only the median matters,
+	 * so instead of sorting the whole range we just place the median at the middle */
+	int axis = m_x_split ? 0 : 1;
+	int middle = start + (end - start) / 2;
+	std::nth_element(primitives_index.begin() + start, primitives_index.begin() + middle,
+		primitives_index.begin() + end, [&](const int a, const int b)
+	{
+		return primitives[a].GetCenterPoint().s[axis] <
+			primitives[b].GetCenterPoint().s[axis];
+	});
+
+	/* time for split the primitives */
+	return middle;
+}
+
+/* bounds of a range of primitives and of their centroids */
+struct RangeBounds
+{
+	AABB aabb;
+	cl_float3 centroid_min;
+	cl_float3 centroid_max;
+};
+
+/* primitives projected into the bins of each axis */
+struct RangeBins
+{
+	int count[3][s_sahBins];
+	AABB aabb[3][s_sahBins];
+};
+
+static RangeBounds ComputeBounds(const std::vector<AABB>& primitives, const std::vector<int>& primitives_index,
+	const int start, const int end)
+{
+	RangeBounds bounds;
+	bounds.aabb = primitives[primitives_index[start]];
+	bounds.centroid_min = bounds.aabb.GetCenterPoint();
+	bounds.centroid_max = bounds.centroid_min;
+	for (int i = start + 1; i < end; i++)
+	{
+		const AABB& primitive = primitives[primitives_index[i]];
+		bounds.aabb = bounds.aabb + primitive;
+		cl_float3 center = primitive.GetCenterPoint();
+		for (int axis = 0; axis < 3; axis++)
+		{
+			bounds.centroid_min.s[axis] = std::min(bounds.centroid_min.s[axis], center.s[axis]);
+			bounds.centroid_max.s[axis] = std::max(bounds.centroid_max.s[axis], center.s[axis]);
+		}
+	}
+	return bounds;
+}
+
+static void MergeBounds(RangeBounds& bounds, const RangeBounds& other)
+{
+	bounds.aabb = bounds.aabb + other.aabb;
+	for (int axis = 0; axis < 3; axis++)
+	{
+		bounds.centroid_min.s[axis] = std::min(bounds.centroid_min.s[axis], other.centroid_min.s[axis]);
+		bounds.centroid_max.s[axis] = std::max(bounds.centroid_max.s[axis], other.centroid_max.s[axis]);
+	}
+}
+
+/* bin of a centroid on a given axis, scale is the amount of bins over the extent of the centroids */
+static inline int ComputeBin(const AABB& primitive, const RangeBounds& bounds, const int axis, const float scale)
+{
+	return std::min(s_sahBins - 1,
+		(int)((primitive.GetCenterPoint().s[axis] - bounds.centroid_min.s[axis]) * scale));
+}
+
+static void ComputeBins(const std::vector<AABB>& primitives, const std::vector<int>& primitives_index,
+	const int start, const int end, const RangeBounds& bounds, const float* scale, RangeBins& bins)
+{
+	memset(bins.count, 0, sizeof(bins.count));
+	for (int i = start; i < end; i++)
+	{
+		const AABB& primitive = primitives[primitives_index[i]];
+		for (int axis = 0; axis < 3; axis++)
+		{
+			if (scale[axis] == 0.0f)
+				continue;
+
+			int bin = ComputeBin(primitive, bounds, axis, scale[axis]);
+			bins.aabb[axis][bin] = bins.count[axis][bin] == 0 ? primitive : bins.aabb[axis][bin] + primitive;
+			bins.count[axis][bin]++;
+		}
+	}
+}
+
+static void MergeBins(RangeBins& bins, const RangeBins& other)
+{
+	for (int axis = 0; axis < 3; axis++)
+	{
+		for (int bin = 0; bin < s_sahBins; bin++)
+		{
+			if (other.count[axis][bin] == 0)
+				continue;
+
+			bins.aabb[axis][bin] = bins.count[axis][bin] == 0 ? 
+				other.aabb[axis][bin] : bins.aabb[axis][bin] + other.aabb[axis][bin];
+			bins.count[axis][bin] += other.count[axis][bin];
+		}
+	}
+}
+
+int BVH::SplitBinnedSAH(const std::vector<AABB>& primitives, std::vector<int>& primitives_index,
+	const int start, const int end, const int max_leaf_size)
+{
+	/*
+
+	This function implements the binned Surface Area Heuristic as described by Wald
+	in "On fast Construction of SAH-based Bounding Volume Hierarchies" (2007).
+	The centroids of the primitives are projected into a fixed amount of bins on
+	each axis, and the split planes between bins are evaluated using the cost
+	C = Ct + Ci * (A(left) * N(left) + A(right) * N(right)) / A(node).
+
+	On big ranges (top levels of the tree) the bounds, the bins and the partition are
+	computed in chunks by the TaskPool. The AABB unions and the bin counters are exact, 
+	and the partition is stable, so the result is the same as the one of a single thread.
+
+	*/
+
+	int count = end - start;
+	TaskPool& pool = TaskPool::GetSharedPool();
+	int chunks = count >= s_parallelRangeSize ? pool.GetThreadsAmount() : 1;
+
+	/* bounds of the primitives and of their centroids on this node */
+	RangeBounds bounds;
+	if (chunks > 1)
+	{
+		std::vector<RangeBounds> chunk_bounds(chunks);
+		pool.ParallelFor(start, end, chunks, [&](const int chunk, const int chunk_start, const int chunk_end)
+		{
+			chunk_bounds[chunk] = ComputeBounds(primitives, primitives_index, chunk_start, chunk_end);
+		});
+
+		bounds = chunk_bounds[0];
+		for (int chunk = 1; chunk < chunks; chunk++)
+		{
+			MergeBounds(bounds, chunk_bounds[chunk]);
+		}
+	}
+	else
+	{
+		bounds = ComputeBounds(primitives, primitives_index, start, end);
+	}
+
+	/* project primitives into the bins of every axis at once, axis where all 
+	 * centroids lie on the same plane have a scale of 0 and are not evaluated */
+	float scale[3];
+	for (int axis = 0; axis < 3; axis++)
+	{
+		float extent = bounds.centroid_max.s[axis] - bounds.centroid_min.s[axis];
+		scale[axis] = extent > 0.0f ? s_sahBins / extent : 0.0f;
+	}
+
+	RangeBins bins;
+	if (chunks > 1)
+	{
+		std::vector<RangeBins> chunk_bins(chunks);
+		pool.ParallelFor(start, end, chunks, [&](const int chunk, const int chunk_start, const int chunk_end)
+		{
+			ComputeBins(primitives, primitives_index, chunk_start, chunk_end, bounds, scale, chunk_bins[chunk]);
+		});
+
+		bins = chunk_bins[0];
+		for (int chunk = 1; chunk < chunks; chunk++)
+		{
+			MergeBins(bins, chunk_bins[chunk]);
+		}
+	}
+	else
+	{
+		ComputeBins(primitives, primitives_index, start, end, bounds, scale, bins);
+	}
+
+	float node_area = bounds.aabb.GetSurfaceArea();
+	float best_cost = std::numeric_limits<float>::max();
+	int best_axis = -1;
+	int best_bin = -1;
+
+	for (int axis = 0; axis < 3; axis++)
+	{
+		if (scale[axis] == 0.0f)
+			continue;
+
+		const int* bin_count = bins.count[axis];
+		const AABB* bin_aabb = bins.aabb[axis];
+
+		/* sweep from the right to compute the area and amount of primitives on the right of each plane */
+		float right_area[s_sahBins];
+		int right_count[s_sahBins];
+		AABB accumulated;
+		int accumulated_count = 0;
+		for (int bin = s_sahBins - 1; bin > 0; bin--)
+		{
+			if (bin_count[bin] > 0)
+			{
+				accumulated = accumulated_count == 0 ? bin_aabb[bin] : accumulated + bin_aabb[bin];
+				accumulated_count += bin_count[bin];
+			}
+			right_area[bin] = accumulated_count > 0 ? accumulated.GetSurfaceArea() : 0.0f;
+			right_count[bin] = accumulated_count;
+		}
+
+		/* sweep from the left evaluating the plane between bin - 1 and bin */
+		accumulated_count = 0;
+		for (int bin = 1; bin < s_sahBins; bin++)
+		{
+			if (bin_count[bin - 1] > 0)
+			{
+				accumulated = accumulated_count == 0 ? bin_aabb[bin - 1] : accumulated + bin_aabb[bin - 1];
+				accumulated_count += bin_count[bin - 1];
+			}
+
+			if (accumulated_count == 0 || right_count[bin] == 0)
+				continue; /* one of the sides would be empty */
+
+			float cost = s_traversalCost + s_intersectionCost * 
+				(accumulated.GetSurfaceArea() * accumulated_count + right_area[bin] * right_count[bin]) / node_area;
+			if (cost < best_cost)
+			{
+				best_cost = cost;
+				best_axis = axis;
+				best_bin = bin;
+			}
+		}
+	}
+
+	/* a leaf is an option only when the primitives fit inside it */
+	if (count <= max_leaf_size && (best_axis == -1 || s_intersectionCost * count <= best_cost))
+	{
+		return -1;
+	}
+
+	if (best_axis == -1)
+	{
+		/* every centroid is on the same point, any split is as good as another */
+		return start + count / 2;
+	}
+
+	/* partition primitives_index around the best plane */
+	std::vector<int>::iterator first = primitives_index.begin() + start;
+	if (chunks == 1)
+	{
+		std::vector<int>::iterator middle = std::stable_partition(first, primitives_index.begin() + end,
+			[&](const int a)
+		{
+			return ComputeBin(primitives[a], bounds, best_axis, scale[best_axis]) < best_bin;
+		});
+		return middle - primitives_index.begin();
+	}
+
+	/* parallel stable partition: each chunk counts how many of its primitives go to the left,
+	 * so every chunk knows where to write its primitives on both sides */
+	std::vector<int> left_count(chunks, 0);
+	std::vector<char> goes_left(count);
+	pool.ParallelFor(start, end, chunks, [&](const int chunk, const int chunk_start, const int chunk_end)
+	{
+		for (int i = chunk_start; i < chunk_end; i++)
+		{
+			goes_left[i - start] = ComputeBin(primitives[primitives_index[i]], 
+				bounds, best_axis, scale[best_axis]) < best_bin;
+			left_count[chunk] += goes_left[i - start];
+		}
+	});
+
+	std::vector<int> left_offset(chunks);
+	std::vector<int> right_offset(chunks);
+	int total_left = 0;
+	for (int chunk = 0; chunk < chunks; chunk++)
+	{
+		left_offset[chunk] = total_left;
+		total_left += left_count[chunk];
+	}
+	int total_right = total_left;
+	for (int chunk = 0; chunk < chunks; chunk++)
+	{
+		right_offset[chunk] = total_right;
+		total_right += (int)((long long)count * (chunk + 1) / chunks - (long long)count * chunk / chunks) - left_count[chunk];
+	}
+
+	std::vector<int> partitioned(count);
+	pool.ParallelFor(start, end, chunks, [&](const int chunk, const int chunk_start, const int chunk_end)
+	{
+		int left = left_offset[chunk];
+		int right = right_offset[chunk];
+		for (int i = chunk_start; i < chunk_end; i++)
+		{
+			partitioned[goes_left[i - start] ? left++ : right++] = primitives_index[i];
+		}
+	});
+	std::copy(partitioned.begin(), partitioned.end(), first);
+
+	return start + total_left;
+}
+
+void BVH::BuildTraversal(BVHTreeNode* traversal_array, int& offset, const std::vector<SceneGroup*>& objects,
+	const SceneGroupStruct* groups, const std::vector<int>& instances_group) const
 {
 	assert(traversal_array != nullptr && "Traversal array must be pre-allocated");
 	assert((m_left != nullptr || m_object_index != -1) &&
@@ -131,19 +488,70 @@ void BVH::BuildTraversal(BVHTreeNode* traversal_array, int& offset)const
 	* they describe traversal code for BVHs on GPUs.
 	*/
 
+	if (m_left == nullptr && m_object_index >= objects.size()) // this is a leaf of an instance
+	{
+		/* the BVH of the group is shared by all its instances, so it's stored 
+		 * apart and the leaf just points to the instance */
+		int instance_index = m_object_index - objects.size();
+		traversal_array[offset].aabb.point_max = m_aabb.GetMaxPoint();
+		traversal_array[offset].aabb.point_min = m_aabb.GetMinPoint();
+		traversal_array[offset].packet_indexes.s[1] = instance_index;
+		traversal_array[offset].leaf_info.s[0] = -1;
+		traversal_array[offset].leaf_info.s[1] = instances_group[instance_index];
+		traversal_array[offset].packet_indexes.s[0] = offset + 1; /* scape index */
+		offset++;
+		return;
+	}
+
+	if (m_left == nullptr) // this is a leaf node
+	{
+		/* the leaf is replaced by the triangle level BVH of the group, 
+		 * whose root node has the same AABB of this leaf */
+		const BVH* group_bvh = objects[m_object_index]->GetBVH();
+		group_bvh->BuildTraversal(traversal_array, offset, 
+			groups[m_object_index].facesStart, m_object_index);
+		return;
+	}
+
 	int local_offset = offset;
 	traversal_array[offset].aabb.point_max = m_aabb.GetMaxPoint();
 	traversal_array[offset].aabb.point_min = m_aabb.GetMinPoint();
+	traversal_array[local_offset].packet_indexes.s[1] = -1;
+	traversal_array[local_offset].leaf_info.s[0] = 0;
+	traversal_array[local_offset].leaf_info.s[1] = -1;
+
+	offset++;/* traversal resumes on the left node */
+	m_left->BuildTraversal(traversal_array, offset, objects, groups, instances_group);
 
-	if (m_object_index == -1) // this is a root or middle node
+	/* offset was modified by the left branch, now traversing through the right */
+	m_right->BuildTraversal(traversal_array, offset, objects, groups, instances_group);
+
+	/* offset after traversing the right branch  is the scape index */
+	traversal_array[local_offset].packet_indexes.s[0] = offset;
+}
+
+void BVH::BuildTraversal(BVHTreeNode* traversal_array, int& offset,
+	const int faces_start, const int group_index)const
+{
+	assert(traversal_array != nullptr && "Traversal array must be pre-allocated");
+	assert((m_left != nullptr || m_first != -1) &&
+		"Node must be a leaf, root or middle node. BVH was probably not generated");
+
+	int local_offset = offset;
+	traversal_array[offset].aabb.point_max = m_aabb.GetMaxPoint();
+	traversal_array[offset].aabb.point_min = m_aabb.GetMinPoint();
+
+	if (m_left != nullptr) // this is a root or middle node
 	{
 		traversal_array[local_offset].packet_indexes.s[1] = -1;
+		traversal_array[local_offset].leaf_info.s[0] = 0;
+		traversal_array[local_offset].leaf_info.s[1] = -1;
 
 		offset++;/* traversal resumes on the left node */
-		m_left->BuildTraversal(traversal_array, offset);
+		m_left->BuildTraversal(traversal_array, offset, faces_start, group_index);
 
 		/* offset was modified by the left branch, now traversing through the right */
-		m_right->BuildTraversal(traversal_array, offset);
+		m_right->BuildTraversal(traversal_array, offset, faces_start, group_index);
 		
 		/* offset after traversing the right branch  is the scape index */
 		traversal_array[local_offset].packet_indexes.s[0] = offset;
@@ -151,10 +559,439 @@ void BVH::BuildTraversal(BVHTreeNode* traversal_array, int& offset)const
 	}
 	else // this is a leaf node
 	{
-		traversal_array[local_offset].packet_indexes.s[1] = m_object_index;
+		/* faces of a leaf are contiguous inside the global faces buffer */
+		traversal_array[local_offset].packet_indexes.s[1] = faces_start + m_first;
+		traversal_array[local_offset].leaf_info.s[0] = m_count;
+		traversal_array[local_offset].leaf_info.s[1] = group_index;
 		traversal_array[local_offset].packet_indexes.s[0] = ++offset; /* scape index */
 		/* on leaf node the escape index is always offset + 1, but
 		 * we'll store it here for the sake of simplicity */
 
 	}
-}
\ No newline at end of file
+}
+
+/* compute the bounds of count faces starting at faces_start on the global faces buffer */
+static void FacesBounds(const cl_int3* faces, const cl_float3* vertices, const int faces_start, const int count,
+	cl_float3& point_min, cl_float3& point_max)
+{
+	point_min = vertices[faces[faces_start].s[0]];
+	point_max = point_min;
+	for (int f = faces_start; f < faces_start + count; f++)
+	{
+		for (int v = 0; v < 3; v++)
+		{
+			const cl_float3& vertex = vertices[faces[f].s[v]];
+			for (int axis = 0; axis < 3; axis++)
+			{
+				point_min.s[axis] = std::min(point_min.s[axis], vertex.s[axis]);
+				point_max.s[axis] = std::max(point_max.s[axis], vertex.s[axis]);
+			}
+		}
+	}
+}
+
+/* Visit the given nodes and all of their ancestors once each, from the last position to the first. 
+	Parents are always stored before their children, so a node is visited after all of its children
+	that changed. visited receives the nodes visited sorted by position */
+template <class Visit>
+static void VisitAncestors(const std::vector<int>& parents, const std::vector<int>& nodes, 
+	std::vector<int>& visited, Visit visit)
+{
+	std::priority_queue<int> pending(nodes.begin(), nodes.end());
+	visited.clear();
+	while (!pending.empty())
+	{
+		int node = pending.top();
+		pending.pop();
+		if (!visited.empty() && visited.back() == node)
+			continue; /* both children of the node changed */
+
+		visit(node);
+		visited.push_back(node);
+		if (parents[node] != -1)
+			pending.push(parents[node]);
+	}
+	std::reverse(visited.begin(), visited.end());
+}
+
+void BVH::FindParents(const BVHTreeNode* traversal_array, const int size, std::vector<int>& parents)
+{
+	assert(traversal_array != nullptr && size > 0);
+
+	/* the left child is the next node and the right child is at the escape index of the left one */
+	parents.assign(size, -1);
+	for (int i = 0; i < size; i++)
+	{
+		if (traversal_array[i].packet_indexes.s[1] != -1)
+			continue; // leaf node
+
+		parents[i + 1] = i;
+		parents[traversal_array[i + 1].packet_indexes.s[0]] = i;
+	}
+}
+
+void BVH::Refit(BVHTreeNode* traversal_array, const std::vector<int>& parents, const std::vector<int>& leaves,
+	const cl_int3* faces, const cl_float3* vertices, const std::vector<bool>& refit_groups, std::vector<int>& refitted)
+{
+	assert(traversal_array != nullptr);
+
+	VisitAncestors(parents, leaves, refitted, [&](const int i)
+	{
+		BVHTreeNode& node = traversal_array[i];
+		if (node.packet_indexes.s[1] != -1) // leaf node
+		{
+			if (node.leaf_info.s[0] < 0 || !refit_groups[node.leaf_info.s[1]])
+				return; /* an instance or a group that didn't move */
+
+			FacesBounds(faces, vertices, node.packet_indexes.s[1], node.leaf_info.s[0], 
+				node.aabb.point_min, node.aabb.point_max);
+		}
+		else // middle node
+		{
+			const BVHTreeNode& left = traversal_array[i + 1];
+			const BVHTreeNode& right = traversal_array[left.packet_indexes.s[0]];
+			for (int axis = 0; axis < 3; axis++)
+			{
+				node.aabb.point_min.s[axis] = std::min(left.aabb.point_min.s[axis], right.aabb.point_min.s[axis]);
+				node.aabb.point_max.s[axis] = std::max(left.aabb.point_max.s[axis], right.aabb.point_max.s[axis]);
+			}
+		}
+	});
+}
+
+void BVH::FindParents(const BVH4Node* wide_array, const int size, std::vector<int>& parents)
+{
+	assert(wide_array != nullptr && size > 0);
+
+	parents.assign(size, -1);
+	for (int i = 0; i < size; i++)
+	{
+		for (int c = 0; c < 4; c++)
+		{
+			if (wide_array[i].child.s[c] != -1 && wide_array[i].count.s[c] == 0) // middle child
+				parents[wide_array[i].child.s[c]] = i;
+		}
+	}
+}
+
+void BVH::RefitWide(BVH4Node* wide_array, const std::vector<int>& parents, const std::vector<int>& leaves,
+	const cl_int3* faces, const cl_float3* vertices, const std::vector<bool>& refit_groups, std::vector<int>& refitted)
+{
+	assert(wide_array != nullptr);
+
+	VisitAncestors(parents, leaves, refitted, [&](const int i)
+	{
+		BVH4Node& node = wide_array[i];
+		for (int c = 0; c < 4; c++)
+		{
+			if (node.child.s[c] == -1 || node.count.s[c] < 0)
+				continue; /* empty slot or an instance */
+
+			cl_float3 point_min, point_max;
+			if (node.count.s[c] > 0) // leaf child
+			{
+				if (!refit_groups[node.group.s[c]])
+					continue;
+
+				FacesBounds(faces, vertices, node.child.s[c], node.count.s[c], point_min, point_max);
+			}
+			else // middle child, the union of its own children
+			{
+				const BVH4Node& child = wide_array[node.child.s[c]];
+				point_min.s[0] = point_min.s[1] = point_min.s[2] = std::numeric_limits<float>::max();
+				point_max.s[0] = point_max.s[1] = point_max.s[2] = -std::numeric_limits<float>::max();
+				for (int g = 0; g < 4; g++)
+				{
+					if (child.child.s[g] == -1)
+						continue;
+
+					point_min.s[0] = std::min(point_min.s[0], child.min_x.s[g]);
+					point_min.s[1] = std::min(point_min.s[1], child.min_y.s[g]);
+					point_min.s[2] = std::min(point_min.s[2], child.min_z.s[g]);
+					point_max.s[0] = std::max(point_max.s[0], child.max_x.s[g]);
+					point_max.s[1] = std::max(point_max.s[1], child.max_y.s[g]);
+					point_max.s[2] = std::max(point_max.s[2], child.max_z.s[g]);
+				}
+			}
+
+			node.min_x.s[c] = point_min.s[0];
+			node.min_y.s[c] = point_min.s[1];
+			node.min_z.s[c] = point_min.s[2];
+			node.max_x.s[c] = point_max.s[0];
+			node.max_y.s[c] = point_max.s[1];
+			node.max_z.s[c] = point_max.s[2];
+		}
+	});
+}
+
+/* surface area of an AABB already packed for OpenCL */
+static float SurfaceArea(const CL_AABB& aabb)
+{
+	float x = aabb.point_max.s[0] - aabb.point_min.s[0];
+	float y = aabb.point_max.s[1] - aabb.point_min.s[1];
+	float z = aabb.point_max.s[2] - aabb.point_min.s[2];
+	return 2.0f * (x * y + y * z + z * x);
+}
+
+/* a node of the binary traversal array is a leaf if it points to faces or to an instance */
+static inline bool IsLeaf(const BVHTreeNode& node)
+{
+	return node.packet_indexes.s[1] != -1;
+}
+
+/* Collapse the binary subtree rooted at binary_index into a new node of the wide array, and recursively
+ * its middle children. Returns the amount of stack entries needed to traverse it after popping it */
+static int CollapseWideNode(const BVHTreeNode* traversal_array, const int binary_index, std::vector<BVH4Node>& wide_array)
+{
+	/* children of the wide node, starting with the two children of the binary node. A binary root that 
+	 * is also a leaf is the only child of its wide node */
+	int children[4];
+	int children_amount = 0;
+	if (IsLeaf(traversal_array[binary_index]))
+	{
+		children[children_amount++] = binary_index;
+	}
+	else
+	{
+		children[children_amount++] = binary_index + 1;
+		children[children_amount++] = traversal_array[binary_index + 1].packet_indexes.s[0];
+	}
+
+	/* open the middle child with the largest surface area until the node is full */
+	while (children_amount < 4)
+	{
+		int largest = -1;
+		float largest_area = -1.0f;
+		for (int c = 0; c < children_amount; c++)
+		{
+			const BVHTreeNode& node = traversal_array[children[c]];
+			if (!IsLeaf(node) && SurfaceArea(node.aabb) > largest_area)
+			{
+				largest = c;
+				largest_area = SurfaceArea(node.aabb);
+			}
+		}
+		if (largest == -1)
+			break; /* only leaves left */
+
+		int opened = children[largest];
+		children[largest] = opened + 1;
+		children[children_amount++] = traversal_array[opened + 1].packet_indexes.s[0];
+	}
+
+	/* reserve the position of this node, its children come after it */
+	int wide_index = wide_array.size();
+	wide_array.push_back(BVH4Node());
+
+	BVH4Node node;
+	memset(&node, 0, sizeof(BVH4Node));
+	int pushed = 0;
+	int child_stack = 0;
+	for (int c = 0; c < 4; c++)
+	{
+		if (c >= children_amount)
+		{
+			node.child.s[c] = -1;
+			continue;
+		}
+
+		const BVHTreeNode& child = traversal_array[children[c]];
+		node.min_x.s[c] = child.aabb.point_min.s[0];
+		node.min_y.s[c] = child.aabb.point_min.s[1];
+		node.min_z.s[c] = child.aabb.point_min.s[2];
+		node.max_x.s[c] = child.aabb.point_max.s[0];
+		node.max_y.s[c] = child.aabb.point_max.s[1];
+		node.max_z.s[c] = child.aabb.point_max.s[2];
+
+		if (IsLeaf(child))
+		{
+			node.child.s[c] = child.packet_indexes.s[1];
+			node.count.s[c] = child.leaf_info.s[0];
+			node.group.s[c] = child.leaf_info.s[1];
+			if (child.leaf_info.s[0] < 0)
+			{
+				/* instances are pushed on the stack before entering their BVH */
+				pushed++;
+				child_stack = std::max(child_stack, 1);
+			}
+		}
+		else
+		{
+			node.child.s[c] = wide_array.size();
+			node.count.s[c] = 0;
+			node.group.s[c] = -1;
+			pushed++;
+			child_stack = std::max(child_stack, CollapseWideNode(traversal_array, children[c], wide_array));
+		}
+	}
+	/* the vector may have grown on the recursion, don't keep references to it */
+	wide_array[wide_index] = node;
+
+	/* every hit child is pushed, the last one to be popped waits below all the others */
+	if (pushed == 0)
+		return 0;
+	return std::max(pushed, pushed - 1 + child_stack);
+}
+
+int BVH::BuildWideTraversal(const BVHTreeNode* traversal_array, const int root, std::vector<BVH4Node>& wide_array)
+{
+	assert(traversal_array != nullptr && root >= 0);
+
+	/* the root is pushed before the traversal starts */
+	return std::max(1, CollapseWideNode(traversal_array, root, wide_array));
+}
+
+/* Exponent of the smallest power of two step that covers [origin, max] in 255 steps, so the device
+ * decoding origin + 255 * 2^exponent always reaches max */
+static int QuantizationExponent(const float origin, const float max)
+{
+	int exponent;
+	std::frexp((max - origin) / 255.0f, &exponent);
+	exponent = std::max(exponent, -126); /* keep 2^exponent a normalized float */
+	while (origin + 255.0f * std::ldexp(1.0f, exponent) < max)
+		exponent++;
+
+	assert(exponent <= 127 && "AABB too large to be quantized");
+	return exponent;
+}
+
+/* Largest step whose decoded value is not above value, so the quantized AABB contains the exact one */
+static cl_uchar QuantizeDown(const float origin, const float step, const float value)
+{
+	int q = (int)std::floor((value - origin) / step);
+	q = std::min(std::max(q, 0), 255);
+	while (q > 0 && origin + q * step > value)
+		q--;
+	return (cl_uchar)q;
+}
+
+/* Smallest step whose decoded value is not below value */
+static cl_uchar QuantizeUp(const float origin, const float step, const float value)
+{
+	int q = (int)std::ceil((value - origin) / step);
+	q = std::min(std::max(q, 0), 255);
+	while (q < 255 && origin + q * step < value)
+		q++;
+	return (cl_uchar)q;
+}
+
+void BVH::CompressWideTraversal(const BVH4Node* wide_array, const int start, const int end, BVH4QNode* compressed_array)
+{
+	assert(wide_array != nullptr && compressed_array != nullptr && start >= 0 && start <= end);
+
+	for (int i = start; i < end; i++)
+	{
+		const BVH4Node& node = wide_array[i];
+		BVH4QNode& compressed = compressed_array[i];
+		memset(&compressed, 0, sizeof(BVH4QNode));
+		compressed.child = node.child;
+
+		/* the grid covers the union of the children */
+		float point_min[3] = { 0.0f, 0.0f, 0.0f };
+		float point_max[3] = { 0.0f, 0.0f, 0.0f };
+		bool empty = true;
+		for (int c = 0; c < 4; c++)
+		{
+			if (node.child.s[c] == -1)
+				continue;
+
+			const float child_min[3] = { node.min_x.s[c], node.min_y.s[c], node.min_z.s[c] };
+			const float child_max[3] = { node.max_x.s[c], node.max_y.s[c], node.max_z.s[c] };
+			for (int axis = 0; axis < 3; axis++)
+			{
+				point_min[axis] = empty ? child_min[axis] : std::min(point_min[axis], child_min[axis]);
+				point_max[axis] = empty ? child_max[axis] : std::max(point_max[axis], child_max[axis]);
+			}
+			empty = false;
+		}
+
+		float step[3];
+		for (int axis = 0; axis < 3; axis++)
+		{
+			int exponent = QuantizationExponent(point_min[axis], point_max[axis]);
+			compressed.exponent.s[axis] = (cl_char)exponent;
+			step[axis] = std::ldexp(1.0f, exponent);
+		}
+		compressed.origin_x = point_min[0];
+		compressed.origin_y = point_min[1];
+		compressed.origin_z = point_min[2];
+
+		for (int c = 0; c < 4; c++)
+		{
+			if (node.child.s[c] == -1)
+				continue;
+
+			compressed.min_x.s[c] = QuantizeDown(point_min[0], step[0], node.min_x.s[c]);
+			compressed.min_y.s[c] = QuantizeDown(point_min[1], step[1], node.min_y.s[c]);
+			compressed.min_z.s[c] = QuantizeDown(point_min[2], step[2], node.min_z.s[c]);
+			compressed.max_x.s[c] = QuantizeUp(point_min[0], step[0], node.max_x.s[c]);
+			compressed.max_y.s[c] = QuantizeUp(point_min[1], step[1], node.max_y.s[c]);
+			compressed.max_z.s[c] = QuantizeUp(point_min[2], step[2], node.max_z.s[c]);
+
+			assert(node.count.s[c] < 255 && "Too many faces on a leaf to be compressed");
+			compressed.count.s[c] = node.count.s[c] < 0 ? 255 : (cl_uchar)node.count.s[c];
+		}
+	}
+}
+
+BVHStatistics BVH::ComputeStatistics(const BVHTreeNode* traversal_array, const int size)
+{
+	assert(traversal_array != nullptr && size > 0);
+
+	BVHStatistics statistics;
+	statistics.nodes = size;
+	statistics.leaves = 0;
+	statistics.depth = 0;
+	statistics.traversal_cost = 0.0f;
+	statistics.intersection_cost = 0.0f;
+
+	float root_area = SurfaceArea(traversal_array[0].aabb);
+	if (root_area <= 0.0f)
+		root_area = 1.0f; /* flat scene, avoid a division by zero */
+
+	/* the subtree of a node covers the range between its position and its escape index,
+	 * so the escape indexes of the current path from the root are enough to compute the depth */
+	std::vector<int> path;
+	for (int i = 0; i < size; i++)
+	{
+		while (!path.empty() && path.back() <= i)
+			path.pop_back();
+
+		statistics.depth = std::max(statistics.depth, (int)path.size() + 1);
+		float probability = SurfaceArea(traversal_array[i].aabb) / root_area;
+
+		if (traversal_array[i].packet_indexes.s[1] == -1)
+		{
+			statistics.traversal_cost += s_traversalCost * probability;
+			path.push_back(traversal_array[i].packet_indexes.s[0]);
+		}
+		else
+		{
+			statistics.leaves++;
+			if (traversal_array[i].leaf_info.s[0] > 0) /* instances have no faces on this array */
+				statistics.intersection_cost += s_intersectionCost * probability * traversal_array[i].leaf_info.s[0];
+		}
+	}
+
+	return statistics;
+}
+
+int BVH::ComputeOrderedStackSize(const BVHTreeNode* traversal_array, const int start, const int end)
+{
+	assert(traversal_array != nullptr && start >= 0 && start < end);
+
+	/* same walk over the escape indexes of ComputeStatistics, only the middle nodes are on the path */
+	std::vector<int> path;
+	int stack_size = 0;
+	for (int i = start; i < end; i++)
+	{
+		while (!path.empty() && path.back() <= i)
+			path.pop_back();
+
+		stack_size = std::max(stack_size, (int)path.size());
+		if (!IsLeaf(traversal_array[i]))
+			path.push_back(traversal_array[i].packet_indexes.s[0]);
+	}
+
+	return stack_size;
+}
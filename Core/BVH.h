@@ -24,16 +24,56 @@
 #include "CL\cl.h"
 #include "glm\glm\glm.hpp"
 #include "AABB.h"
-#include "SceneGroup.h"
 #include "CLStructs.h"
 
+class SceneGroup;
+
+
+/* Algorithms available to partition the primitives of a BVH */
+enum BVHBuildMethod
+{
+	/* Kay and Kajiya median split, alternating between X and Y axis */
+	MedianSplit,
+	/* Surface Area Heuristic evaluated over a fixed amount of bins on every axis */
+	BinnedSAH
+};
+
+/* Layouts of the traversal array sent to the OpenCL device */
+enum BVHLayout
+{
+	/* binary nodes on a fixed order, traversed without a stack by following escape indexes */
+	StacklessLayout,
+	/* the binary nodes of StacklessLayout, traversed with a stack visiting the closest child first and 
+	 * skipping the boxes beyond the closest hit found so far */
+	OrderedLayout,
+	/* 4-wide nodes with the AABBs of the children stored together, traversed with a stack */
+	WideLayout,
+	/* same as WideLayout, with the AABBs of the children quantized to 8 bits so a node fits a cache line */
+	CompressedLayout
+};
+
+/* Cost report of a BVH, computed over its traversal array. Costs follow the Surface Area Heuristic
+	and are expressed per ray hitting the root node: traversal_cost is the expected cost of visiting 
+	middle nodes, while intersection_cost is the expected amount of triangle tests */
+struct BVHStatistics
+{
+	int nodes;
+	int leaves;
+	int depth;
+	float traversal_cost;
+	float intersection_cost;
+};
 
 /* 
 	The BVH class will describe a Bounding volume hierarchy as a binary tree. 
 	Each instance of this class will build new instances of itself recursively
-	provided with a set of objects, until every leaf node has only one object.
+	provided with a set of primitives, until every leaf node has at most a given 
+	amount of primitives.
 
-	The BVH leaf nodes have an index pointing to an object on the list of objects.
+	BVHs are used in two levels: the object level BVH partitions the SceneGroups of the 
+	scene, while each SceneGroup owns a triangle level BVH partitioning its faces. 
+	When the traversal array is built, the leaves of the object level BVH are replaced by
+	the triangle level BVH of the group they point to.
 */
 class BVH final
 {
@@ -43,13 +83,29 @@ public:
 	~BVH();
 
 	/*
-	* Recursevely creates the BVHs
+	* Creates an object level BVH
 	* objects vector contains the pointers to all objects in the scene
-	* objects_index is a set of indexes pointing to the objects vector that
-	* 			  will be split into a new level of the tree
+	* instances vector contains the AABBs of all instances in world space, the 
+	*			  instance i is the primitive of index objects.size() + i
+	* objects_index is a set of indexes pointing to the primitives (objects followed
+	*			  by instances) that will be split into a new level of the tree
+	* returns an AABB fitting all the geometry of child nodes
+	*/
+	AABB Create(const std::vector<SceneGroup*>& objects, const std::vector<AABB>& instances,
+		std::vector<int>& objects_index, const BVHBuildMethod method = MedianSplit);
+
+	/*
+	* Recursevely creates the BVHs over a generic set of primitives
+	* primitives vector contains the AABB of every primitive
+	* primitives_index is a set of indexes pointing to the primitives vector, it will
+	*				be reordered so the primitives of each leaf node are contiguous
+	* start and end delimit the range of primitives_index covered by this node
+	* max_leaf_size is the maximum amount of primitives stored on a leaf node
+	* method is the algorithm used to split the primitives at each level
 	* returns an AABB fitting all the geometry of child nodes
 	*/
-	AABB Create(const std::vector<SceneGroup*>& objects, std::vector<int>& objects_index);
+	AABB Create(const std::vector<AABB>& primitives, std::vector<int>& primitives_index,
+		const int start, const int end, const int max_leaf_size, const BVHBuildMethod method);
 
 	/* Return the amount of nodes this BVH has, including its own */
 	inline int GetNodesAmount() const
@@ -57,16 +113,92 @@ public:
 		return nodes_amount;
 	}
 
-	/* Resursvely traversal this BVH in a top-botton left-right manner and build
-	 * an array representing the traversal. 
+	/* Return the amount of leaf nodes this BVH has */
+	inline int GetLeavesAmount() const
+	{
+		return leaves_amount;
+	}
+
+	/* Resursvely traversal this object level BVH in a top-botton left-right manner and build
+	 * an array representing the traversal. Each leaf is replaced by the triangle level BVH
+	 * of the SceneGroup it points to, while leaves of instances are kept as a single node.
 	 * traversal_array is a pre-allocated array of size of the amount of nodes in 
-	 *                 in the entire BVH (from root node) 
+	 *                 in the entire BVH (from root node, including the triangle level BVHs) 
 	 * offset is the amount of the array filled so far, must start with 0
+	 * objects is the same vector used to create this BVH
+	 * groups is the array of SceneGroupStruct, following the order of objects
+	 * instances_group contains the index of the group of each instance
+	 */
+	void BuildTraversal(BVHTreeNode* traversal_array, int& offset, const std::vector<SceneGroup*>& objects, 
+		const SceneGroupStruct* groups, const std::vector<int>& instances_group) const;
+
+	/* Same as above, but for a triangle level BVH.
+	 * faces_start is the index where the faces of the group start inside the global faces buffer
+	 * group_index is the index of the group on the SceneGroupStruct array
 	 */
-	void BuildTraversal(BVHTreeNode* traversal_array, int& offset) const;
+	void BuildTraversal(BVHTreeNode* traversal_array, int& offset, 
+		const int faces_start, const int group_index) const;
+
+	/* Compute the cost report of a traversal array, such as the one generated by BuildTraversal.
+	 * size is the amount of nodes on traversal_array. Leaves of instances count as a 
+	 * single node, the cost of the BVH of their group is not included */
+	static BVHStatistics ComputeStatistics(const BVHTreeNode* traversal_array, const int size);
+
+	/* Return the amount of stack entries the kernel needs to traverse the BVH stored on the range [start, end)
+	 * of a binary traversal array with the ordered traversal, without instances. It's the amount of middle 
+	 * nodes on the longest path, only the farthest child of each one waits on the stack */
+	static int ComputeOrderedStackSize(const BVHTreeNode* traversal_array, const int start, const int end);
+
+	/* Find the parent of each node on the range [0, size) of a traversal array, -1 on the root.
+	 * The BVHs of the instanced groups stored after size are not reached */
+	static void FindParents(const BVHTreeNode* traversal_array, const int size, std::vector<int>& parents);
+
+	/* Recompute the AABBs of some leaves of a traversal array and of their ancestors after their vertices 
+	 * moved, keeping its topology. The rest of the array is not visited.
+	 * parents is the one found by FindParents
+	 * leaves are the leaves to start from, the ones of instances must have their AABB updated before calling this
+	 * faces and vertices are the global buffers pointed by the leaves
+	 * refit_groups tells which groups had their vertices changed, only their leaves are recomputed
+	 * refitted receives every node recomputed, sorted by position, to upload only those */
+	static void Refit(BVHTreeNode* traversal_array, const std::vector<int>& parents, const std::vector<int>& leaves,
+		const cl_int3* faces, const cl_float3* vertices, const std::vector<bool>& refit_groups, std::vector<int>& refitted);
+
+	/* Collapse a binary traversal array, such as the one generated by BuildTraversal, into 4-wide nodes 
+	 * appended to wide_array in depth-first order. Each wide node takes the children of a binary node and
+	 * opens the largest of its middle children until it holds 4 of them.
+	 * root is the position of the root node of the BVH to be collapsed inside traversal_array.
+	 * The wide root is placed at the position wide_array had before the call. Leaves of instances are
+	 * kept as a leaf child, and their group BVH must be collapsed separately.
+	 * Returns the amount of stack entries the kernel needs to traverse the wide BVH, without instances */
+	static int BuildWideTraversal(const BVHTreeNode* traversal_array, const int root, std::vector<BVH4Node>& wide_array);
+
+	/* Same as FindParents, but for a wide traversal array such as the one generated by BuildWideTraversal */
+	static void FindParents(const BVH4Node* wide_array, const int size, std::vector<int>& parents);
+
+	/* Same as Refit, but for a wide traversal array. leaves are the nodes holding the leaf children to start
+	 * from, the AABBs of instances must be updated on their parent node before calling this */
+	static void RefitWide(BVH4Node* wide_array, const std::vector<int>& parents, const std::vector<int>& leaves,
+		const cl_int3* faces, const cl_float3* vertices, const std::vector<bool>& refit_groups, std::vector<int>& refitted);
+
+	/* Quantize the range [start, end) of a wide traversal array into compressed_array, keeping the position 
+	 * of every node. The AABBs of the children are stored relative to the AABB of their parent on a grid of
+	 * 255 steps per axis, rounded outwards. The group of a leaf child is not stored on compressed nodes, it must
+	 * be on the fourth element of the first face of the leaf */
+	static void CompressWideTraversal(const BVH4Node* wide_array, const int start, const int end, BVH4QNode* compressed_array);
 
 private:
 
+	/* Sort the range [start, end) of primitives_index by the X or Y position of the primitives
+	 * and return the middle of the range, as proposed by Kay and Kajiya */
+	int SplitMedian(const std::vector<AABB>& primitives, std::vector<int>& primitives_index,
+		const int start, const int end);
+
+	/* Partition the range [start, end) of primitives_index using the binned Surface Area Heuristic
+	 * and return the position where the right child starts. Return -1 if turning this node into a
+	 * leaf is cheaper, which is only allowed when there are max_leaf_size primitives or less */
+	int SplitBinnedSAH(const std::vector<AABB>& primitives, std::vector<int>& primitives_index,
+		const int start, const int end, const int max_leaf_size);
+
 	/* pointers to child nodes, NULL if in a leaf node */
 	BVH* m_left;
 	BVH* m_right;
@@ -74,14 +206,24 @@ private:
 	/* The bounding box that fits all geometry of this node and its children */
 	AABB m_aabb;
 	
-	/* Index pointing to an SceneGroup in the list of objects. Only valid on a leaf node */
+	/* Index pointing to the first primitive in the list of primitives. Only valid on a leaf node */
 	int m_object_index;
 
+	/* Position of the first primitive of this leaf inside primitives_index, 
+	 * the primitives of a leaf are contiguous. Only valid on a leaf node */
+	int m_first;
+
+	/* Amount of primitives on this leaf node, 0 on middle nodes */
+	int m_count;
+
 	/* True if this BVH was sorted in the X coordinated */
 	bool m_x_split;
 
 	/* The amount of nodes on this level of the tree, including this own */
 	int nodes_amount;
+
+	/* The amount of leaf nodes on this level of the tree */
+	int leaves_amount;
 };
 
 
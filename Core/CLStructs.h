@@ -54,7 +54,7 @@ typedef struct SceneInformation
 	cl_int height;
 	cl_int pixelCount;
 	cl_int groupsSize;
-	cl_int bvhSize;
+	cl_int bvhSize; /* amount of nodes of the object level BVH */
 	cl_float proportion_x;
 	cl_float proportion_y;
 } SceneInformation;
@@ -94,11 +94,92 @@ typedef struct BVHTreeNode
 	 * packet_indexes.s[0]
 	 * 
 	 * The second element is only valid on leaf nodes, it points to 
-	 * position within the SceneGroupStruct array, -1 otherwise */
+	 * the first face of the leaf within the global faces buffer, -1 otherwise */
 	 cl_int2 packet_indexes;
-	 cl_int2 padding; /* extra 8 bytes due do memory aligment */
+	 /* Only valid on leaf nodes, the first element is the amount of faces
+	  * on this leaf and the second element is the position of the group 
+	  * which the faces belong within the SceneGroupStruct array.
+	  * On a leaf holding an instance the amount of faces is -1 and the
+	  * second element of packet_indexes is the index of the instance */
+	 cl_int2 leaf_info;
 }BVHTreeNode;
 
+/* Amount of entries of the traversal stack used by the kernel on the ordered traversal of the binary BVH */
+#define BVH_ORDERED_STACK_SIZE 64
+
+/* Amount of entries of the traversal stack used by the kernel on the wide BVH */
+#define BVH_WIDE_STACK_SIZE 64
+
+/* A node of the wide BVH, collapsing up to 4 nodes of the binary BVH into one. The AABBs
+	of the children are stored as a structure of arrays, so the kernel tests all of them at once */
+typedef struct BVH4Node
+{
+	/* one element for each child */
+	cl_float4 min_x;
+	cl_float4 min_y;
+	cl_float4 min_z;
+	cl_float4 max_x;
+	cl_float4 max_y;
+	cl_float4 max_z;
+
+	/* Index of each child inside the wide traversal array. On leaves it's the first face of the
+	 * leaf within the global faces buffer, or the index of the instance. -1 on empty slots */
+	cl_int4 child;
+	/* Amount of faces on each leaf child, 0 on middle nodes and -1 on leaves holding an instance */
+	cl_int4 count;
+	/* Position of the group which the faces of each leaf child belong within the SceneGroupStruct array */
+	cl_int4 group;
+}BVH4Node;
+
+/* A node of the wide BVH with the AABBs of the children quantized to 8 bits, packed into a single
+	cache line. The AABB of child c covers origin + min * 2^exponent to origin + max * 2^exponent 
+	on each axis, rounded outwards so it always contains the exact one */
+typedef struct BVH4QNode
+{
+	/* same as BVH4Node::child */
+	cl_int4 child;
+
+	/* minimum corner of the AABB of this node and the power of two of the quantization step on each axis */
+	cl_float origin_x;
+	cl_float origin_y;
+	cl_float origin_z;
+	cl_char4 exponent;
+
+	/* one element for each child, in steps of the quantization grid */
+	cl_uchar4 min_x;
+	cl_uchar4 min_y;
+	cl_uchar4 min_z;
+	cl_uchar4 max_x;
+	cl_uchar4 max_y;
+	cl_uchar4 max_z;
+
+	/* Amount of faces on each leaf child, 0 on middle nodes and 255 on leaves holding an instance.
+	 * The group of the faces is taken from the fourth element of the first face of the leaf */
+	cl_uchar4 count;
+	cl_int padding;
+}BVH4QNode;
+
+/* InstanceStruct holds info about an instance of a scene group. The BVH of the group is stored 
+	once after the object level BVH, and rays are transformed into its object space */
+typedef struct InstanceStruct
+{
+	cl_float4 world_to_object[3]; /* rows of the 3x4 matrix transforming world space into object space */
+	cl_int bvhStart; /* position of the root node of the group BVH on the traversal array */
+	cl_int bvhEnd; /* escape index of that root node, the group BVH covers the range [bvhStart, bvhEnd) */
+	cl_int2 padding;
+}InstanceStruct;
+
+/* Efficiency metrics of a frame, see PrepareRaytracer. The kernel adds up the counters of the rays of each
+	work-group into one of those, the host adds up all of them */
+typedef struct EfficiencyCounters
+{
+	cl_ulong intersect_tests; /* rays tested against a face */
+	cl_ulong intersect_hits; /* tests that hit the face */
+	cl_ulong box_tests; /* rays tested against the AABB of a node */
+	cl_ulong nodes_visited; /* nodes whose AABB was hit */
+	cl_ulong leaves_visited; /* leaves whose faces were tested */
+}EfficiencyCounters;
+
 /* default material to objects that don't have one */
 static const Material s_defaultMaterial = 
 {
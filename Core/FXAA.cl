@@ -32,6 +32,15 @@
 
 
 
+/* specialized builds know the resolution at compile time, see Raytracer.cl */
+#ifdef SCENE_SPECIALIZED
+#define FXAA_WIDTH SCENE_WIDTH
+#define FXAA_HEIGHT SCENE_HEIGHT
+#else
+#define FXAA_WIDTH (*width)
+#define FXAA_HEIGHT (*height)
+#endif // SCENE_SPECIALIZED
+
 float FxaaLuma(uchar3 rgb) {
 	return (float)rgb.y * 1.96321f + (float)rgb.x;
 }
@@ -41,8 +50,8 @@ __kernel void AntiAliasingFXAA(__global uchar4* screenInput, __global uchar4* sc
 
 
 	int id = get_global_id(0);
-	int x = id % *width;				//-----column in which is the pixel
-	int y = id / *width;				//-----line in which is the pixel
+	int x = id % FXAA_WIDTH;				//-----column in which is the pixel
+	int y = id / FXAA_WIDTH;				//-----line in which is the pixel
 
 	bool canUp = true;
 	bool canDown = true;
@@ -78,7 +87,7 @@ __kernel void AntiAliasingFXAA(__global uchar4* screenInput, __global uchar4* sc
 		screenOutput[id] = screenInput[id];
 		return;
 	}
-	if (x < *width - 1)
+	if (x < FXAA_WIDTH - 1)
 	{
 		rgbE = screenInput[id + 1].xyz;
 		lumaE = FxaaLuma(rgbE);
@@ -90,7 +99,7 @@ __kernel void AntiAliasingFXAA(__global uchar4* screenInput, __global uchar4* sc
 	}
 	if (y > 0)
 	{
-		rgbN = screenInput[id - *width].xyz;
+		rgbN = screenInput[id - FXAA_WIDTH].xyz;
 		lumaN = FxaaLuma(rgbN);
 	}
 	else
@@ -98,9 +107,9 @@ __kernel void AntiAliasingFXAA(__global uchar4* screenInput, __global uchar4* sc
 		screenOutput[id] = screenInput[id];
 		return;
 	}
-	if (y < *height - 1)
+	if (y < FXAA_HEIGHT - 1)
 	{
-		rgbS = screenInput[id + *width].xyz;
+		rgbS = screenInput[id + FXAA_WIDTH].xyz;
 		lumaS = FxaaLuma(rgbS);
 	}
 	else
@@ -141,16 +150,16 @@ __kernel void AntiAliasingFXAA(__global uchar4* screenInput, __global uchar4* sc
 	float lumaSE = lumaM;
 
 
-	rgbNW = screenInput[id - *width - 1].xyz;
+	rgbNW = screenInput[id - FXAA_WIDTH - 1].xyz;
 	lumaNW = FxaaLuma(rgbNW);
 
-	rgbNE = screenInput[id - *width + 1].xyz;
+	rgbNE = screenInput[id - FXAA_WIDTH + 1].xyz;
 	lumaNE = FxaaLuma(rgbNE);
 
-	rgbSW = screenInput[id + *width - 1].xyz;
+	rgbSW = screenInput[id + FXAA_WIDTH - 1].xyz;
 	lumaSW = FxaaLuma(rgbSW);
 
-	rgbSE = screenInput[id + *width + 1].xyz;
+	rgbSE = screenInput[id + FXAA_WIDTH + 1].xyz;
 	lumaSE = FxaaLuma(rgbSE);
 
 
@@ -18,6 +18,7 @@
 
 
 #include "OBJLoader.h"
+#include "Trace.h"
 
 void RemoveFileName(std::string& path)
 
@@ -141,6 +142,7 @@ bool LoadOBJ(const char* fileName)
 	/* Please bear in mind that this loader is not suppose to be comprehensive,
 	since RenderGirl is suppose to work with other 3D softwares.
 	You may notice the lack of asserts. */
+	TraceSpan span("OBJ parse", "scene");
 
 	FILE* objFile = fopen(fileName, "r");
 
@@ -18,6 +18,7 @@
 
 #include "OCLContext.h"
 #include "OCLDevice.h"
+#include "Trace.h"
 
 
 // callback function to capture errors on this context
@@ -30,6 +31,10 @@ static void __stdcall ImplementationError(const char* errinfo, const void* priva
 bool OCLContext::InitContext(const OCLDevice *device)
 {
 	m_isReady = false;
+	m_allocationCount = 0;
+	m_bytesToDevice = 0;
+	m_bytesToHost = 0;
+	m_profiling = false;
 	this->m_device = device;
 
 	Log::Message("");
@@ -58,7 +63,8 @@ bool OCLContext::InitContext(const OCLDevice *device)
 		}
 	}
 
-	m_queue = clCreateCommandQueue(m_context, device->GetID(), NULL, &error);
+	/* profiling is cheap until events are asked for, see SetProfiling */
+	m_queue = clCreateCommandQueue(m_context, device->GetID(), CL_QUEUE_PROFILING_ENABLE, &error);
 
 	if (error != CL_SUCCESS)
 	{
@@ -74,6 +80,15 @@ bool OCLContext::InitContext(const OCLDevice *device)
 		}
 	}
 
+	/* reads that may run while the device works on the commands of m_queue, see EnqueueMarker */
+	m_transferQueue = clCreateCommandQueue(m_context, device->GetID(), CL_QUEUE_PROFILING_ENABLE, &error);
+	if (error != CL_SUCCESS)
+	{
+		clReleaseCommandQueue(m_queue);
+		Log::Error("Couldn't create the transfer command queue inside " + device->GetName());
+		return false;
+	}
+
 	Log::Message("Context was created without errors.");
 
 	m_isReady = true;
@@ -86,6 +101,8 @@ bool OCLContext::ExecuteCommands()
 
 	// the flush!
 	cl_int error = clFinish(m_queue);
+	if (error == CL_SUCCESS)
+		error = clFinish(m_transferQueue);
 	if (error != CL_SUCCESS)
 	{
 		std::string errorString("Failed to flush the command queue on the device " + m_device->GetName() + ": ");
@@ -103,6 +120,171 @@ bool OCLContext::ExecuteCommands()
 	return true;
 }
 
+bool OCLContext::FlushCommands()
+{
+	assert(m_isReady && "You cannot flush a queue if the context is not ready!");
+
+	cl_int error = clFlush(m_queue);
+	if (error == CL_SUCCESS)
+		error = clFlush(m_transferQueue);
+	if (error != CL_SUCCESS)
+	{
+		Log::Error("Failed to flush the command queue on the device " + m_device->GetName());
+		return false;
+	}
+
+	return true;
+}
+
+bool OCLContext::EnqueueMarker(cl_event* event)
+{
+	assert(m_isReady && "You cannot use a queue if the context is not ready!");
+
+	if (clEnqueueMarkerWithWaitList(m_queue, 0, NULL, event) != CL_SUCCESS)
+	{
+		Log::Error("Failed to enqueue a marker on the device " + m_device->GetName());
+		return false;
+	}
+
+	return true;
+}
+
+/* called by the OpenCL implementation once a write of WriteStaged is done with its copy of the data */
+static void CL_CALLBACK ReleaseStagedData(cl_event event, cl_int status, void* data)
+{
+	delete[] (char*)data;
+}
+
+bool OCLContext::WriteStaged(const cl_mem buffer, const size_t offset, const size_t size, const void* data, cl_event* event)
+{
+	/* a non-blocking write reads the host memory only when it runs on the device, which may be after frames 
+	 * still queued, so it gets a copy the caller can't change meanwhile */
+	char* staged = new char[size];
+	memcpy(staged, data, size);
+
+	cl_event write;
+	if (clEnqueueWriteBuffer(m_queue, buffer, CL_FALSE, offset, size, staged, 0, NULL, &write) != CL_SUCCESS)
+	{
+		delete[] staged;
+		return false;
+	}
+
+	if (clSetEventCallback(write, CL_COMPLETE, ReleaseStagedData, staged) != CL_SUCCESS)
+	{
+		/* the copy can only be released here */
+		clWaitForEvents(1, &write);
+		delete[] staged;
+	}
+
+	if (event != NULL)
+		*event = write;
+	else
+		clReleaseEvent(write);
+
+	return true;
+}
+
+const char* OCLContext::GetProfilingStageName(const ProfilingStage stage)
+{
+	static const char* s_names[ProfilingStageCount] = { "Upload", "Raytrace", "Anti-aliasing", "Copy", "Readback" };
+	return s_names[stage];
+}
+
+cl_event* OCLContext::ProfilingEvent(const ProfilingStage stage, const std::string &name)const
+{
+	bool tracing = Trace::IsRecording();
+	if (!m_profiling && !tracing)
+		return NULL;
+
+	ProfiledCommand command;
+	command.stage = stage;
+	command.event = NULL;
+	command.name = name.empty() ? GetProfilingStageName(stage) : name;
+	command.traceTime = tracing ? Trace::Now() : -1.0;
+	m_profiledCommands.push_back(command);
+
+	return &m_profiledCommands.back().event;
+}
+
+bool OCLContext::CollectProfiling(FrameTiming &timing, int amount)
+{
+	static const cl_profiling_info s_profilingInfo[4] = { CL_PROFILING_COMMAND_QUEUED, CL_PROFILING_COMMAND_SUBMIT,
+		CL_PROFILING_COMMAND_START, CL_PROFILING_COMMAND_END };
+
+	memset(&timing, 0, sizeof(FrameTiming));
+	if (amount < 0 || amount > (int)m_profiledCommands.size())
+		amount = m_profiledCommands.size();
+
+	bool ok = true;
+	cl_ulong first = 0;
+	for (int c = 0; c < amount; c++)
+	{
+		ProfiledCommand command = m_profiledCommands.front();
+		m_profiledCommands.pop_front();
+		if (command.event == NULL)
+			continue;
+
+		cl_ulong times[4];
+		bool read = true;
+		for (int i = 0; i < 4; i++)
+		{
+			if (clGetEventProfilingInfo(command.event, s_profilingInfo[i], sizeof(cl_ulong), &times[i], NULL) != CL_SUCCESS)
+				read = false;
+		}
+		clReleaseEvent(command.event);
+		if (!read)
+		{
+			ok = false;
+			continue;
+		}
+
+		StageTiming &stage = timing.stages[command.stage];
+		if (stage.commands == 0)
+		{
+			stage.queued = times[0];
+			stage.submit = times[1];
+			stage.start = times[2];
+			stage.end = times[3];
+		}
+		else
+		{
+			stage.queued = std::min(stage.queued, times[0]);
+			stage.submit = std::min(stage.submit, times[1]);
+			stage.start = std::min(stage.start, times[2]);
+			stage.end = std::max(stage.end, times[3]);
+		}
+		stage.busy += times[3] - times[2];
+		stage.commands++;
+
+		/* the device has its own clock, it's moved to the one of the trace by the time the command was sent */
+		if (command.traceTime >= 0.0 && Trace::IsRecording())
+		{
+			double start = command.traceTime + (times[2] - times[0]) / 1000.0;
+			Trace::AddDeviceSpan(command.name, "device", start, (times[3] - times[2]) / 1000.0);
+		}
+
+		if (first == 0 || times[0] < first)
+			first = times[0];
+	}
+
+	/* the device clock only makes sense relative to the frame */
+	for (int s = 0; s < ProfilingStageCount; s++)
+	{
+		StageTiming &stage = timing.stages[s];
+		if (stage.commands == 0)
+			continue;
+		stage.queued -= first;
+		stage.submit -= first;
+		stage.start -= first;
+		stage.end -= first;
+	}
+
+	if (!ok)
+		Log::Error("Couldn't read the profiling information of the commands on the device " + m_device->GetName());
+
+	return ok;
+}
+
 bool OCLContext::SyncAllMemoryDeviceToHost()
 {
 	bool error = true;
@@ -124,7 +306,7 @@ bool OCLContext::SyncAllMemoryHostToDevice()
 	std::list<OCLMemoryObjectBase*>::iterator it;
 	for (it = m_memList.begin(); it != m_memList.end(); it++)
 	{
-		if (!(*it)->SyncHostToDevice())
+		if (!(*it)->SyncDirtyHostToDevice())
 		{
 			error = false;
 		}
@@ -135,6 +317,10 @@ bool OCLContext::SyncAllMemoryHostToDevice()
 
 void OCLContext::ReleaseContext()
 {
+	/* the writes still queued release their copies of the data once they are done */
+	clFinish(m_queue);
+	clFinish(m_transferQueue);
+
 	// dealloc all memory associated with this device
 	std::list<OCLMemoryObjectBase*>::iterator it;
 	for (it = m_memList.begin(); it != m_memList.end(); it++)
@@ -143,7 +329,16 @@ void OCLContext::ReleaseContext()
 	}
 	m_memList.clear();
 
+	std::deque<ProfiledCommand>::iterator command;
+	for (command = m_profiledCommands.begin(); command != m_profiledCommands.end(); command++)
+	{
+		if (command->event != NULL)
+			clReleaseEvent(command->event);
+	}
+	m_profiledCommands.clear();
+
 	// release OpenCL stuff
+	clReleaseCommandQueue(m_transferQueue);
 	clReleaseCommandQueue(m_queue);
 	clReleaseContext(m_context);
 	/* Deleting the queue after deleting the context is considered a memory leak
@@ -21,6 +21,8 @@
 #define __OCLCONTEXT_CLASS__
 
 #include <list>
+#include <deque>
+#include <string>
 
 #include "CL\cl.h"
 #include "OCLMemoryObject.h"
@@ -28,6 +30,25 @@
 
 class OCLDevice;
 
+/* Times of the commands of a stage of a frame, in nanoseconds since the first command of the frame was queued:
+	when the first command of the stage was queued, submitted to the device and started, and when the last one ended.
+	busy is the time the commands of the stage took on the device added up, which may be less than end - start */
+struct StageTiming
+{
+	cl_ulong queued;
+	cl_ulong submit;
+	cl_ulong start;
+	cl_ulong end;
+	cl_ulong busy;
+	int commands; // amount of commands of the stage, all the times are 0 without them
+};
+
+/* Timing of each stage of a frame, indexed by ProfilingStage */
+struct FrameTiming
+{
+	StageTiming stages[ProfilingStageCount];
+};
+
 /* OCLContext class encapsules a context object, managing kernels and command queues, 
 	also alloc memory on the device */
 class OCLContext
@@ -46,6 +67,7 @@ public:
 	{
 		OCLMemoryObject<T>* newMem = new OCLMemoryObject<T>(this, m_queue, size, type, error);
 		m_memList.push_back(newMem);
+		m_allocationCount++;
 
 		return newMem;
 	}
@@ -76,8 +98,8 @@ public:
 	/* Call SyncDeviceToHost on all memories associated with this context. Return FALSE if at least
 		one memory syncronization failed */
 	bool SyncAllMemoryDeviceToHost();
-	/* Call SyncHostToDevice on all memories associated with this context. Return FALSE if at 
-		least one memory syncronization failed */
+	/* Call SyncDirtyHostToDevice on all memories associated with this context, so only the data changed on
+		the host since the last sync is uploaded. Return FALSE if at least one memory syncronization failed */
 	bool SyncAllMemoryHostToDevice();
 
 
@@ -96,15 +118,93 @@ public:
 	{
 		return m_queue;
 	}
+	/* Get the second command queue of this context, for reads that wait on events of the first one instead of
+		the commands queued after them */
+	inline const cl_command_queue GetCLTransferQueue()const
+	{
+		return m_transferQueue;
+	}
 	// Is this context ready to receive kernels?
 	inline bool IsReady()const
 	{
 		return m_isReady;
 	}
-	/* execute all commands on the command queue (call a clFlush), this is a blocking call.
+	/* Return the amount of memory objects created on this context since it was initialized. Once the buffers
+		of a scene and a resolution are in place, rendering again must not increase it */
+	inline int GetAllocationCount()const
+	{
+		return m_allocationCount;
+	}
+
+	/* Return the amount of bytes transferred between host and device memory objects of this context since it
+		was initialized, in each direction. Copies between device buffers are not included */
+	inline size_t GetBytesToDevice()const
+	{
+		return m_bytesToDevice;
+	}
+	inline size_t GetBytesToHost()const
+	{
+		return m_bytesToHost;
+	}
+
+	/* Called by the memory objects of this context on each transfer */
+	inline void AddBytesToDevice(const size_t bytes)
+	{
+		m_bytesToDevice += bytes;
+	}
+	inline void AddBytesToHost(const size_t bytes)
+	{
+		m_bytesToHost += bytes;
+	}
+
+	/* Profiling of the commands. The queue is created with profiling enabled, and while profiling is on or a trace
+		is recording, the memory objects and the kernels of this context keep an event of each command they send,
+		until CollectProfiling. Commands collected while a trace is recording are added to it */
+	inline void SetProfiling(const bool profiling)
+	{
+		m_profiling = profiling;
+	}
+	inline bool IsProfiling()const
+	{
+		return m_profiling;
+	}
+
+	/* Return where to store the event of the next command of the given stage, NULL when profiling is off.
+		name is the name of the command on the trace, the name of the stage by default.
+		The pointer is only valid until the next command */
+	cl_event* ProfilingEvent(const ProfilingStage stage, const std::string &name = std::string())const;
+
+	/* Return the name of a stage, such as "Upload" */
+	static const char* GetProfilingStageName(const ProfilingStage stage);
+
+	/* Return the amount of commands profiled and not collected yet */
+	inline int GetProfiledCommands()const
+	{
+		return m_profiledCommands.size();
+	}
+
+	/* Read the times of the first amount of commands profiled, all of them when amount is negative, into timing
+		and release their events. Those commands must be done. Return FALSE if some time couldn't be read */
+	bool CollectProfiling(FrameTiming &timing, int amount = -1);
+
+	/* Write size bytes of data at offset, in bytes, of a buffer of this context without waiting for it. data is
+		copied into memory of the context first, so the caller can change it right after, and that copy is released
+		once the write is done. event receives the write when it's not NULL. Return FALSE if it couldn't be enqueued */
+	bool WriteStaged(const cl_mem buffer, const size_t offset, const size_t size, const void* data, cl_event* event);
+
+	/* execute all commands on both command queues (call a clFinish), this is a blocking call.
 		return TRUE for sucess and FALSE for an error */
 	bool ExecuteCommands();
 
+	/* send all commands on both command queues to the device (call a clFlush) without waiting for them.
+		return TRUE for sucess and FALSE for an error */
+	bool FlushCommands();
+
+	/* Enqueue a marker on the command queue, event completes once every command queued before it is done.
+		Commands on the transfer queue wait on it instead of the whole queue. The caller releases event with
+		clReleaseEvent. Return FALSE for an error */
+	bool EnqueueMarker(cl_event* event);
+
 private:
 
 	// the device which this context is running
@@ -115,6 +215,8 @@ private:
 	cl_command_queue m_queue;
 	/*	I'll be using only one command queue for each context to keep things simple, 
 		maybe later I'll implement a command queue class and share it among contexts */
+	// reads of the frames of a sequence, so they run while the device traces the next one
+	cl_command_queue m_transferQueue;
 
 
 	// is this context ready to receive kernels?
@@ -122,6 +224,22 @@ private:
 
 	// list of memories associated with this context
 	std::list<OCLMemoryObjectBase*> m_memList;
+	// amount of memory objects created so far
+	int m_allocationCount;
+	// amount of bytes transferred so far on each direction
+	size_t m_bytesToDevice;
+	size_t m_bytesToHost;
+
+	// commands profiled and not collected yet, in the order they were sent
+	struct ProfiledCommand
+	{
+		ProfilingStage stage;
+		cl_event event; // NULL if the command couldn't be sent
+		std::string name;
+		double traceTime; // time on the trace when it was sent, see Trace::Now
+	};
+	bool m_profiling;
+	mutable std::deque<ProfiledCommand> m_profiledCommands;
 };
 
 
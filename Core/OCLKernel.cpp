@@ -45,24 +45,41 @@ OCLKernel::OCLKernel(OCLProgram* program,const std::string &name)
 
 	// init variables to kernel dispatch
 	m_workDim = 1;
-	m_globalWorkSize = 1;
+	m_globalWorkSize[0] = m_globalWorkSize[1] = 1;
+	m_localWorkSize[0] = m_localWorkSize[1] = 0;
+	if (clGetKernelWorkGroupInfo(m_kernel, program->GetContext()->GetDevice()->GetID(), CL_KERNEL_WORK_GROUP_SIZE,
+		sizeof(size_t), &m_maxWorkGroupSize, NULL) != CL_SUCCESS)
+	{
+		m_maxWorkGroupSize = 1;
+	}
 
 	m_kernelOk = true;
 }
 
-bool OCLKernel::EnqueueExecution()
+bool OCLKernel::EnqueueExecution(const ProfilingStage stage)
 {
-	/* For now, I'll let OpenCL implementation decide the size of each work-group */
-
 	cl_int error = CL_SUCCESS;
 
 	assert(m_kernelOk && "Kernel must be ready to execution");
 
+	/* Without a work-group size the OpenCL implementation decides it, otherwise the range
+	 * must be a multiple of it, so it's rounded up */
+	size_t globalWorkSize[2] = { m_globalWorkSize[0], m_globalWorkSize[1] };
+	const size_t* localWorkSize = NULL;
+	if (m_localWorkSize[0] > 0)
+	{
+		for (int d = 0; d < m_workDim; d++)
+		{
+			globalWorkSize[d] = (globalWorkSize[d] + m_localWorkSize[d] - 1) / m_localWorkSize[d] * m_localWorkSize[d];
+		}
+		localWorkSize = m_localWorkSize;
+	}
+
 	error = clEnqueueNDRangeKernel(m_program->GetContext()->GetCLQueue(), m_kernel, m_workDim,
 			NULL, // should always be NULL, this is from the OpenCL specification
-			&m_globalWorkSize, // the total amount of threads (work-itens)
-			NULL, // passing NULL on the size of the work-groups, OpenCL will hopefully pick the proper size
-			0,NULL, NULL); // events syncronization stuff
+			globalWorkSize, // the total amount of threads (work-itens)
+			localWorkSize, // the size of the work-groups, NULL lets OpenCL pick it
+			0,NULL, m_program->GetContext()->ProfilingEvent(stage, m_name)); // events syncronization stuff
 
 	if (error != CL_SUCCESS)
 	{
@@ -75,7 +92,7 @@ bool OCLKernel::EnqueueExecution()
 			errorString += "CL_INVALID_KERNEL_ARGS";
 			break;
 		case CL_INVALID_WORK_GROUP_SIZE:
-			errorString += "CL_INVALID_KERNEL_ARGS";
+			errorString += "CL_INVALID_WORK_GROUP_SIZE";
 			break;
 		case CL_INVALID_WORK_ITEM_SIZE:
 			errorString += "CL_INVALID_WORK_ITEM_SIZE";
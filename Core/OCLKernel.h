@@ -30,8 +30,9 @@ public:
 	~OCLKernel();
 
 	/*Enqueue execution of this kernel in the current command queue. Warning: the is a non-blocking call that will only
-		be executed when ExecuteCommands is called on OCLContext. Return FALSE for fail on execution */
-	bool EnqueueExecution();
+		be executed when ExecuteCommands is called on OCLContext. stage is where the execution is profiled, see 
+		ProfilingEvent on OCLContext. Return FALSE for fail on execution */
+	bool EnqueueExecution(const ProfilingStage stage = RaytraceStage);
 
 
 	/* Set argument list for this kernel, kernel must be ready. object parameter is a properly allocated memory,
@@ -54,6 +55,37 @@ public:
 		return true;
 	}
 
+	/* Set an argument passed by value, such as an int or a float. Same rules of the function above apply */
+	template<class T>
+	bool SetValueArgument(const int index, const T &value)
+	{
+		assert(index < m_argumentSize && "index cannot be higher than argument size");
+
+		cl_int error = clSetKernelArg(m_kernel, index, sizeof(T), &value);
+		if (error != CL_SUCCESS)
+		{
+			Log::Error("Couldn't set kernel argument on " + m_name);
+			return false;
+		}
+
+		return true;
+	}
+
+	/* Set a __local argument, size bytes of local memory shared by the work-items of each work-group */
+	bool SetLocalArgument(const int index, const size_t size)
+	{
+		assert(index < m_argumentSize && "index cannot be higher than argument size");
+
+		cl_int error = clSetKernelArg(m_kernel, index, size, NULL);
+		if (error != CL_SUCCESS)
+		{
+			Log::Error("Couldn't set kernel argument on " + m_name);
+			return false;
+		}
+
+		return true;
+	}
+
 	// return FALSE is the kernel was not ok (probrably there's no such kernel in this progrm)
 	inline bool GetOk()const
 	{
@@ -64,13 +96,39 @@ public:
 	inline void SetGlobalWorkSize(const size_t size)
 	{
 		assert(size > 0 && "Work itens should be bigger than 0!");
-		m_globalWorkSize = size;
+		m_workDim = 1;
+		m_globalWorkSize[0] = size;
+		m_globalWorkSize[1] = 1;
+	}
+
+	/* Set a two dimensional range of work-itens for this kernel, such as one work-iten per pixel of an image */
+	inline void SetGlobalWorkSize(const size_t width, const size_t height)
+	{
+		assert(width > 0 && height > 0 && "Work itens should be bigger than 0!");
+		m_workDim = 2;
+		m_globalWorkSize[0] = width;
+		m_globalWorkSize[1] = height;
+	}
+
+	/* Set the size of each work-group, a tile of width x height on two dimensional ranges. The range is rounded up
+		to whole work-groups, so the kernel must discard work-itens outside of it. 
+		0 lets the OpenCL implementation choose the size, which is the default */
+	inline void SetLocalWorkSize(const size_t width, const size_t height = 1)
+	{
+		m_localWorkSize[0] = width;
+		m_localWorkSize[1] = height;
 	}
 
 	// get the total amount of work-itens in all work-groups for this kernel
 	inline int GetGlobalWorkSize() const
 	{
-		return m_globalWorkSize;
+		return m_globalWorkSize[0] * m_globalWorkSize[1];
+	}
+
+	// get the maximum amount of work-itens on a work-group of this kernel on its device
+	inline size_t GetMaxWorkGroupSize() const
+	{
+		return m_maxWorkGroupSize;
 	}
 
 
@@ -88,10 +146,14 @@ private:
 
 	/* variable to control kernel execution*/
 
-	// the size of the work dimention, default 1 for now
+	// the size of the work dimention, 1 or 2
 	cl_int m_workDim;
-	// the total amount of work-itens in all work-groups
-	size_t m_globalWorkSize;
+	// the total amount of work-itens in all work-groups, on each dimension
+	size_t m_globalWorkSize[2];
+	// the size of the work-groups on each dimension, 0 if it's up to the OpenCL implementation
+	size_t m_localWorkSize[2];
+	// limit of work-itens on a work-group imposed by the resources this kernel uses
+	size_t m_maxWorkGroupSize;
 
 };
 
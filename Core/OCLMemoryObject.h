@@ -34,6 +34,17 @@ enum MemoryType
 	WriteOnly = CL_MEM_WRITE_ONLY
 };
 
+/* Stages of a frame timed by the profiling of the commands, see ProfilingEvent on OCLContext */
+enum ProfilingStage
+{
+	UploadStage,		// writes from host to device
+	RaytraceStage,		// the kernels tracing the frame
+	AntiAliasingStage,	// the FXAA kernel
+	CopyStage,			// copies and fills of device buffers
+	ReadbackStage,		// reads from device to host
+	ProfilingStageCount
+};
+
 
 class OCLContext;
 
@@ -45,6 +56,7 @@ public:
 	virtual ~OCLMemoryObjectBase(){};
 	virtual bool SyncHostToDevice() = 0;
 	virtual bool SyncDeviceToHost() = 0;
+	virtual bool SyncDirtyHostToDevice() = 0;
 };
 
 /* Memory object class stores any kind of data into an OpenCL device, contains methods for transferring data
@@ -57,7 +69,7 @@ public:
 	/* Set data on this memory. Parameter copy define if the data will be copied entirely or just the pointer;
 		if just the pointer is copied, the class will DELETE it after using it.
 		Bear in mind that this function WON'T transfer the data to the device, call the sync functions to do that. 
-		If there's another data previously loaded, the old one will be DELETED*/
+		If there's another data previously loaded, the old one will be DELETED. The whole memory is marked as dirty */
 	void SetData(T* data, bool copy = true)
 	{
 		if (m_data_host != NULL)
@@ -74,6 +86,48 @@ public:
 			// copy pointer only
 			m_data_host = data;
 		}
+		this->MarkDirty();
+	}
+
+	/* Dirty tracking. Changes made to the host memory through operator[] must be marked as dirty, 
+		so SyncDirtyHostToDevice uploads them. The dirty part is kept as a single range of elements */
+
+	/* Mark the whole memory as changed on the host */
+	inline void MarkDirty()
+	{
+		m_dirty_start = 0;
+		m_dirty_end = m_size;
+	}
+
+	/* Mark a range of elements as changed on the host, offset and amount are in elements */
+	inline void MarkDirty(const int offset, const int amount)
+	{
+		assert(offset >= 0 && offset + amount <= m_size && "You can't mark more memory than the buffer size");
+		if (amount <= 0)
+			return;
+
+		if (!this->IsDirty())
+		{
+			m_dirty_start = offset;
+			m_dirty_end = offset + amount;
+		}
+		else
+		{
+			m_dirty_start = std::min(m_dirty_start, offset);
+			m_dirty_end = std::max(m_dirty_end, offset + amount);
+		}
+	}
+
+	/* Host and device memories hold the same data, like on buffers written only by the device */
+	inline void MarkClean()
+	{
+		m_dirty_start = m_dirty_end = 0;
+	}
+
+	/* Return TRUE if the host memory has changes not uploaded to the device yet */
+	inline bool IsDirty()const
+	{
+		return m_dirty_end > m_dirty_start;
 	}
 	/* Get raw data currently on the host memory */
 	inline const T* GetData()const
@@ -110,7 +164,7 @@ public:
 		cl_int error;
 
 		error = clEnqueueCopyBuffer(m_queue, source->GetDeviceMemory(), m_data_device, sourceOffset * sizeof(T),
-			destOffset * sizeof(T), amount * sizeof(T), NULL, NULL, NULL);
+			destOffset * sizeof(T), amount * sizeof(T), NULL, NULL, m_context->ProfilingEvent(CopyStage));
 
 		if (error != CL_SUCCESS)
 		{
@@ -131,33 +185,158 @@ public:
 		return this->CopyFromMemoryBuffer(source, amount, sourceOffset, destOffset);
 	}
 
+	/* Set every element of the device buffer to value, without touching the host memory.
+		WARNING: the task will only be completed when the current command queue is flushed. Return FALSE if it failed */
+	bool FillDeviceMemory(const T &value)
+	{
+		if (clEnqueueFillBuffer(m_queue, m_data_device, &value, sizeof(T), 0, m_size * sizeof(T), 0, NULL,
+			m_context->ProfilingEvent(CopyStage)) != CL_SUCCESS)
+		{
+			Log::Error("Couldn't fill memory on " + m_context->GetDevice()->GetName() + " device");
+			return false;
+		}
+
+		return true;
+	}
+
 	/* Sync functions*/
 
-	/* Copy memory from host to device. WARNING: the task will only be completed when the current command queue is flushed,
+	/* Copy memory from host to device without waiting for it. The host memory is copied by the context first, 
+		so it can be changed right after this call, see WriteStaged on OCLContext.
+		WARNING: the task will only be completed when the current command queue is flushed,
 		call ExecuteCommands on OCLContext to guarantee a copy. Return FALSE if the allocation failed
 		*/
 	bool SyncHostToDevice()
 	{
 		assert(m_data_host != NULL && "You must set this memory before syncing with the device");
-		// add an command to the current command queue
-		//TODO: try using NON-blocking calls
-		if (clEnqueueWriteBuffer(m_queue, m_data_device, CL_TRUE, 0, sizeof(T)* m_size, m_data_host,0, NULL, NULL) != CL_SUCCESS)
+		if (!m_context->WriteStaged(m_data_device, 0, sizeof(T)* m_size, m_data_host, m_context->ProfilingEvent(UploadStage)))
 		{
 			Log::Error("Couldn't alloc enough memory on " + m_context->GetDevice()->GetName() + " device");
 			return false;
 		}
+		m_context->AddBytesToDevice(sizeof(T)* m_size);
+		this->MarkClean();
 		
 		return true;
 	}
+	/* Copy memory from host to device without waiting for it. The host memory must not be changed until the write
+		is done, the event returned tells when, and the caller releases it with clReleaseEvent. Event may be NULL when
+		the write is waited for through a command enqueued after this one. Return FALSE if the write couldn't be enqueued */
+	bool SyncHostToDevice(cl_event* event)
+	{
+		assert(m_data_host != NULL && "You must set this memory before syncing with the device");
+		cl_event* profilingEvent = m_context->ProfilingEvent(UploadStage);
+		if (clEnqueueWriteBuffer(m_queue, m_data_device, CL_FALSE, 0, sizeof(T)* m_size, m_data_host, 0, NULL,
+			profilingEvent != NULL ? profilingEvent : event) != CL_SUCCESS)
+		{
+			Log::Error("Couldn't write the memory on " + m_context->GetDevice()->GetName() + " device");
+			return false;
+		}
+		/* the context keeps its own reference to the event */
+		if (profilingEvent != NULL && event != NULL)
+		{
+			*event = *profilingEvent;
+			clRetainEvent(*event);
+		}
+		m_context->AddBytesToDevice(sizeof(T)* m_size);
+		this->MarkClean();
+
+		return true;
+	}
+
+	/* Copy only a range of the memory from host to device, offset and amount are in elements,
+		NOT the size in bytes. Same warnings of the function above apply */
+	bool SyncHostToDevice(const int offset, const int amount)
+	{
+		assert(m_data_host != NULL && "You must set this memory before syncing with the device");
+		assert(offset >= 0 && offset + amount <= m_size && "You can't sync more memory than the buffer size");
+
+		if (!m_context->WriteStaged(m_data_device, offset * sizeof(T), sizeof(T)* amount, m_data_host + offset,
+			m_context->ProfilingEvent(UploadStage)))
+		{
+			Log::Error("Couldn't write the memory on " + m_context->GetDevice()->GetName() + " device");
+			return false;
+		}
+		m_context->AddBytesToDevice(sizeof(T)* amount);
+
+		/* the dirty range is only cleared when this write covers it */
+		if (offset <= m_dirty_start && offset + amount >= m_dirty_end)
+			this->MarkClean();
+
+		return true;
+	}
+
+	/* Copy from host to device only the range marked as dirty since the last sync, nothing if the memory
+		is clean. Same warnings of the functions above apply */
+	bool SyncDirtyHostToDevice()
+	{
+		if (!this->IsDirty())
+			return true;
+
+		return this->SyncHostToDevice(m_dirty_start, m_dirty_end - m_dirty_start);
+	}
+
 	/* Copy memory from device to host, this causes an intrinsic flush on the command queue.
 		return FALSE if the allocation failed*/
 	bool SyncDeviceToHost()
 	{
-		if (clEnqueueReadBuffer(m_queue, m_data_device, CL_TRUE, 0, sizeof(T)* m_size, m_data_host,0, NULL, NULL) != CL_SUCCESS)
+		if (clEnqueueReadBuffer(m_queue, m_data_device, CL_TRUE, 0, sizeof(T)* m_size, m_data_host,0, NULL, 
+			m_context->ProfilingEvent(ReadbackStage)) != CL_SUCCESS)
+		{
+			Log::Error("Couldn't read the memory on " + m_context->GetDevice()->GetName() + " device");
+			return false;
+		}
+		m_context->AddBytesToHost(sizeof(T)* m_size);
+		this->MarkClean();
+
+		return true;
+	}
+
+	/* Copy memory from device to host without waiting for it. The host memory must not be used until the event 
+		returned is complete, then the caller releases it with clReleaseEvent. Event may be NULL when the memory is
+		waited for through a command enqueued after this one. The command is only sent to the device 
+		when the queue is flushed, see FlushCommands on OCLContext. Return FALSE if the read couldn't be enqueued */
+	bool SyncDeviceToHost(cl_event* event)
+	{
+		cl_event* profilingEvent = m_context->ProfilingEvent(ReadbackStage);
+		if (clEnqueueReadBuffer(m_queue, m_data_device, CL_FALSE, 0, sizeof(T)* m_size, m_data_host, 0, NULL, 
+			profilingEvent != NULL ? profilingEvent : event) != CL_SUCCESS)
+		{
+			Log::Error("Couldn't read the memory on " + m_context->GetDevice()->GetName() + " device");
+			return false;
+		}
+		/* the context keeps its own reference to the event */
+		if (profilingEvent != NULL && event != NULL)
+		{
+			*event = *profilingEvent;
+			clRetainEvent(*event);
+		}
+		m_context->AddBytesToHost(sizeof(T)* m_size);
+		this->MarkClean();
+
+		return true;
+	}
+
+	/* Same as above, but the read goes on the transfer queue of the context and waits only for after, usually a
+		marker from EnqueueMarker on OCLContext, so it runs while the device works on the commands queued after 
+		the marker. FlushCommands on OCLContext sends it to the device */
+	bool SyncDeviceToHost(const cl_event after, cl_event* event)
+	{
+		cl_event* profilingEvent = m_context->ProfilingEvent(ReadbackStage);
+		if (clEnqueueReadBuffer(m_context->GetCLTransferQueue(), m_data_device, CL_FALSE, 0, sizeof(T)* m_size, 
+			m_data_host, 1, &after, profilingEvent != NULL ? profilingEvent : event) != CL_SUCCESS)
 		{
 			Log::Error("Couldn't read the memory on " + m_context->GetDevice()->GetName() + " device");
 			return false;
 		}
+		/* the context keeps its own reference to the event */
+		if (profilingEvent != NULL && event != NULL)
+		{
+			*event = *profilingEvent;
+			clRetainEvent(*event);
+		}
+		m_context->AddBytesToHost(sizeof(T)* m_size);
+		this->MarkClean();
 
 		return true;
 	}
@@ -171,7 +350,7 @@ private:
 
 	/* Only OCLContext is able to create those objects
 	size is the number of elements, NOT the size in bytes*/
-	OCLMemoryObject(const OCLContext* context,const cl_command_queue queue,const int size,const MemoryType type,cl_bool* error)
+	OCLMemoryObject(OCLContext* context,const cl_command_queue queue,const int size,const MemoryType type,cl_bool* error)
 	{
 		assert(size > 0 && "Size should be at least 1!");
 		assert(context != NULL);
@@ -181,6 +360,7 @@ private:
 		this->m_context = context;
 		this->m_queue = queue;
 		this->m_size = size;
+		this->m_dirty_start = this->m_dirty_end = 0;
 
 
 		// create OpenCL memory
@@ -216,7 +396,7 @@ private:
 	friend class OCLContext;
 
 	// context to which this block of data is associated
-	const OCLContext* m_context;
+	OCLContext* m_context;
 	cl_command_queue m_queue;
 
 	// raw host data
@@ -225,6 +405,9 @@ private:
 	cl_mem m_data_device;
 	// number of elements 
 	int m_size;
+	// range of elements changed on the host and not uploaded yet, empty if start >= end
+	int m_dirty_start;
+	int m_dirty_end;
 };
 
 
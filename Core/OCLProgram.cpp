@@ -18,8 +18,64 @@
 
 #include "OCLProgram.h"
 #include "OCLDevice.h"
+#include "Trace.h"
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
 
 std::string OCLProgram::s_path;
+std::string OCLProgram::s_cachePath;
+bool OCLProgram::s_customCachePath = false;
+bool OCLProgram::s_cacheEnabled = true;
+
+/* FNV-1a hash, used to name the files of the program binaries cache */
+static void HashBytes(const char* data, const size_t size, cl_ulong& hash)
+{
+	for (size_t i = 0; i < size; i++)
+	{
+		hash ^= (unsigned char)data[i];
+		hash *= 1099511628211ULL;
+	}
+}
+
+static void HashString(const std::string& data, cl_ulong& hash)
+{
+	/* the size is hashed too, so consecutive strings can't be confused with each other */
+	size_t size = data.size();
+	HashBytes((const char*)&size, sizeof(size_t), hash);
+	HashBytes(data.c_str(), size, hash);
+}
+
+/* Hash the files included by source with #include "file", searching them on path. 
+	Files included by them are hashed as well */
+static void HashIncludes(const std::string& path, const std::string& source, cl_ulong& hash, const int depth = 0)
+{
+	/* stop on cyclic includes, the compiler will complain about them anyway */
+	if (depth > 8)
+		return;
+
+	size_t position = 0;
+	while ((position = source.find("#include", position)) != std::string::npos)
+	{
+		position += 8;
+		size_t start = source.find_first_of("\"\n", position);
+		if (start == std::string::npos || source[start] != '"')
+			continue;
+		size_t end = source.find('"', start + 1);
+		if (end == std::string::npos)
+			break;
+
+		std::string file = source.substr(start + 1, end - start - 1);
+		HashString(file, hash);
+
+		std::ifstream stream(path + file, std::ios::binary);
+		std::string content((std::istreambuf_iterator<char>(stream)), std::istreambuf_iterator<char>());
+		HashString(content, hash);
+		HashIncludes(path, content, hash, depth + 1);
+		position = end;
+	}
+}
 
 OCLProgram::OCLProgram(OCLContext* context)
 {
@@ -29,6 +85,7 @@ OCLProgram::OCLProgram(OCLContext* context)
 	assert(context->IsReady() && "Context must be ready to execute kernels!");
 
 	m_isCompiled = false;
+	m_program = NULL;
 }
 
 OCLProgram::~OCLProgram()
@@ -39,7 +96,8 @@ OCLProgram::~OCLProgram()
 	{
 		delete m_sourceCodeList[a];
 	}
-	clReleaseProgram(m_program);
+	if (m_program != NULL)
+		clReleaseProgram(m_program);
 }
 
 bool OCLProgram::LoadSource(const std::string &sourceFile)
@@ -80,6 +138,34 @@ bool OCLProgram::LoadSource(const std::string &sourceFile)
 
 bool OCLProgram::BuildProgram(const std::string &options)
 {
+	TraceSpan span("Kernel build", "program");
+	std::string options_str = options;
+
+	if (!s_path.empty())
+	{
+		// We must provide the include paths for OpenCL compiler for includes
+		// within .cl files (e.g. FXAA.cl)
+		options_str += " -I \"" + s_path + "\"";
+	}
+
+	auto pretime = std::chrono::high_resolution_clock::now();
+
+	/* look for a binary of this program built before */
+	std::string cachePath;
+	if (s_cacheEnabled)
+	{
+		cachePath = this->GetBinaryCachePath(options_str);
+		if (this->BuildFromBinary(cachePath, options_str))
+		{
+			std::chrono::milliseconds ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+				std::chrono::high_resolution_clock::now() - pretime);
+			Log::Message("Program binary cache hit, loaded " + cachePath + " in " + std::to_string(ms.count()) + "ms");
+			m_isCompiled = true;
+			return true;
+		}
+		Log::Message("Program binary cache miss for " + cachePath);
+	}
+
 	// now the building phase
 
 	cl_int error;
@@ -110,15 +196,6 @@ bool OCLProgram::BuildProgram(const std::string &options)
 		return false;
 	}
 
-	std::string options_str = options;
-
-	if (!s_path.empty())
-	{
-		// We must provide the include paths for OpenCL compiler for includes
-		// within .cl files (e.g. FXAA.cl)
-		options_str += " -I \"" + s_path + "\"";
-	}
-
 	error = clBuildProgram(m_program, 0, NULL, options_str.c_str(), NULL, NULL);
 
 	if (error != CL_SUCCESS)
@@ -150,7 +227,90 @@ bool OCLProgram::BuildProgram(const std::string &options)
 	// ok, cool
 	m_isCompiled = true;
 
+	std::chrono::milliseconds ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+		std::chrono::high_resolution_clock::now() - pretime);
+	Log::Message("Program built from source in " + std::to_string(ms.count()) + "ms");
+
+	/* a program that can't be cached still works, only the next build will take longer */
+	if (s_cacheEnabled && !this->SaveBinary(cachePath))
+		Log::Message("Couldn't write the program binary cache at " + cachePath);
+
 	return true;
 
 }
 
+std::string OCLProgram::GetBinaryCachePath(const std::string &options)const
+{
+	cl_ulong hash = 14695981039346656037ULL;
+	for (unsigned int a = 0; a < m_sourceCodeList.size(); a++)
+	{
+		std::string source(m_sourceCodeList[a], m_sourceSizes[a]);
+		HashString(source, hash);
+		HashIncludes(s_path, source, hash);
+	}
+	HashString(options, hash);
+
+	/* binaries are only valid for the same device and driver */
+	const OCLDevice* device = m_context->GetDevice();
+	HashString(device->GetName(), hash);
+	HashString(device->GetVendor(), hash);
+	HashString(device->GetVersion(), hash);
+	HashString(device->GetClVersion(), hash);
+
+	std::stringstream name;
+	name << (s_customCachePath ? s_cachePath : s_path) << "RenderGirl_" << std::hex << std::setw(16) << std::setfill('0') << hash << ".bin";
+	return name.str();
+}
+
+bool OCLProgram::BuildFromBinary(const std::string &path, const std::string &options)
+{
+	std::ifstream file(path, std::ios::binary);
+	if (!file.is_open())
+		return false;
+
+	std::vector<char> binary((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+	if (binary.empty())
+		return false;
+
+	cl_int error;
+	cl_int binaryStatus;
+	cl_device_id device = m_context->GetDevice()->GetID();
+	size_t size = binary.size();
+	const unsigned char* binaryPointer = (const unsigned char*)&binary[0];
+	m_program = clCreateProgramWithBinary(m_context->GetCLContext(), 1, &device, &size, &binaryPointer, &binaryStatus, &error);
+	if (error != CL_SUCCESS || binaryStatus != CL_SUCCESS)
+	{
+		m_program = NULL;
+		return false;
+	}
+
+	/* a binary still must be built, an outdated or corrupted one is discarded and the sources are compiled */
+	if (clBuildProgram(m_program, 1, &device, options.c_str(), NULL, NULL) != CL_SUCCESS)
+	{
+		clReleaseProgram(m_program);
+		m_program = NULL;
+		return false;
+	}
+
+	return true;
+}
+
+bool OCLProgram::SaveBinary(const std::string &path)const
+{
+	size_t size = 0;
+	if (clGetProgramInfo(m_program, CL_PROGRAM_BINARY_SIZES, sizeof(size_t), &size, NULL) != CL_SUCCESS || size == 0)
+		return false;
+
+	std::vector<unsigned char> binary(size);
+	unsigned char* binaryPointer = &binary[0];
+	if (clGetProgramInfo(m_program, CL_PROGRAM_BINARIES, sizeof(unsigned char*), &binaryPointer, NULL) != CL_SUCCESS)
+		return false;
+
+	std::ofstream file(path, std::ios::binary);
+	if (!file.is_open())
+		return false;
+	file.write((const char*)binaryPointer, size);
+
+	return file.good();
+}
+
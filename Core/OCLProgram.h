@@ -36,7 +36,9 @@ public:
 
 	/* Build the loaded OpenCL program in a given context, options argument is a set
 		of options to the OpenCL compiler, return FALSE if there was a problem.
-		For the list of avaiable options, please refer to OpenCL documentation */
+		For the list of avaiable options, please refer to OpenCL documentation.
+		The binary of the built program is cached on disk, later builds of the same sources, included files, 
+		options, device and driver load it instead of compiling the sources again */
 	bool BuildProgram(const std::string &options = std::string());
 
 
@@ -46,6 +48,20 @@ public:
 		s_path = directory;
 	}
 
+	/* Set the directory where the binaries of built programs are cached, it must exist and end with a separator.
+		By default they are stored on the same directory of the .cl source files. */
+	inline static void SetBinaryCacheDirectory(const std::string& directory)
+	{
+		s_cachePath = directory;
+		s_customCachePath = true;
+	}
+
+	/* Enable or disable the cache of program binaries, enabled by default */
+	inline static void SetBinaryCacheEnabled(const bool enabled)
+	{
+		s_cacheEnabled = enabled;
+	}
+
 	/* Return TRUE if this program is ready to be executed */
 	inline bool IsCompiled() const
 	{
@@ -65,6 +81,16 @@ public:
 	}
 
 private:
+	/* Return the path of the cache file of this program built with the given options, named after 
+		a hash of the sources, the files they include, the options and the device and driver versions */
+	std::string GetBinaryCachePath(const std::string &options)const;
+
+	/* Create and build the program from a cached binary, return FALSE if there's no valid binary at path */
+	bool BuildFromBinary(const std::string &path, const std::string &options);
+
+	/* Write the binary of the built program at path, return FALSE if there was a problem */
+	bool SaveBinary(const std::string &path)const;
+
 	// the contex on where this program is running
 	const OCLContext* m_context;
 	// the OpenCL program
@@ -81,6 +107,10 @@ private:
 	std::vector<int> m_sourceSizes;
     // path to look for .cl sources
     static std::string s_path;
+	// path to store the binaries of built programs and if it was set by the user
+	static std::string s_cachePath;
+	static bool s_customCachePath;
+	static bool s_cacheEnabled;
 };
 
 
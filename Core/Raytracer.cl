@@ -17,6 +17,17 @@
 	*/
 
 #define SMALL_NUM  0.00000001f // anything that avoids division overflow
+#define SHADOW_BIAS 0.0001f // distance shadow rays start away from the surface, relative to the magnitude of the point
+
+/* Specialized builds receive the scene information as compile time constants with -D SCENE_SPECIALIZED,
+ * so they are folded into the code instead of being read from the SceneInformation buffer by every pixel */
+#ifndef SCENE_SPECIALIZED
+#define SCENE_WIDTH (sceneInfo->width)
+#define SCENE_HEIGHT (sceneInfo->height)
+#define SCENE_PROPORTION_X (sceneInfo->proportion_x)
+#define SCENE_PROPORTION_Y (sceneInfo->proportion_y)
+#define SCENE_BVH_SIZE (sceneInfo->bvhSize)
+#endif // SCENE_SPECIALIZED
 
 #include "FXAA.cl"
 
@@ -52,7 +63,7 @@ typedef struct SceneInformation
 	int height;
 	int pixelCount;
 	int groupsSize;
-	int bvhSize;
+	int bvhSize; /* amount of nodes of the object level BVH */
 	float proportion_x;
 	float proportion_y;
 } SceneInformation;
@@ -92,11 +103,119 @@ typedef struct BVHTreeNode
 	* packet_indexes.s[0]
 	*
 	* The second element is only valid on leaf nodes, it points to
-	* position within the SceneGroupStruct array, -1 otherwise */
+	* the first face of the leaf within the global faces buffer, -1 otherwise */
 	int2 packet_indexes;
-    int2 padding; /* extra 8 bytes due do memory aligment */
+	/* Only valid on leaf nodes, the first element is the amount of faces
+	* on this leaf and the second element is the position of the group
+	* which the faces belong within the SceneGroupStruct array.
+	* On a leaf holding an instance the amount of faces is -1 and the
+	* second element of packet_indexes is the index of the instance */
+	int2 leaf_info;
 }BVHTreeNode;
 
+/* Amount of entries of the traversal stack used on the ordered traversal of the binary BVH */
+#define BVH_ORDERED_STACK_SIZE 64
+
+/* Amount of entries of the traversal stack used on the wide BVH */
+#define BVH_WIDE_STACK_SIZE 64
+
+/* A node of the wide BVH, collapsing up to 4 nodes of the binary BVH into one. The AABBs
+of the children are stored as a structure of arrays, so they are tested all at once */
+typedef struct BVH4Node
+{
+	/* one element for each child */
+	float4 min_x;
+	float4 min_y;
+	float4 min_z;
+	float4 max_x;
+	float4 max_y;
+	float4 max_z;
+
+	/* Index of each child inside the wide traversal array. On leaves it's the first face of the
+	* leaf within the global faces buffer, or the index of the instance. -1 on empty slots */
+	int4 child;
+	/* Amount of faces on each leaf child, 0 on middle nodes and -1 on leaves holding an instance */
+	int4 count;
+	/* Position of the group which the faces of each leaf child belong within the SceneGroupStruct array */
+	int4 group;
+}BVH4Node;
+
+/* A node of the wide BVH with the AABBs of the children quantized to 8 bits, packed into a single
+cache line. The AABB of child c covers origin + min * 2^exponent to origin + max * 2^exponent
+on each axis, rounded outwards so it always contains the exact one */
+typedef struct BVH4QNode
+{
+	/* same as BVH4Node::child */
+	int4 child;
+
+	/* minimum corner of the AABB of this node and the power of two of the quantization step on each axis */
+	float origin_x;
+	float origin_y;
+	float origin_z;
+	char4 exponent;
+
+	/* one element for each child, in steps of the quantization grid */
+	uchar4 min_x;
+	uchar4 min_y;
+	uchar4 min_z;
+	uchar4 max_x;
+	uchar4 max_y;
+	uchar4 max_z;
+
+	/* Amount of faces on each leaf child, 0 on middle nodes and 255 on leaves holding an instance.
+	* The group of the faces is taken from the fourth element of the first face of the leaf */
+	uchar4 count;
+	int padding;
+}BVH4QNode;
+
+/* InstanceStruct holds info about an instance of a scene group. The BVH of the group is stored
+once after the object level BVH, and rays are transformed into its object space */
+typedef struct InstanceStruct
+{
+	float4 world_to_object[3]; /* rows of the 3x4 matrix transforming world space into object space */
+	int bvhStart; /* position of the root node of the group BVH on the traversal array */
+	int bvhEnd; /* escape index of that root node, the group BVH covers the range [bvhStart, bvhEnd) */
+	int2 padding;
+}InstanceStruct;
+
+/* Sum of the efficiency counters of the work-items of a work-group, see RayCounters */
+typedef struct EfficiencyCounters
+{
+	ulong intersect_tests;
+	ulong intersect_hits;
+	ulong box_tests;
+	ulong nodes_visited;
+	ulong leaves_visited;
+}EfficiencyCounters;
+
+/* Node of the traversal array the kernel was compiled for */
+#if defined(BVH_COMPRESSED)
+typedef BVH4QNode BVHNode;
+#elif defined(BVH_WIDE)
+typedef BVH4Node BVHNode;
+#else
+typedef BVHTreeNode BVHNode;
+#endif
+
+/* Work done by a work-item, counted on private memory and added up by its work-group at the end of the kernel.
+ * A box test is each AABB tested against a ray, a node is visited when its box was hit and its children are
+ * looked at, and a leaf is visited when its faces are tested */
+typedef struct RayCounters
+{
+	uint intersect_tests;
+	uint intersect_hits;
+	uint box_tests;
+	uint nodes_visited;
+	uint leaves_visited;
+}RayCounters;
+
+/* metrics are not compiled depending on user configuration, the traversal cost of each pixel needs them too */
+#if defined(EFFICIENCY_METRICS) || defined(TRAVERSAL_COST)
+#define COUNT(counter, amount) (counters->counter += (amount))
+#else
+#define COUNT(counter, amount)
+#endif // EFFICIENCY_METRICS
+
 
 /* Kay and Kayjia ray-box intersection algorithm */
 bool RayBoxIntersect(
@@ -117,6 +236,29 @@ bool RayBoxIntersect(
     return minmax >= maxmin;
 }
 
+/* Same as RayBoxIntersect, but only accepts boxes in front of the origin and not beyond max_distance.
+ * inv_D is the inverse of the ray direction, and the distance where the ray enters the box goes to t_near */
+bool RayBoxIntersectDistance(
+    const float3 O, // Ray origin
+    const float3 inv_D, // Inverse of the ray direction
+    const CL_AABB box,
+    const float max_distance,
+    float* t_near)
+{
+    float3 tmin = (box.point_min - O) * inv_D;
+    float3 tmax = (box.point_max - O) * inv_D;
+
+    float3 real_min = min(tmin, tmax);
+    float3 real_max = max(tmin, tmax);
+
+    /* enlarged by a few ulps as on the wide traversal, rays grazing a box would be lost to rounding */
+    float minmax = min(min(real_max.x, real_max.y), real_max.z) * 1.00000036f;
+    float maxmin = max(max(real_min.x, real_min.y), real_min.z);
+
+    *t_near = maxmin;
+    return minmax >= max(maxmin, 0.0f) && maxmin <= max_distance;
+}
+
 
 /* MllerTrumbore intersection algorithm - http://en.wikipedia.org/wiki/M%C3%B6ller%E2%80%93Trumbore_intersection_algorithm */
 int Intersect(const float3   V1,  // Triangle vertices
@@ -183,28 +325,283 @@ int Intersect(const float3   V1,  // Triangle vertices
 
 }
 
-/* Here starts the raytracer*/
-__kernel void Raytrace(__global float3* vertices, __global int4* faces, __global SceneGroupStruct* groups, __global Material* materials,
-	__global BVHTreeNode* bvhTreeNode, __global SceneInformation* sceneInfo, __global uchar4* frame, __global Camera* camera,
-	__global Light* light, __global uint* intersectCounter, __global uint* intersectHitCounter)
+/* Transform a point (w = 1) or a direction (w = 0) by a 3x4 matrix given by its rows */
+float3 TransformByRows(__global const float4* rows, const float3 v, const float w)
 {
-	int id = get_global_id(0);
-	// grab XY coordinate of this instance
-	int x = id % sceneInfo->width;
-	int y = id / sceneInfo->height;
+	float4 v4 = (float4)(v, w);
+	return (float3)(dot(rows[0], v4), dot(rows[1], v4), dot(rows[2], v4));
+}
+
+/* Test the ray against the faces [facesStart, facesEnd) of a leaf, keeping the closest hit on the
+ * last arguments. group and instance are the ones the faces of this leaf belong */
+void IntersectFaces(__global float3* vertices, __global int4* faces, const int facesStart, const int facesEnd,
+	const int group, const int instance, const float3 O, const float3 D, float* maxDistance, int* face_i,
+	float3* point_i, float3* normal, int* groupIndex, int* instance_hit, RayCounters* counters)
+{
+	float distance;
+	COUNT(leaves_visited, 1);
+	for (int k = facesStart; k < facesEnd; k++)
+	{
+		int result;
+		float3 temp_point; // temporary intersection point
+		float3 temp_normal;// temporary normal vector
 
+		COUNT(intersect_tests, 1);
 
-	/* Using the syntax frame[x][y] produces different behaviour on different platforms (doesn't work on NVIDIA GPUS)
-	So use the XYZ to access the members of any vector types */
+		result = Intersect(vertices[faces[k].x],
+			vertices[faces[k].y],
+			vertices[faces[k].z],
+			O, D, &temp_normal, &temp_point, &distance);
+
+		if (result > 0)
+		{
+			//some collision
+			if (distance < *maxDistance) // check if it's the closest to the camera so far
+			{
+				*maxDistance = distance;
+				*face_i = k;
+				*point_i = temp_point;
+				*normal = temp_normal;
+				*groupIndex = group;
+				*instance_hit = instance;
+			}
+			COUNT(intersect_hits, 1);
+		}
+	}
+}
+
+/* Moller-Trumbore test for shadow rays, it only tells if the face blocks the ray before max_distance,
+ * without computing the normal or the intersection point */
+bool IntersectAny(const float3 V1, const float3 V2, const float3 V3, const float3 O, const float3 D, const float max_distance)
+{
+	float3 e1 = V2 - V1;
+	float3 e2 = V3 - V1;
+	float3 P = cross(D, e2);
+	float det = dot(e1, P);
+	if (det > -SMALL_NUM && det < SMALL_NUM) return false;
+	float inv_det = 1.f / det;
+
+	float3 T = O - V1;
+	float u = dot(T, P) * inv_det;
+	if (u < 0.f || u > 1.f) return false;
+
+	float3 Q = cross(T, e1);
+	float v = dot(D, Q) * inv_det;
+	if (v < 0.f || u + v > 1.f) return false;
+
+	float t = dot(e2, Q) * inv_det;
+	return t > SMALL_NUM && t < max_distance;
+}
+
+/* Test the ray against the faces [facesStart, facesEnd) of a leaf, returning on the first one blocking it */
+bool IntersectFacesAny(__global float3* vertices, __global int4* faces, const int facesStart, const int facesEnd,
+	const float3 O, const float3 D, const float max_distance, RayCounters* counters)
+{
+	COUNT(leaves_visited, 1);
+	for (int k = facesStart; k < facesEnd; k++)
+	{
+		COUNT(intersect_tests, 1);
+		if (IntersectAny(vertices[faces[k].x], vertices[faces[k].y], vertices[faces[k].z], O, D, max_distance))
+		{
+			COUNT(intersect_hits, 1);
+			return true;
+		}
+	}
+	return false;
+}
+
+#ifdef BVH_WIDE
+/* Slab test of the ray against the AABBs of the 4 children of a wide node at once. Returns the mask of the
+ * children hit in front of the origin and not beyond max_distance. The distance where the ray enters each
+ * child goes to t_near_out and the amount of faces of each child to count_out, -1 on instances */
+int4 IntersectChildren(__global BVHNode* node, const float3 O, const float3 inv_D, const float max_distance,
+	float4* t_near_out, int4* count_out)
+{
+#ifdef BVH_COMPRESSED
+	/* decode the AABBs of the children, the step is built straight from the bits of the exponent */
+	float4 step = as_float4((convert_int4(node->exponent) + 127) << 23);
+	float4 min_x = node->origin_x + convert_float4(node->min_x) * step.x;
+	float4 min_y = node->origin_y + convert_float4(node->min_y) * step.y;
+	float4 min_z = node->origin_z + convert_float4(node->min_z) * step.z;
+	float4 max_x = node->origin_x + convert_float4(node->max_x) * step.x;
+	float4 max_y = node->origin_y + convert_float4(node->max_y) * step.y;
+	float4 max_z = node->origin_z + convert_float4(node->max_z) * step.z;
+	int4 count = convert_int4(node->count);
+	count = select(count, (int4)(-1), count == 255);
+#else
+	float4 min_x = node->min_x;
+	float4 min_y = node->min_y;
+	float4 min_z = node->min_z;
+	float4 max_x = node->max_x;
+	float4 max_y = node->max_y;
+	float4 max_z = node->max_z;
+	int4 count = node->count;
+#endif // BVH_COMPRESSED
+
+	/* slabs of the 4 children at once */
+	float4 t1 = (min_x - O.x) * inv_D.x;
+	float4 t2 = (max_x - O.x) * inv_D.x;
+	float4 t_near = min(t1, t2);
+	float4 t_far = max(t1, t2);
+	t1 = (min_y - O.y) * inv_D.y;
+	t2 = (max_y - O.y) * inv_D.y;
+	t_near = max(t_near, min(t1, t2));
+	t_far = min(t_far, max(t1, t2));
+	t1 = (min_z - O.z) * inv_D.z;
+	t2 = (max_z - O.z) * inv_D.z;
+	t_near = max(t_near, min(t1, t2));
+	t_far = min(t_far, max(t1, t2));
+
+	/* boxes behind the ray or farther than the closest hit so far are skipped. t_far is enlarged by
+	 * a few ulps, rays grazing a box would be lost to rounding otherwise (Ize, "Robust BVH Ray Traversal") */
+	t_far *= 1.00000036f;
+	*t_near_out = t_near;
+	*count_out = count;
+	return (t_far >= max(t_near, 0.0f)) & (t_near <= max_distance) & (node->child != -1);
+}
+
+/* Amount of children of a wide node, the boxes tested by IntersectChildren */
+int ChildrenCount(__global BVHNode* node)
+{
+	int4 valid = node->child != -1;
+	return -(valid.x + valid.y + valid.z + valid.w);
+}
+#endif // BVH_WIDE
+
+/* Any-hit traversal for shadow rays, returns true as soon as a face blocks the ray from O up to max_distance.
+ * The order of the children doesn't matter, so the wide BVH pushes them unsorted and the binary BVH is
+ * always traversed without a stack */
+bool Occluded(__global float3* vertices, __global int4* faces, __global BVHNode* bvhTreeNode,
+	__global InstanceStruct* instances, const int bvhSize, const float3 O, const float3 D, const float max_distance,
+	RayCounters* counters)
+{
+	float3 traversal_origin = O;
+	float3 traversal_dir = D;
+	float3 inv_dir = 1.0f / D;
+	int instance = -1;
+
+#ifdef BVH_WIDE
+	int stack[BVH_WIDE_STACK_SIZE];
+	int stack_size = 0;
+	int instance_stack = 0;
+	stack[stack_size++] = 0;
+
+	while (stack_size > 0)
+	{
+		if (instance != -1 && stack_size == instance_stack)
+		{
+			traversal_origin = O;
+			traversal_dir = D;
+			inv_dir = 1.0f / traversal_dir;
+			instance = -1;
+		}
+
+		int i = stack[--stack_size];
+		if (i < 0)
+		{
+			instance = -2 - i;
+			traversal_origin = TransformByRows(instances[instance].world_to_object, O, 1.0f);
+			traversal_dir = TransformByRows(instances[instance].world_to_object, D, 0.0f);
+			inv_dir = 1.0f / traversal_dir;
+			instance_stack = stack_size;
+			stack[stack_size++] = instances[instance].bvhStart;
+			continue;
+		}
+
+		float4 t_near;
+		int4 count;
+		int4 hit = IntersectChildren(&bvhTreeNode[i], traversal_origin, inv_dir, max_distance, &t_near, &count);
+		COUNT(nodes_visited, 1);
+		COUNT(box_tests, ChildrenCount(&bvhTreeNode[i]));
+
+		int hit_array[4];
+		int child_array[4];
+		int count_array[4];
+		vstore4(hit, 0, hit_array);
+		vstore4(bvhTreeNode[i].child, 0, child_array);
+		vstore4(count, 0, count_array);
+		for (int c = 0; c < 4; c++)
+		{
+			if (!hit_array[c])
+				continue;
 
+			if (count_array[c] > 0)
+			{
+				if (IntersectFacesAny(vertices, faces, child_array[c], child_array[c] + count_array[c],
+					traversal_origin, traversal_dir, max_distance, counters))
+					return true;
+				continue;
+			}
+
+			stack[stack_size++] = count_array[c] == 0 ? child_array[c] : -2 - child_array[c];
+		}
+	}
+#else
+	int resume = 0;
+	int end = bvhSize;
+	int i = 0;
+	float t_near;
+	while (i < end || instance != -1)
+	{
+		if (i >= end)
+		{
+			i = resume;
+			end = bvhSize;
+			traversal_origin = O;
+			traversal_dir = D;
+			inv_dir = 1.0f / traversal_dir;
+			instance = -1;
+			continue;
+		}
+
+		COUNT(box_tests, 1);
+		if (!RayBoxIntersectDistance(traversal_origin, inv_dir, bvhTreeNode[i].aabb, max_distance, &t_near))
+		{
+			i = bvhTreeNode[i].packet_indexes.x;
+			continue;
+		}
+		COUNT(nodes_visited, 1);
+
+		if (bvhTreeNode[i].leaf_info.x == -1)
+		{
+			instance = bvhTreeNode[i].packet_indexes.y;
+			traversal_origin = TransformByRows(instances[instance].world_to_object, O, 1.0f);
+			traversal_dir = TransformByRows(instances[instance].world_to_object, D, 0.0f);
+			inv_dir = 1.0f / traversal_dir;
+			resume = i + 1;
+			i = instances[instance].bvhStart;
+			end = instances[instance].bvhEnd;
+			continue;
+		}
+		else if (bvhTreeNode[i].packet_indexes.y != -1)
+		{
+			int facesStart = bvhTreeNode[i].packet_indexes.y;
+			if (IntersectFacesAny(vertices, faces, facesStart, facesStart + bvhTreeNode[i].leaf_info.x,
+				traversal_origin, traversal_dir, max_distance, counters))
+				return true;
+		}
+		i++;
+	}
+#endif // BVH_WIDE
+
+	return false;
+}
+
+/* Here starts the raytracer*/
+
+/* Trace the primary ray through the point (pixel_x, pixel_y) of the frame, in pixels, and shade the closest hit.
+ * Return the color with full alpha, or a transparent black if the ray missed everything */
+float4 TracePixel(__global float3* vertices, __global int4* faces, __global SceneGroupStruct* groups, __global Material* materials,
+	__global BVHNode* bvhTreeNode, __global InstanceStruct* instances, __global SceneInformation* sceneInfo, __global Camera* camera,
+	__global Light* light, RayCounters* counters, const float pixel_x, const float pixel_y)
+{
 	/* build direction of the ray based on camera and the current pixel */
-	float normalized_i = ((float)((float)x / (float)(sceneInfo->width) * (float)(sceneInfo->proportion_x)) - 0.5f);
-	float normalized_j = -((float)((float)y / (float)(sceneInfo->height) * (float)(sceneInfo->proportion_y)) - 0.5f);
+	float normalized_i = ((float)(pixel_x / (float)(SCENE_WIDTH) * (float)(SCENE_PROPORTION_X)) - 0.5f);
+	float normalized_j = -((float)(pixel_y / (float)(SCENE_HEIGHT) * (float)(SCENE_PROPORTION_Y)) - 0.5f);
 	float3 ray_dir = (float3)(camera->right * normalized_i) + (float3)(camera->up * normalized_j) + camera->dir;
 
 	ray_dir = normalize(ray_dir);
 
-	float distance = 1000000.0f; // high value for the first ray
 	int face_i = -1; // index of the face that was hit, was -1 I don't now why
 	int groupIndex = -1;
 	float maxDistance = 1000000.0f; //max distance, work as a far view point
@@ -212,56 +609,252 @@ __kernel void Raytrace(__global float3* vertices, __global int4* faces, __global
 	float3 normal; // face normal
 	float3 l_origin = camera->pos; // local copy of origin of rays (camera/eye)
 
+	/* ray used by the traversal, it's transformed into object space inside instances. The direction 
+	 * is not normalized after the transformation, so distances are the same on both spaces */
+	float3 traversal_origin = l_origin;
+	float3 traversal_dir = ray_dir;
+	int instance = -1; // instance being traversed, -1 on the object level BVH
+	int instance_hit = -1; // instance of the closest face, -1 if it's not an instance
+
+#ifdef BVH_WIDE
+	/* Stack traversal over 4-wide nodes, the AABBs of the 4 children are tested at once and the
+	 * children hit are pushed so the closest one is visited first. Leaves are tested right away,
+	 * while instances are pushed as -2 - index, so the remaining children of the node are still tested
+	 * against the world space ray */
+	int stack[BVH_WIDE_STACK_SIZE];
+	int stack_size = 0;
+	int instance_stack = 0; // stack size when the instance was entered, its BVH is done once the stack gets back to it
+	float3 inv_dir = 1.0f / traversal_dir;
+	stack[stack_size++] = 0;
+
+	while (stack_size > 0)
+	{
+		if (instance != -1 && stack_size == instance_stack)
+		{
+			/* done with the BVH of the instance, back to the object level */
+			traversal_origin = l_origin;
+			traversal_dir = ray_dir;
+			inv_dir = 1.0f / traversal_dir;
+			instance = -1;
+		}
+
+		int i = stack[--stack_size];
+		if (i < 0)
+		{
+			/* leaf of an instance, traverse the BVH of its group in object space */
+			instance = -2 - i;
+			traversal_origin = TransformByRows(instances[instance].world_to_object, l_origin, 1.0f);
+			traversal_dir = TransformByRows(instances[instance].world_to_object, ray_dir, 0.0f);
+			inv_dir = 1.0f / traversal_dir;
+			instance_stack = stack_size;
+			stack[stack_size++] = instances[instance].bvhStart;
+			continue;
+		}
+
+		float4 t_near;
+		int4 count;
+		int4 hit = IntersectChildren(&bvhTreeNode[i], traversal_origin, inv_dir, maxDistance, &t_near, &count);
+		COUNT(nodes_visited, 1);
+		COUNT(box_tests, ChildrenCount(&bvhTreeNode[i]));
+
+		float near_array[4];
+		int hit_array[4];
+		int child_array[4];
+		int count_array[4];
+		vstore4(t_near, 0, near_array);
+		vstore4(hit, 0, hit_array);
+		vstore4(bvhTreeNode[i].child, 0, child_array);
+		vstore4(count, 0, count_array);
+#ifndef BVH_COMPRESSED
+		int group_array[4];
+		vstore4(bvhTreeNode[i].group, 0, group_array);
+#endif // BVH_COMPRESSED
+
+		/* children to be pushed, sorted from the farthest to the closest */
+		float push_near[4];
+		int push_child[4];
+		int push_size = 0;
+		for (int c = 0; c < 4; c++)
+		{
+			if (!hit_array[c])
+				continue;
+
+			if (count_array[c] > 0)
+			{
+				/* a leaf, test against the faces it holds */
+#ifdef BVH_COMPRESSED
+				int group = faces[child_array[c]].w;
+#else
+				int group = group_array[c];
+#endif // BVH_COMPRESSED
+				IntersectFaces(vertices, faces, child_array[c], child_array[c] + count_array[c], group, instance,
+					traversal_origin, traversal_dir, &maxDistance, &face_i, &point_i, &normal, &groupIndex,
+					&instance_hit, counters);
+				continue;
+			}
+
+			int entry = count_array[c] == 0 ? child_array[c] : -2 - child_array[c];
+			int p = push_size++;
+			while (p > 0 && push_near[p - 1] < near_array[c])
+			{
+				push_near[p] = push_near[p - 1];
+				push_child[p] = push_child[p - 1];
+				p--;
+			}
+			push_near[p] = near_array[c];
+			push_child[p] = entry;
+		}
+
+		for (int c = 0; c < push_size; c++)
+		{
+			stack[stack_size++] = push_child[c];
+		}
+	}
+#elif defined(BVH_ORDERED)
+	/* Stack traversal over the binary nodes. Both children of a middle node are tested before descending,
+	 * the closest one is visited first while the farthest one is pushed with its distance. Boxes beyond 
+	 * the closest hit found so far are skipped, also when popped, so early hits prune the rest of the tree */
+	int stack[BVH_ORDERED_STACK_SIZE];
+	float stack_near[BVH_ORDERED_STACK_SIZE];
+	int stack_size = 0;
+	int instance_stack = 0; // stack size when the instance was entered, its BVH is done once the stack gets back to it
+	float3 inv_dir = 1.0f / traversal_dir;
+	float t_left, t_right; // distance where the ray enters each child
+
+	/* node being visited, its box was already hit. -1 when the current path is done */
+	int i = RayBoxIntersectDistance(traversal_origin, inv_dir, bvhTreeNode[0].aabb, maxDistance, &t_left) ? 0 : -1;
+	COUNT(box_tests, 1);
+	while (true)
+	{
+		if (i == -1)
+		{
+			if (instance != -1 && stack_size == instance_stack)
+			{
+				/* done with the BVH of the instance, back to the object level */
+				traversal_origin = l_origin;
+				traversal_dir = ray_dir;
+				inv_dir = 1.0f / traversal_dir;
+				instance = -1;
+			}
+			if (stack_size == 0)
+				break;
+
+			stack_size--;
+			if (stack_near[stack_size] <= maxDistance)
+				i = stack[stack_size];
+			continue;
+		}
+
+		COUNT(nodes_visited, 1);
+		if (bvhTreeNode[i].leaf_info.x == -1)
+		{
+			/* leaf of an instance, traverse the BVH of its group in object space */
+			instance = bvhTreeNode[i].packet_indexes.y;
+			traversal_origin = TransformByRows(instances[instance].world_to_object, l_origin, 1.0f);
+			traversal_dir = TransformByRows(instances[instance].world_to_object, ray_dir, 0.0f);
+			inv_dir = 1.0f / traversal_dir;
+			instance_stack = stack_size;
+			i = instances[instance].bvhStart;
+			COUNT(box_tests, 1);
+			if (!RayBoxIntersectDistance(traversal_origin, inv_dir, bvhTreeNode[i].aabb, maxDistance, &t_left))
+				i = -1;
+			continue;
+		}
+
+		if (bvhTreeNode[i].packet_indexes.y != -1)
+		{
+			/* this is a leaf, so we must test against the faces it holds */
+			int facesStart = bvhTreeNode[i].packet_indexes.y;
+			IntersectFaces(vertices, faces, facesStart, facesStart + bvhTreeNode[i].leaf_info.x, bvhTreeNode[i].leaf_info.y, 
+				instance, traversal_origin, traversal_dir, &maxDistance, &face_i, &point_i, &normal, &groupIndex,
+				&instance_hit, counters);
+			i = -1;
+			continue;
+		}
+
+		/* middle node, the left child comes right after it and the right child is at the escape index of the left one */
+		int left = i + 1;
+		int right = bvhTreeNode[left].packet_indexes.x;
+		bool hit_left = RayBoxIntersectDistance(traversal_origin, inv_dir, bvhTreeNode[left].aabb, maxDistance, &t_left);
+		bool hit_right = RayBoxIntersectDistance(traversal_origin, inv_dir, bvhTreeNode[right].aabb, maxDistance, &t_right);
+		COUNT(box_tests, 2);
+		if (hit_left && hit_right)
+		{
+			if (t_right < t_left)
+			{
+				/* the right child is closer */
+				int swap = left;
+				left = right;
+				right = swap;
+				float swap_near = t_left;
+				t_left = t_right;
+				t_right = swap_near;
+			}
+			stack[stack_size] = right;
+			stack_near[stack_size] = t_right;
+			stack_size++;
+			i = left;
+		}
+		else if (hit_left)
+		{
+			i = left;
+		}
+		else if (hit_right)
+		{
+			i = right;
+		}
+		else
+		{
+			i = -1;
+		}
+	}
+#else
+	int resume = 0; // where the object level traversal resumes after the instance
+	int end = SCENE_BVH_SIZE;
+
     /* Thrane and Simonsen traversal algorithm from "A Comparison of Acceleration Structures
 	 * for GPU Assisted Ray Tracing" */
     int i = 0;
     /* traverse the tree in a fixed order generated on host code */
-    while (i < sceneInfo->bvhSize)
+    while (i < end || instance != -1)
 	{
+		if (i >= end)
+		{
+			/* done with the BVH of the instance, back to the object level */
+			i = resume;
+			end = SCENE_BVH_SIZE;
+			traversal_origin = l_origin;
+			traversal_dir = ray_dir;
+			instance = -1;
+			continue;
+		}
+
         /* Intersect agaisnst this node of the tree */
-        if (RayBoxIntersect(l_origin, ray_dir,bvhTreeNode[i].aabb))
+        COUNT(box_tests, 1);
+        if (RayBoxIntersect(traversal_origin, traversal_dir, bvhTreeNode[i].aabb))
         {
+            COUNT(nodes_visited, 1);
             /* nice, a hit, but this may be a leaf node or middle node */
-            if (bvhTreeNode[i].packet_indexes.y != -1)
+            if (bvhTreeNode[i].leaf_info.x == -1)
             {
-                /* this is an object, so we must test agains all geometry  */
-                int p = bvhTreeNode[i].packet_indexes.y;
-
-                // for each face, look for intersections with the ray
-                int facesEnd = groups[p].facesStart + groups[p].facesSize; // the index where the faces of this group ends
-                for (unsigned int k = groups[p].facesStart; k < facesEnd; k++)
-                {
-                    int result;
-                    float3 temp_point; // temporary intersection point
-                    float3 temp_normal;// temporary normal vector
-
-#ifdef EFFICIENCY_METRICS
-                    /* metrics are not compiled depending on user configuration */
-                    atomic_inc(intersectCounter);
-#endif // EFFICIENCY_METRICS
+                /* leaf of an instance, traverse the BVH of its group in object space */
+                instance = bvhTreeNode[i].packet_indexes.y;
+                traversal_origin = TransformByRows(instances[instance].world_to_object, l_origin, 1.0f);
+                traversal_dir = TransformByRows(instances[instance].world_to_object, ray_dir, 0.0f);
+                resume = i + 1;
+                i = instances[instance].bvhStart;
+                end = instances[instance].bvhEnd;
+                continue;
+            }
+            else if (bvhTreeNode[i].packet_indexes.y != -1)
+            {
+                /* this is a leaf, so we must test against the faces it holds */
+                int p = bvhTreeNode[i].leaf_info.y;
 
-                    result = Intersect(vertices[faces[k].x],
-                                       vertices[faces[k].y],
-                                       vertices[faces[k].z],
-                                       l_origin, ray_dir, &temp_normal, &temp_point, &distance);
-
-                    if (result > 0)
-                    {
-                        //some collision
-                        if (distance < maxDistance) // check if it's the closest to the camera so far
-                        {
-                            maxDistance = distance;
-                            face_i = k;
-                            point_i = temp_point;
-                            normal = temp_normal;
-                            groupIndex = p;
-                        }
-#ifdef EFFICIENCY_METRICS
-                        /* metrics are not compiled depending on user configuration */
-                        atomic_inc(intersectHitCounter);
-#endif // EFFICIENCY_METRICS
-                    }
-                }
+                int facesStart = bvhTreeNode[i].packet_indexes.y;
+                IntersectFaces(vertices, faces, facesStart, facesStart + bvhTreeNode[i].leaf_info.x, p, instance,
+                               traversal_origin, traversal_dir, &maxDistance, &face_i, &point_i, &normal, &groupIndex,
+                               &instance_hit, counters);
             }
             /* continue on the next node */
             i++;
@@ -273,50 +866,48 @@ __kernel void Raytrace(__global float3* vertices, __global int4* faces, __global
         }
 
 	}
-
+#endif // BVH_WIDE
 
 	// paint pixel
 	if (face_i != -1)
 	{
+		if (instance_hit != -1)
+		{
+			/* the hit was computed in object space, the normal goes back to world space through 
+			 * the transpose of world_to_object (the inverse transpose of object to world) */
+			point_i = l_origin + ray_dir * maxDistance;
+			normal = instances[instance_hit].world_to_object[0].xyz * normal.x +
+				instances[instance_hit].world_to_object[1].xyz * normal.y +
+				instances[instance_hit].world_to_object[2].xyz * normal.z;
+		}
 
 		// get direction vector of light based on the intersection point
 		float3 L = light->pos - point_i;
 		L = normalize(L);
 
-		///* shot secondary ray directed to the light and see if we have a shadow */
-		//l_origin = point_i;
-		//bool shadow = false;
-		//float3 temp; // info to be discarted
-		//for (unsigned int p = 0; p < sceneInfo->facesSize; p++)
-		//{
-		//	if (p != face_i)
-		//	{
-		//		if (Intersect(vertices[faces[p].x], vertices[faces[p].y], vertices[faces[p].z], l_origin, L, &temp, &temp, &distance, &intersectOutput) > 0)
-		//		{
-		//			shadow = true;
-		//			break;
-		//		}
-		//	}
-		//}
-		//if (shadow)// if there's a shadow, put black pixel
-		//{
-		//	frame[id].x = 0;
-		//	frame[id].y = 0;
-		//	frame[id].z = 0;
-		//	frame[id].w = 255;
-		//	return;
-		//}
+		normal = normalize(normal);
+
+#ifdef SHADOWS
+		/* shoot a secondary ray towards the light, it starts slightly away from the surface on the side
+		 * of the light, so the face that was hit doesn't block it */
+		float light_distance = length(light->pos - point_i);
+		float3 shadow_offset = dot(normal, L) < 0.0f ? -normal : normal;
+		float bias = SHADOW_BIAS * max(1.0f, max(max(fabs(point_i.x), fabs(point_i.y)), fabs(point_i.z)));
+		bool shadow = Occluded(vertices, faces, bvhTreeNode, instances, SCENE_BVH_SIZE, point_i + shadow_offset * bias,
+			L, light_distance - bias, counters);
+#else
+		bool shadow = false;
+#endif // SHADOWS
 
 		// now that we have the face, calculate illumination
 		float3 amount_color = (float3)(0.0f, 0.0f, 0.0f); //final amount of color that goes to each pixel
 
-		normal = normalize(normal);
-
 		//int indexMaterial = faces[face_i].w;
 
 		//diffuse
+		/* points in shadow only get the ambient light */
 		float dot_r = dot(normal, L);
-		if (dot_r > 0)
+		if (dot_r > 0 && !shadow)
 		{
 			float Kd = ((materials[groupIndex].diffuseColor.x
 				+ materials[groupIndex].diffuseColor.y
@@ -329,7 +920,7 @@ __kernel void Raytrace(__global float3* vertices, __global int4* faces, __global
 		//glm::vec3 R = glm::cross(2.0f * glm::dot(L,normal) * normal,L);
 		float3 R = L - 2.0f * dot(L, normal) * normal;
 		dot_r = dot(ray_dir, R);
-		if (dot_r > 0)
+		if (dot_r > 0 && !shadow)
 		{
 			float spec = pown(dot_r, 20.0f) * light->Ks;
 			// put specular component
@@ -349,17 +940,159 @@ __kernel void Raytrace(__global float3* vertices, __global int4* faces, __global
 		if (final_c.z > 1.0f)
 			final_c.z = 1.0f;
 
-		frame[id].x = (final_c.x * 255.0f);
-		frame[id].y = (final_c.y * 255.0f);
-		frame[id].z = (final_c.z * 255.0f);
-		frame[id].w = 255; // full alpha
+		return (float4)(final_c, 1.0f); // full alpha
+	}
+
+	// no collision, transparent pixel
+	return (float4)(0.0f, 0.0f, 0.0f, 0.0f);
+}
+
+/* Write a color of TracePixel to the frame */
+void WritePixel(__global uchar4* frame, const int id, const float4 color)
+{
+	/* Using the syntax frame[x][y] produces different behaviour on different platforms (doesn't work on NVIDIA GPUS)
+	So use the XYZ to access the members of any vector types */
+	frame[id].x = (color.x * 255.0f);
+	frame[id].y = (color.y * 255.0f);
+	frame[id].z = (color.z * 255.0f);
+	frame[id].w = (color.w * 255.0f);
+}
+
+#ifdef EFFICIENCY_METRICS
+/* Sum value over the work-items of the work-group, every one of them must call this. reduction holds one
+ * element for each work-item. The sum is done on 64 bits, the tests of a whole tile can overflow 32 bits */
+ulong ReduceLocal(const uint value, __local ulong* reduction)
+{
+	int local_id = get_local_id(1) * get_local_size(0) + get_local_id(0);
+	int active = get_local_size(0) * get_local_size(1);
+
+	reduction[local_id] = value;
+	barrier(CLK_LOCAL_MEM_FENCE);
+	/* each step adds the second half of the elements left to the first half, the middle one stays
+	 * on the first half when the amount is odd */
+	while (active > 1)
+	{
+		int half_size = (active + 1) / 2;
+		if (local_id + half_size < active)
+			reduction[local_id] += reduction[local_id + half_size];
+		barrier(CLK_LOCAL_MEM_FENCE);
+		active = half_size;
+	}
+
+	ulong sum = reduction[0];
+	/* the next reduction overwrites the elements */
+	barrier(CLK_LOCAL_MEM_FENCE);
+	return sum;
+}
+
+/* Add the counters of the work-group to its partial sum on groupCounters, one for each work-group. They are
+ * added instead of written, so the sums carry over the launches of a progressive frame or of a sequence */
+void ReduceCounters(const RayCounters* counters, __local ulong* reduction, __global EfficiencyCounters* groupCounters)
+{
+	ulong intersect_tests = ReduceLocal(counters->intersect_tests, reduction);
+	ulong intersect_hits = ReduceLocal(counters->intersect_hits, reduction);
+	ulong box_tests = ReduceLocal(counters->box_tests, reduction);
+	ulong nodes_visited = ReduceLocal(counters->nodes_visited, reduction);
+	ulong leaves_visited = ReduceLocal(counters->leaves_visited, reduction);
+
+	if (get_local_id(0) == 0 && get_local_id(1) == 0)
+	{
+		__global EfficiencyCounters* group = &groupCounters[get_group_id(1) * get_num_groups(0) + get_group_id(0)];
+		group->intersect_tests += intersect_tests;
+		group->intersect_hits += intersect_hits;
+		group->box_tests += box_tests;
+		group->nodes_visited += nodes_visited;
+		group->leaves_visited += leaves_visited;
+	}
+}
+#endif // EFFICIENCY_METRICS
+
+__kernel void Raytrace(__global float3* vertices, __global int4* faces, __global SceneGroupStruct* groups, __global Material* materials,
+	__global BVHNode* bvhTreeNode,
+	__global InstanceStruct* instances, __global SceneInformation* sceneInfo, __global uchar4* frame, __global Camera* camera,
+	__global Light* light, __global EfficiencyCounters* groupCounters, __local ulong* reduction, __global uint2* traversalCost)
+{
+	// grab XY coordinate of this instance, each work-group is a tile of pixels
+	int x = get_global_id(0);
+	int y = get_global_id(1);
+	RayCounters counters = { 0, 0, 0, 0, 0 };
+
+	/* the range is rounded up to whole tiles. The work-items outside of it don't return, all the work-items of
+	 * the work-group must get to the reduction of the counters */
+	if (x < SCENE_WIDTH && y < SCENE_HEIGHT)
+	{
+		int id = y * SCENE_WIDTH + x;
+		float4 color = TracePixel(vertices, faces, groups, materials, bvhTreeNode, instances, sceneInfo, camera, light,
+			&counters, (float)x, (float)y);
+		WritePixel(frame, id, color);
+#ifdef TRAVERSAL_COST
+		/* diagnostic mode, the work of the primary and the shadow ray of the pixel */
+		traversalCost[id] = (uint2)(counters.nodes_visited, counters.intersect_tests);
+#endif // TRAVERSAL_COST
 	}
-	else
+
+#ifdef EFFICIENCY_METRICS
+	ReduceCounters(&counters, reduction, groupCounters);
+#endif // EFFICIENCY_METRICS
+}
+
+/* Random number in [0, 1) for a pixel, a sample and a dimension of the sample, the same
+ * arguments always give the same number. Based on the integer hash of Thomas Wang */
+float SampleRandom(const int id, const int sample, const int dimension)
+{
+	uint seed = (uint)id * 9781u + (uint)sample * 6271u + (uint)dimension * 26699u;
+	seed = (seed ^ 61u) ^ (seed >> 16);
+	seed *= 9u;
+	seed = seed ^ (seed >> 4);
+	seed *= 0x27d4eb2du;
+	seed = seed ^ (seed >> 15);
+	return (float)(seed >> 8) * (1.0f / 16777216.0f);
+}
+
+/* Progressive rendering, each call traces one more sample of every pixel and adds its color to the
+ * accumulation buffer. The first sample goes through the same point of Raytrace and overwrites the buffer,
+ * the next ones are jittered inside the pixel, so the average converges to an anti-aliased frame */
+__kernel void RaytraceProgressive(__global float3* vertices, __global int4* faces, __global SceneGroupStruct* groups, 
+	__global Material* materials, __global BVHNode* bvhTreeNode,
+	__global InstanceStruct* instances, __global SceneInformation* sceneInfo, __global float4* accumulation, __global Camera* camera,
+	__global Light* light, __global EfficiencyCounters* groupCounters, __local ulong* reduction, const int sample)
+{
+	int x = get_global_id(0);
+	int y = get_global_id(1);
+	RayCounters counters = { 0, 0, 0, 0, 0 };
+
+	/* same as Raytrace, the work-items outside of the frame still reduce the counters */
+	if (x < SCENE_WIDTH && y < SCENE_HEIGHT)
 	{
-		// no collision, put transparent pixel
-		frame[id].x = 0;
-		frame[id].y = 0;
-		frame[id].z = 0;
-		frame[id].w = 0; // zero alpha
+		int id = y * SCENE_WIDTH + x;
+
+		float pixel_x = (float)x;
+		float pixel_y = (float)y;
+		if (sample > 0)
+		{
+			pixel_x += SampleRandom(id, sample, 0) - 0.5f;
+			pixel_y += SampleRandom(id, sample, 1) - 0.5f;
+		}
+
+		float4 color = TracePixel(vertices, faces, groups, materials, bvhTreeNode, instances, sceneInfo, camera, light,
+			&counters, pixel_x, pixel_y);
+		if (sample == 0)
+			accumulation[id] = color;
+		else
+			accumulation[id] += color;
 	}
+
+#ifdef EFFICIENCY_METRICS
+	ReduceCounters(&counters, reduction, groupCounters);
+#endif // EFFICIENCY_METRICS
+}
+
+/* Average the samples of the accumulation buffer into the frame, one work-item per pixel */
+__kernel void ResolveSamples(__global float4* accumulation, __global uchar4* frame, const int pixelCount, const int samples)
+{
+	int id = get_global_id(0);
+	if (id >= pixelCount)
+		return;
+
+	WritePixel(frame, id, accumulation[id] / (float)samples);
 }
@@ -42,8 +42,10 @@
 
 #include "RenderGirlShared.h"
 #include "SceneGroup.h"
+#include "SceneInstance.h"
 #include "SceneManager.h"
 #include "Log.h"
+#include "Trace.h"
 
 
 
@@ -19,7 +19,17 @@
 
 #include "RenderGirlShared.h"
 #include "CLMath.h"
+#include "Trace.h"
 #include <chrono>
+#include <sstream>
+#include <iomanip>
+#include <locale>
+
+/* efficiency counters of a frame that didn't trace anything yet */
+static const EfficiencyCounters s_noCounters = { 0, 0, 0, 0, 0 };
+/* programs kept built on the device, a new resolution or size of the scene builds one more when the kernels
+	are specialized so the least recently used one is dropped past this */
+static const size_t s_maxProgramVariants = 4;
 
 RenderGirlShared::RenderGirlShared()
 {
@@ -27,9 +37,40 @@ RenderGirlShared::RenderGirlShared()
 	m_program = NULL;
 	m_kernel = NULL;
 	m_kernel_AA = NULL;
+	m_kernel_progressive = NULL;
+	m_kernel_resolve = NULL;
 	m_frame = NULL;
+	m_frame_AA = NULL;
+	m_accumulation = NULL;
+	m_sampleCount = 0;
+	m_frameEvent = NULL;
+	m_callbackPending = false;
+	m_renderPending = false;
+	m_frameChanged = true;
+	m_sequenceFirst = 0;
+	m_sequenceQueued = 0;
+	m_sequenceFrames = 0;
+	m_sequenceProfiledCommands = 0;
+	m_profiling = false;
+	m_frameProfiledCommands = 0;
+	memset(&m_frameTiming, 0, sizeof(FrameTiming));
+	m_sceneInfoMem = NULL;
+	m_cameraMem = NULL;
+	m_lightMem = NULL;
+	m_countersMem = NULL;
+	m_traversalCostMem = NULL;
+	m_widthMem = NULL;
+	m_heightMem = NULL;
+	m_frameBytesToDevice = 0;
+	m_frameBytesToHost = 0;
 
 	m_efficiencyInfo = false;
+	m_efficiencyCounters = s_noCounters;
+	m_traversalCost = false;
+	m_specializedKernels = false;
+	m_variantUses = 0;
+	m_tileWidth = 8;
+	m_tileHeight = 8;
 }
 RenderGirlShared::~RenderGirlShared()
 {
@@ -136,11 +177,21 @@ bool RenderGirlShared::SelectDevice(const OCLDevice* select)
 		SceneManager& manager = SceneManager::GetSharedManager();
 		manager.SetContext(m_selectedDevice->GetContext());
 	}
+	if (m_selectedDevice->IsReady())
+		m_selectedDevice->GetContext()->SetProfiling(m_profiling);
+
+	/* devices tuned before get their best tile size back */
+	std::map<std::string, std::pair<int, int> >::iterator tuned = m_tunedTileSizes.find(m_selectedDevice->GetName());
+	if (tuned != m_tunedTileSizes.end())
+	{
+		m_tileWidth = tuned->second.first;
+		m_tileHeight = tuned->second.second;
+	}
 
 	return error;
 }
 
-bool RenderGirlShared::PrepareRaytracer(const bool efficiency)
+bool RenderGirlShared::PrepareRaytracer(const bool efficiency, const BVHLayout layout, const bool shadows)
 {
 	assert(m_selectedDevice != NULL);
 	assert(m_program == NULL);
@@ -148,14 +199,6 @@ bool RenderGirlShared::PrepareRaytracer(const bool efficiency)
 
 	/* Prepare this device compiling the OpenCL kernels*/
 
-	m_program = new OCLProgram(context);
-	if (!m_program->LoadSource("Raytracer.cl"))
-	{
-		delete m_program;
-		m_program = NULL;
-		return false;
-	}
-
 	std::string program_options = std::string();
 	if (efficiency)
 	{
@@ -170,88 +213,225 @@ bool RenderGirlShared::PrepareRaytracer(const bool efficiency)
 		this->m_efficiencyInfo = false;
 	}
 
-	if (!m_program->BuildProgram(program_options))
+	if (layout == OrderedLayout)
 	{
-		delete m_program;
-		m_program = NULL;
-		return false;
+		/* the kernel keeps a stack to visit the closest child first over the binary array */
+		program_options += " -D BVH_ORDERED";
+	}
+	if (layout == WideLayout || layout == CompressedLayout)
+	{
+		/* the kernel traverses 4-wide nodes with a stack instead of the stackless binary array */
+		program_options += " -D BVH_WIDE";
 	}
+	if (layout == CompressedLayout)
+	{
+		/* and decodes the quantized AABBs of the children */
+		program_options += " -D BVH_COMPRESSED";
+	}
+	SceneManager::GetSharedManager().SetBVHLayout(layout);
 
-	m_kernel = new OCLKernel(m_program, std::string("Raytrace"));
-	if (!m_kernel->GetOk())
+	if (shadows)
 	{
-		delete m_program;
-		delete m_kernel;
-		m_kernel = NULL;
-		m_program = NULL;
-		return false;
+		/* points hit are tested for occlusion with an any-hit traversal towards the light */
+		program_options += " -D SHADOWS";
 	}
 
+	m_programOptions = program_options;
+	if (!this->SelectProgramVariant(program_options))
+		return false;
+
 	Log::Message("Device ready for execution.");
 	return true;
 }
 
-bool RenderGirlShared::PrepareAntiAliasing()
+bool RenderGirlShared::SelectProgramVariant(const std::string& options)
+{
+	std::map<std::string, ProgramVariant>::iterator it = m_programVariants.find(options);
+	if (it == m_programVariants.end())
+	{
+		if (m_programVariants.size() >= s_maxProgramVariants)
+		{
+			/* the kernels already enqueued keep their own reference, so even the current one can go */
+			std::map<std::string, ProgramVariant>::iterator oldest = m_programVariants.begin();
+			std::map<std::string, ProgramVariant>::iterator v;
+			for (v = m_programVariants.begin(); v != m_programVariants.end(); v++)
+			{
+				if (v->second.lastUse < oldest->second.lastUse)
+					oldest = v;
+			}
+			ReleaseProgramVariant(oldest->second);
+			m_programVariants.erase(oldest);
+		}
+
+		ProgramVariant variant;
+		variant.program = new OCLProgram(m_selectedDevice->GetContext());
+		variant.kernel = NULL;
+		variant.kernel_AA = NULL;
+		variant.kernel_progressive = NULL;
+		variant.kernel_resolve = NULL;
+		variant.lastUse = 0;
+		if (!variant.program->LoadSource("Raytracer.cl") || !variant.program->BuildProgram(options))
+		{
+			delete variant.program;
+			return false;
+		}
+
+		variant.kernel = new OCLKernel(variant.program, std::string("Raytrace"));
+		if (!variant.kernel->GetOk())
+		{
+			delete variant.kernel;
+			delete variant.program;
+			return false;
+		}
+
+		it = m_programVariants.insert(std::make_pair(options, variant)).first;
+	}
+	it->second.lastUse = ++m_variantUses;
+
+	m_program = it->second.program;
+	m_kernel = it->second.kernel;
+	m_kernel_AA = it->second.kernel_AA;
+	m_kernel_progressive = it->second.kernel_progressive;
+	m_kernel_resolve = it->second.kernel_resolve;
+	m_variantOptions = options;
+
+	return true;
+}
+
+void RenderGirlShared::ReleaseProgramVariant(ProgramVariant& variant)
+{
+	delete variant.kernel;
+	if (variant.kernel_AA != NULL)
+		delete variant.kernel_AA;
+	if (variant.kernel_progressive != NULL)
+	{
+		delete variant.kernel_progressive;
+		delete variant.kernel_resolve;
+	}
+	delete variant.program;
+}
+
+/* Write a float as a literal of OpenCL C, 9 significant digits are enough to get the exact same float back.
+	The classic locale keeps the decimal point whatever the application set for LC_NUMERIC */
+static std::string FloatLiteral(const float value)
+{
+	std::ostringstream literal;
+	literal.imbue(std::locale::classic());
+	literal << std::scientific << std::setprecision(8) << value << "f";
+	return literal.str();
+}
+
+/* Write the single element of a memory object, marking it as dirty only if the value changed */
+template <class T>
+static void UpdateMemoryObject(OCLMemoryObject<T>* memory, const T& value)
+{
+	if (memcmp(&(*memory)[0], &value, sizeof(T)) != 0)
+	{
+		(*memory)[0] = value;
+		memory->MarkDirty();
+	}
+}
+
+bool RenderGirlShared::PrepareAntiAliasing(const int pixelCount)
 {
+	OCLContext* context = m_selectedDevice->GetContext();
+	cl_bool error = false;
+
+	/* the anti-aliased frame is only written by the device, it doesn't need host memory */
+	if (m_frame_AA != NULL && m_frame_AA->GetSize() != pixelCount)
+	{
+		context->DeleteMemoryObject<cl_uchar4>(m_frame_AA);
+		m_frame_AA = NULL;
+	}
+	if (m_frame_AA == NULL)
+	{
+		m_frame_AA = context->CreateMemoryObject<cl_uchar4>(pixelCount, WriteOnly, &error);
+		if (error)
+			return false;
+	}
+
+	/* the kernel is kept after the first frame with anti-aliasing */
+	if (m_kernel_AA != NULL)
+		return true;
+
 	m_kernel_AA = new OCLKernel(m_program, std::string("AntiAliasingFXAA"));
 	if (!m_kernel_AA->GetOk())
 	{
-		delete m_program;
 		delete m_kernel_AA;
 		m_kernel_AA = NULL;
-		delete m_kernel;
-		m_kernel = NULL;
-		m_program = NULL;
 		return false;
 	}
+	m_programVariants[m_variantOptions].kernel_AA = m_kernel_AA;
 	return true;
 }
 
+bool RenderGirlShared::PrepareProgressive()
+{
+	/* like the anti-aliasing one, the kernels are kept after the first samples */
+	if (m_kernel_progressive != NULL)
+		return true;
 
-bool RenderGirlShared::ExecuteAntiAliasing( int width, int height)
+	m_kernel_progressive = new OCLKernel(m_program, std::string("RaytraceProgressive"));
+	m_kernel_resolve = new OCLKernel(m_program, std::string("ResolveSamples"));
+	if (!m_kernel_progressive->GetOk() || !m_kernel_resolve->GetOk())
+	{
+		delete m_kernel_progressive;
+		delete m_kernel_resolve;
+		m_kernel_progressive = NULL;
+		m_kernel_resolve = NULL;
+		return false;
+	}
+	m_programVariants[m_variantOptions].kernel_progressive = m_kernel_progressive;
+	m_programVariants[m_variantOptions].kernel_resolve = m_kernel_resolve;
+	return true;
+}
+
+
+bool RenderGirlShared::ExecuteAntiAliasing(OCLMemoryObject<cl_uchar4>* frame, int width, int height)
 {
 	OCLContext* context = m_selectedDevice->GetContext();
 
 	cl_bool error = false;
 
-	cl_int temp = width; 
+	if (m_widthMem == NULL)
+	{
+		m_widthMem = context->CreateMemoryObject<cl_int>(1, ReadOnly, &error);
+		if (error)
+			return false;
+		m_widthMem->SetData(new cl_int[1], false);
 
-	OCLMemoryObject<cl_int>* widthMem = context->CreateMemoryObject<cl_int>(1, ReadOnly, &error);
-	widthMem->SetData(&temp, true);
-	widthMem->SyncHostToDevice();
-	temp = height;
-	OCLMemoryObject<cl_int>* heightMem = context->CreateMemoryObject<cl_int>(1, ReadOnly, &error);
-	heightMem->SetData(&temp, true);
-	heightMem->SyncHostToDevice();
+		m_heightMem = context->CreateMemoryObject<cl_int>(1, ReadOnly, &error);
+		if (error)
+			return false;
+		m_heightMem->SetData(new cl_int[1], false);
+	}
 
-	if (error)
+	UpdateMemoryObject<cl_int>(m_widthMem, width);
+	UpdateMemoryObject<cl_int>(m_heightMem, height);
+	if (!m_widthMem->SyncDirtyHostToDevice() || !m_heightMem->SyncDirtyHostToDevice())
 		return false;
 
-	if (!m_kernel_AA->SetArgument(0, m_frame))
+	if (!m_kernel_AA->SetArgument(0, frame))
 		return false;
 	if (!m_kernel_AA->SetArgument(1, m_frame_AA))
 		return false;
-	if (!m_kernel_AA->SetArgument(2, widthMem))
+	if (!m_kernel_AA->SetArgument(2, m_widthMem))
 		return false;
-	if (!m_kernel_AA->SetArgument(3, heightMem))
+	if (!m_kernel_AA->SetArgument(3, m_heightMem))
 		return false;
 
 
 	m_kernel_AA->SetGlobalWorkSize(width * height); // one work-iten per pixel
 
-	if (!m_kernel_AA->EnqueueExecution())
+	if (!m_kernel_AA->EnqueueExecution(AntiAliasingStage))
 		return false;
 
-	return true;
+	/* the anti-aliased frame goes back to the source one */
+	return frame->CopyFromMemoryBuffer(m_frame_AA);
 }
 
-bool RenderGirlShared::Render(int width, int height, Camera &camera, Light &light, AntiAliasingMethod AAOption)
+bool RenderGirlShared::PrepareFrameScene(int width, int height)
 {
-	assert(m_selectedDevice != NULL && "You must have a working context to call this");
-
-	// start counter
-	auto pretime = std::chrono::high_resolution_clock::now();
-
 	if (height < 1 || width < 1)
 	{
 		Log::Error("You have to choose a positive resolution");
@@ -259,70 +439,86 @@ bool RenderGirlShared::Render(int width, int height, Camera &camera, Light &ligh
 	}
 
 	OCLContext* context = m_selectedDevice->GetContext();
-	cl_bool error = false;
 
-	/* setup scene */
+	/* setup scene, anything it uploads is a change */
+	size_t bytesToDevice = context->GetBytesToDevice();
 	SceneManager& sceneManager = SceneManager::GetSharedManager();
 	if (!sceneManager.PrepareScene(m_kernel))
 		return false;
-
-	/* Setup render frame */
-
-	int pixelCount = width * height; // total amount of pixels
-
-	// delete old frame
-	if (m_frame != NULL)
+	m_frameChanged = context->GetBytesToDevice() != bytesToDevice;
+
+	/* the specialization depends on the size of the scene, so the kernel is chosen only after the scene is 
+	 * prepared and gets the arguments of the scene again if it changed */
+	std::string options = m_programOptions;
+	if (m_traversalCost)
+		options += " -D TRAVERSAL_COST";
+	if (m_specializedKernels)
 	{
-		context->DeleteMemoryObject<cl_uchar4>(m_frame);
-		m_frame = NULL;
+		options += std::string(" -D SCENE_SPECIALIZED") +
+			" -D SCENE_WIDTH=" + std::to_string(width) +
+			" -D SCENE_HEIGHT=" + std::to_string(height) +
+			" -D SCENE_PROPORTION_X=" + FloatLiteral((float)width / (float)height) +
+			" -D SCENE_PROPORTION_Y=" + FloatLiteral((float)height / (float)width) +
+			" -D SCENE_BVH_SIZE=" + std::to_string(sceneManager.m_bvhTopLevelSize);
 	}
-
-	m_frame = context->CreateMemoryObject<cl_uchar4>(pixelCount, WriteOnly, &error);
-	if (error)
-		return false;
-
-	cl_uchar4* frameRawAA;
-	if (AAOption != noAA)		//if there is antialiasing
+	if (options != m_variantOptions)
 	{
-		if (!PrepareAntiAliasing())
+		if (!this->SelectProgramVariant(options))
 			return false;
-
-		if (m_frame_AA != NULL)
-		{
-			context->DeleteMemoryObject<cl_uchar4>(m_frame_AA);
-			m_frame_AA = NULL;
-		}
-		m_frame_AA = context->CreateMemoryObject<cl_uchar4>(pixelCount, WriteOnly, &error);
-		if (error)
+		if (!sceneManager.PrepareScene(m_kernel))
 			return false;
-
-
-		frameRawAA = new cl_uchar4[pixelCount];
-		m_frame_AA->SetData(frameRawAA, false);
-		m_frame_AA->SyncHostToDevice();
 	}
 
-	cl_uchar4* frameRaw = new cl_uchar4[pixelCount];
-	m_frame->SetData(frameRaw,false);
-
 	/* Setup render info */
 	m_scene.width = width;
 	m_scene.height = height;
-	m_scene.pixelCount = pixelCount;
+	m_scene.pixelCount = width * height;
 	m_scene.groupsSize = sceneManager.GetGroupsCount();
 	/* TODO: this private access is awful, remove this as soon as possible */
-	m_scene.bvhSize = sceneManager.m_bvhTreeNodes->GetSize();
+	m_scene.bvhSize = sceneManager.m_bvhTopLevelSize;
 	m_scene.proportion_x = (float)width / (float)height;
 	m_scene.proportion_y = (float)height / (float)width;
 
-	OCLMemoryObject<SceneInformation>* sceneInfoMem = context->CreateMemoryObjectWithData(1, &m_scene, true, ReadOnly);
-	sceneInfoMem->SyncHostToDevice();
+	return true;
+}
 
+bool RenderGirlShared::CreateFrameBuffers()
+{
+	/* the small buffers are created once and rewritten on every render */
+	if (m_sceneInfoMem != NULL)
+		return true;
 
-	OCLMemoryObject<Light>* mem_light = context->CreateMemoryObjectWithData(1, &light, true, ReadOnly);
-	mem_light->SyncHostToDevice();
-	
-	/* Precompute some camera stuff*/
+	OCLContext* context = m_selectedDevice->GetContext();
+	cl_bool error = false;
+
+	m_sceneInfoMem = context->CreateMemoryObject<SceneInformation>(1, ReadOnly, &error);
+	if (error)
+		return false;
+	m_sceneInfoMem->SetData(new SceneInformation[1], false);
+
+	m_lightMem = context->CreateMemoryObject<Light>(1, ReadOnly, &error);
+	if (error)
+		return false;
+	m_lightMem->SetData(new Light[1], false);
+
+	m_cameraMem = context->CreateMemoryObject<Camera>(1, ReadOnly, &error);
+	if (error)
+		return false;
+	m_cameraMem->SetData(new Camera[1], false);
+
+	/* grows with the amount of work-groups of the frame, see SetTraceRange */
+	m_countersMem = context->CreateMemoryObject<EfficiencyCounters>(1, ReadWrite, &error);
+	if (error)
+		return false;
+	m_countersMem->SetData(new EfficiencyCounters[1], false);
+	m_countersMem->MarkClean(); /* cleared on the device */
+
+	return true;
+}
+
+/* Precompute some camera stuff*/
+static void PrepareCamera(Camera &camera)
+{
 	// based on the algorithm provided by this user here http://stackoverflow.com/a/13078758/1335511
 	if (camera.from_lookAt)
 	{ 
@@ -332,120 +528,829 @@ bool RenderGirlShared::Render(int width, int height, Camera &camera, Light &ligh
 	camera.dir = normalize(camera.dir);
 	camera.right = cross(camera.dir, camera.up);
 	camera.up = cross(camera.right, camera.dir); //This corrects for any slop in the choice of "up"
-	
+}
+
+bool RenderGirlShared::PrepareFrame(int width, int height, Camera &camera, Light &light)
+{
+	if (!this->PrepareFrameScene(width, height))
+		return false;
+
+	OCLContext* context = m_selectedDevice->GetContext();
+	cl_bool error = false;
+
+	/* Setup render frame, the buffers are kept between renders and recreated only when the resolution changes */
+
+	int pixelCount = width * height; // total amount of pixels
+
+	if (m_frame != NULL && m_frame->GetSize() != pixelCount)
+	{
+		/* the previous frame may still be getting read into its host memory */
+		if (!this->FinishFrame())
+			return false;
+		context->DeleteMemoryObject<cl_uchar4>(m_frame);
+		m_frame = NULL;
+	}
+	if (m_frame == NULL)
+	{
+		m_frame = context->CreateMemoryObject<cl_uchar4>(pixelCount, WriteOnly, &error);
+		if (error)
+			return false;
+		m_frame->SetData(new cl_uchar4[pixelCount], false);
+		m_frame->MarkClean(); /* only written by the device */
+	}
 
-	OCLMemoryObject<Camera>* mem_cam = context->CreateMemoryObjectWithData(1, &camera, true, ReadOnly);
-	mem_cam->SyncHostToDevice();
+	if (!this->CreateFrameBuffers())
+		return false;
+
+	UpdateMemoryObject(m_sceneInfoMem, m_scene);
+	UpdateMemoryObject(m_lightMem, light);
+	PrepareCamera(camera);
+	UpdateMemoryObject(m_cameraMem, camera);
+
+	if (m_sceneInfoMem->IsDirty() || m_cameraMem->IsDirty() || m_lightMem->IsDirty())
+		m_frameChanged = true;
+	/* the samples traced so far are from another frame */
+	if (m_frameChanged)
+		m_sampleCount = 0;
 
 	/*
-	Efficiency metrics for now consist of two integer counters. The intersectCounter will count the 
-	amount of calls to the Intersect function within the OpenCL kernel. 
-	The intersectHitCounter will count the amount of intersecitons that actually hit a triangle. 
-	To count, we will use OpenCL atomic operatations.
-
-	KNOWN ISSUE: Unsigned integers will easily overflow on the intersect counter since a couple of 
-	thousand faces on a reasonably low resolution (740p) can generate 4 billion intersects. 
-	This will be currently a limitation since 64 bits atomic operations in OpenCL are done using 
-	an extension, which to the best of our knowledge NVIDIA does not implement.
+	Efficiency metrics count the intersect tests against faces within the OpenCL kernel, how many of them
+	hit a triangle, the box tests and the nodes and leaves visited on the BVH.
+	Each work-item counts on private memory, and its work-group adds them up on local memory into a single
+	partial sum, so there are no atomic operations. The partial sums are added up on the host with 64 bits,
+	a couple of thousand faces on a reasonably low resolution (740p) can generate 4 billion intersects.
 	*/
-	cl_uint temp = 0;
-	OCLMemoryObject<cl_uint>* mem_intersectCounter = context->CreateMemoryObject<cl_uint>(1);
-	mem_intersectCounter->SetData(&temp);
-
-	OCLMemoryObject<cl_uint>* mem_intersectHitCounter = context->CreateMemoryObject<cl_uint>(1);
-	mem_intersectHitCounter->SetData(&temp);
-	
 	if (m_efficiencyInfo)
 	{
-		mem_intersectCounter->SyncHostToDevice();
-		mem_intersectHitCounter->SyncHostToDevice();
+		/* the counters of the previous frame may still be getting read into the host memory */
+		if (!this->FinishFrame())
+			return false;
+		if (!m_countersMem->FillDeviceMemory(s_noCounters))
+			return false;
 	}
 
-	// set remaining arguments
-	m_kernel->SetArgument(5, sceneInfoMem);
-	m_kernel->SetArgument(6, m_frame);
-	m_kernel->SetArgument(7, mem_cam);
-	m_kernel->SetArgument(8, mem_light);
-	m_kernel->SetArgument(9, mem_intersectCounter);
-	m_kernel->SetArgument(10, mem_intersectHitCounter);
+	/* upload everything changed since the last frame */
+	TraceSpan span("Frame upload", "upload");
+	if (!context->SyncAllMemoryHostToDevice())
+		return false;
+
+	return true;
+}
+
+bool RenderGirlShared::Render(int width, int height, Camera &camera, Light &light, AntiAliasingMethod AAOption)
+{
+	if (!this->RenderAsync(width, height, camera, light, AAOption))
+		return false;
+
+	return this->FinishFrame();
+}
 
-	m_kernel->SetGlobalWorkSize(pixelCount); // one work-iten per pixel
+/* what OnFrameReady needs to call the callback of a frame, the frame may be done only after the next one started */
+struct FrameReadyCall
+{
+	RenderGirlShared* shared;
+	FrameReadyCallback callback;
+	void* userData;
+	const cl_uchar4* frame;
+	int width;
+	int height;
+};
+
+bool RenderGirlShared::RenderAsync(int width, int height, Camera &camera, Light &light, AntiAliasingMethod AAOption,
+	FrameReadyCallback callback, void* userData)
+{
+	assert(m_selectedDevice != NULL && "You must have a working context to call this");
+	TraceSpan span("RenderAsync", "frame");
+
+	// start counter
+	auto pretime = std::chrono::high_resolution_clock::now();
+
+	OCLContext* context = m_selectedDevice->GetContext();
+
+	/* transfers of this frame, the scene and the small buffers are only uploaded when they change */
+	size_t bytesToDevice = context->GetBytesToDevice();
+	size_t bytesToHost = context->GetBytesToHost();
+
+	/* the scene is prepared while the device may still be working on the previous frame, the uploads are 
+	 * queued after it */
+	if (!this->PrepareFrame(width, height, camera, light))
+		return false;
+
+	/* the previous frame is read into the same host memory */
+	if (!this->FinishFrame())
+		return false;
+
+	int pixelCount = width * height; // total amount of pixels
+
+	if (AAOption != noAA)		//if there is antialiasing
+	{
+		if (!PrepareAntiAliasing(pixelCount))
+			return false;
+	}
+
+	// set remaining arguments
+	m_kernel->SetArgument(6, m_sceneInfoMem);
+	m_kernel->SetArgument(7, m_frame);
+	m_kernel->SetArgument(8, m_cameraMem);
+	m_kernel->SetArgument(9, m_lightMem);
+	if (!this->SetTraceRange(m_kernel, width, height)) // one work-iten per pixel
+		return false;
+	if (!this->SetTraversalCostArgument(pixelCount))
+		return false;
 
 	if (!m_kernel->EnqueueExecution())
 		return false;
 
 	if (AAOption != noAA)
 	{
-		if (!ExecuteAntiAliasing(width, height))
+		if (!ExecuteAntiAliasing(m_frame, width, height))
 			return false;
+	}
 
-		m_frame->CopyFromMemoryBuffer(m_frame_AA);
+	/* the counters are read before the frame, so they are ready along with it */
+	if (m_efficiencyInfo)
+	{
+		if (!m_countersMem->SyncDeviceToHost(NULL))
+			return false;
+	}
+	if (m_traversalCost)
+	{
+		if (!m_traversalCostMem->SyncDeviceToHost(NULL))
+			return false;
 	}
 
-	if (!context->ExecuteCommands())
+	if (!m_frame->SyncDeviceToHost(&m_frameEvent))
 		return false;
 
-	if (AAOption != noAA)
+	if (callback != NULL)
 	{
-		context->DeleteMemoryObject(m_frame_AA);
-		m_frame_AA = NULL;
+		FrameReadyCall* call = new FrameReadyCall;
+		call->shared = this;
+		call->callback = callback;
+		call->userData = userData;
+		call->frame = m_frame->GetData();
+		call->width = width;
+		call->height = height;
+		m_callbackPending = true;
+		if (clSetEventCallback(m_frameEvent, CL_COMPLETE, &RenderGirlShared::OnFrameReady, call) != CL_SUCCESS)
+		{
+			m_callbackPending = false;
+			delete call;
+			Log::Error("Couldn't set the callback of the frame on " + m_selectedDevice->GetName());
+			return false;
+		}
+	}
+
+	if (!context->FlushCommands())
+		return false;
+
+	m_renderPending = true;
+	m_renderStart = pretime;
+	m_frameProfiledCommands = context->GetProfiledCommands();
+	m_frameBytesToDevice = context->GetBytesToDevice() - bytesToDevice;
+	m_frameBytesToHost = context->GetBytesToHost() - bytesToHost;
+
+	return true;
+}
+
+void CL_CALLBACK RenderGirlShared::OnFrameReady(cl_event event, cl_int status, void* data)
+{
+	FrameReadyCall* call = (FrameReadyCall*)data;
+	/* failed frames are reported by FinishFrame */
+	if (status == CL_COMPLETE)
+		call->callback(call->frame, call->width, call->height, call->userData);
+
+	/* the frame can be read over from now on */
+	RenderGirlShared* shared = call->shared;
+	delete call;
+	std::lock_guard<std::mutex> lock(shared->m_callbackMutex);
+	shared->m_callbackPending = false;
+	shared->m_callbackDone.notify_all();
+}
+
+bool RenderGirlShared::SetTraceRange(OCLKernel* kernel, const int width, const int height)
+{
+	int tileWidth = m_tileWidth;
+	int tileHeight = m_tileHeight;
+	if ((size_t)(tileWidth * tileHeight) > kernel->GetMaxWorkGroupSize())
+		tileWidth = tileHeight = 0;
+
+	kernel->SetGlobalWorkSize(width, height);
+	if (!m_efficiencyInfo)
+	{
+		kernel->SetLocalWorkSize(tileWidth, tileHeight);
+		/* not used by the kernel, but every argument must be set */
+		kernel->SetArgument(10, m_countersMem);
+		return kernel->SetLocalArgument(11, sizeof(cl_ulong));
+	}
+
+	/* the counters are reduced on local memory, so the size of the work-groups can't be left to the OpenCL 
+	 * implementation. Tiles too big for the kernel are halved until they fit */
+	if (tileWidth == 0)
+	{
+		tileWidth = m_tileWidth > 0 ? m_tileWidth : 8;
+		tileHeight = m_tileHeight > 0 ? m_tileHeight : 8;
+	}
+	while ((size_t)(tileWidth * tileHeight) > kernel->GetMaxWorkGroupSize())
+	{
+		if (tileWidth >= tileHeight)
+			tileWidth /= 2;
+		else
+			tileHeight /= 2;
+	}
+	kernel->SetLocalWorkSize(tileWidth, tileHeight);
+
+	int groups = ((width + tileWidth - 1) / tileWidth) * ((height + tileHeight - 1) / tileHeight);
+	if (m_countersMem->GetSize() < groups)
+	{
+		/* the counters of a sequence add up all of its frames, they're only sized by the first one */
+		if (!m_sequenceSlots.empty() && m_sequenceQueued + m_sequenceFrames > 0)
+		{
+			Log::Error("The frames of a sequence can't grow beyond the first one with the efficiency info on");
+			return false;
+		}
+		OCLContext* context = m_selectedDevice->GetContext();
+		cl_bool error = false;
+		context->DeleteMemoryObject<EfficiencyCounters>(m_countersMem);
+		m_countersMem = context->CreateMemoryObject<EfficiencyCounters>(groups, ReadWrite, &error);
+		if (error)
+			return false;
+		m_countersMem->SetData(new EfficiencyCounters[groups], false);
+		m_countersMem->MarkClean(); /* cleared on the device */
+		if (!m_countersMem->FillDeviceMemory(s_noCounters))
+			return false;
+	}
+
+	kernel->SetArgument(10, m_countersMem);
+	return kernel->SetLocalArgument(11, tileWidth * tileHeight * sizeof(cl_ulong));
+}
+
+bool RenderGirlShared::SetTraversalCostArgument(const int pixelCount)
+{
+	/* the kernel without the traversal cost still needs a buffer on the argument */
+	int size = m_traversalCost ? pixelCount : 1;
+	if (m_traversalCostMem != NULL && m_traversalCostMem->GetSize() != size)
+	{
+		m_selectedDevice->GetContext()->DeleteMemoryObject<cl_uint2>(m_traversalCostMem);
+		m_traversalCostMem = NULL;
+	}
+	if (m_traversalCostMem == NULL)
+	{
+		cl_bool error = false;
+		m_traversalCostMem = m_selectedDevice->GetContext()->CreateMemoryObject<cl_uint2>(size, WriteOnly, &error);
+		if (error)
+			return false;
+		m_traversalCostMem->SetData(new cl_uint2[size], false);
+		m_traversalCostMem->MarkClean(); /* only written by the device */
+	}
+
+	return m_kernel->SetArgument(12, m_traversalCostMem);
+}
+
+void RenderGirlShared::SetTraversalCost(const bool cost)
+{
+	m_traversalCost = cost;
+}
+
+const cl_uint2* RenderGirlShared::GetTraversalCost()const
+{
+	if (!m_traversalCost || m_traversalCostMem == NULL || m_traversalCostMem->GetSize() != m_scene.pixelCount)
+		return NULL;
+
+	return m_traversalCostMem->GetData();
+}
+
+void RenderGirlShared::SumEfficiencyCounters()
+{
+	m_efficiencyCounters = s_noCounters;
+	/* the partial sums of the work-groups not used by the frame stay at 0 */
+	for (int g = 0; g < m_countersMem->GetSize(); g++)
+	{
+		const EfficiencyCounters &group = (*m_countersMem)[g];
+		m_efficiencyCounters.intersect_tests += group.intersect_tests;
+		m_efficiencyCounters.intersect_hits += group.intersect_hits;
+		m_efficiencyCounters.box_tests += group.box_tests;
+		m_efficiencyCounters.nodes_visited += group.nodes_visited;
+		m_efficiencyCounters.leaves_visited += group.leaves_visited;
+	}
+}
+
+void RenderGirlShared::LogEfficiencyInfo()
+{
+	float hitPercentage = 0;
+	/* compute efficiency of ray collisions */
+	const EfficiencyCounters &counters = m_efficiencyCounters;
+
+	if (counters.intersect_tests > 0 && counters.intersect_hits > 0)
+	{
+		hitPercentage = (100.0f * counters.intersect_hits) / counters.intersect_tests;
 	}
 
-	m_frame->SyncDeviceToHost();
+	Log::Message("Amount of intersect tests: " + std::to_string(counters.intersect_tests));
+	Log::Message("Amount of hits on intersect tests " + std::to_string(counters.intersect_hits));
+	Log::Message("Percentage of successful hits is " + std::to_string(hitPercentage) + "%");
+	Log::Message("Amount of box tests: " + std::to_string(counters.box_tests) + ", nodes visited: " + 
+		std::to_string(counters.nodes_visited) + ", leaves visited: " + std::to_string(counters.leaves_visited));
+}
+
+void RenderGirlShared::LogFrameTiming()
+{
+	for (int s = 0; s < ProfilingStageCount; s++)
+	{
+		const StageTiming &stage = m_frameTiming.stages[s];
+		if (stage.commands == 0)
+			continue;
+
+		Log::Message(std::string(OCLContext::GetProfilingStageName((ProfilingStage)s)) + ": " + std::to_string(stage.commands) + " commands took " +
+			std::to_string(stage.busy / 1000000.0f) + " ms on the device, queued at " + std::to_string(stage.queued / 1000000.0f) + 
+			" ms, started at " + std::to_string(stage.start / 1000000.0f) + " ms and ended at " + std::to_string(stage.end / 1000000.0f) + " ms.");
+	}
+}
+
+void RenderGirlShared::CollectFrameTiming(const int amount)
+{
+	if (amount <= 0)
+		return;
+
+	m_selectedDevice->GetContext()->CollectProfiling(m_frameTiming, amount);
+}
 
+void RenderGirlShared::LogFrameInfo()
+{
 	// finish timer
 	auto postime = std::chrono::high_resolution_clock::now();
-	std::chrono::nanoseconds ns = std::chrono::duration_cast<std::chrono::nanoseconds>(postime - pretime);
+	std::chrono::nanoseconds ns = std::chrono::duration_cast<std::chrono::nanoseconds>(postime - m_renderStart);
 	Log::Message("Rendering took " + std::to_string((float)(ns.count() / 1000000000.0f)) + " seconds.");
 
 	if (m_efficiencyInfo)
+		this->LogEfficiencyInfo();
+	if (m_profiling)
+		this->LogFrameTiming();
+
+	Log::Message("Transferred " + std::to_string(m_frameBytesToDevice) + " bytes to the device and " + 
+		std::to_string(m_frameBytesToHost) + " bytes back to the host.");
+}
+
+bool RenderGirlShared::AddSamples(int width, int height, Camera &camera, Light &light, const int samples)
+{
+	assert(m_selectedDevice != NULL && "You must have a working context to call this");
+	assert(samples > 0);
+	TraceSpan span("AddSamples", "frame");
+
+	OCLContext* context = m_selectedDevice->GetContext();
+	cl_bool error = false;
+
+	size_t bytesToDevice = context->GetBytesToDevice();
+	size_t bytesToHost = context->GetBytesToHost();
+
+	if (!this->PrepareFrame(width, height, camera, light))
+		return false;
+	/* the host memory of the frame is read again at the end */
+	if (!this->FinishFrame())
+		return false;
+	if (!this->PrepareProgressive())
+		return false;
+
+	/* the accumulation buffer is only used by the device, a new one starts over */
+	int pixelCount = width * height;
+	if (m_accumulation != NULL && m_accumulation->GetSize() != pixelCount)
+	{
+		context->DeleteMemoryObject<cl_float4>(m_accumulation);
+		m_accumulation = NULL;
+	}
+	if (m_accumulation == NULL)
 	{
-		float hitPercentage = 0;
-		mem_intersectCounter->SyncDeviceToHost();
-		mem_intersectHitCounter->SyncDeviceToHost();
-		/* compute efficiency of ray collisions */
-		cl_uint intersectCounter = (*mem_intersectCounter)[0];
-		cl_uint intersectHitCounter = (*mem_intersectHitCounter)[0];
+		m_accumulation = context->CreateMemoryObject<cl_float4>(pixelCount, ReadWrite, &error);
+		if (error)
+			return false;
+		m_sampleCount = 0;
+	}
 
-		if (intersectCounter > 0 && intersectHitCounter > 0)
-		{
-			hitPercentage = (100.0f * intersectHitCounter) / intersectCounter;
-		}
+	/* the scene was prepared for the kernel of Render, this only sets its arguments */
+	if (!SceneManager::GetSharedManager().PrepareScene(m_kernel_progressive))
+		return false;
 
-		Log::Message("Amount of intersect tests: " + std::to_string(intersectCounter));
-		Log::Message("Amount of hits on intersect tests " + std::to_string(intersectHitCounter));
-		Log::Message("Percentage of successful hits is " + std::to_string(hitPercentage) + "%");
+	m_kernel_progressive->SetArgument(6, m_sceneInfoMem);
+	m_kernel_progressive->SetArgument(7, m_accumulation);
+	m_kernel_progressive->SetArgument(8, m_cameraMem);
+	m_kernel_progressive->SetArgument(9, m_lightMem);
+	if (!this->SetTraceRange(m_kernel_progressive, width, height))
+		return false;
+
+	for (int s = 0; s < samples; s++)
+	{
+		if (!m_kernel_progressive->SetValueArgument<cl_int>(12, m_sampleCount))
+			return false;
+		if (!m_kernel_progressive->EnqueueExecution())
+			return false;
+		m_sampleCount++;
 	}
 
+	m_kernel_resolve->SetArgument(0, m_accumulation);
+	m_kernel_resolve->SetArgument(1, m_frame);
+	m_kernel_resolve->SetValueArgument<cl_int>(2, pixelCount);
+	m_kernel_resolve->SetValueArgument<cl_int>(3, m_sampleCount);
+	m_kernel_resolve->SetGlobalWorkSize(pixelCount);
+	if (!m_kernel_resolve->EnqueueExecution())
+		return false;
+
+	/* the counters add up every sample of this call */
+	if (m_efficiencyInfo)
+	{
+		if (!m_countersMem->SyncDeviceToHost(NULL))
+			return false;
+	}
+
+	/* the frame is read back once the samples are done, without waiting for them here */
+	if (!m_frame->SyncDeviceToHost(&m_frameEvent))
+		return false;
+	if (!context->FlushCommands())
+		return false;
+
+	m_frameProfiledCommands = context->GetProfiledCommands();
+	m_frameBytesToDevice = context->GetBytesToDevice() - bytesToDevice;
+	m_frameBytesToHost = context->GetBytesToHost() - bytesToHost;
 
 	return true;
 }
 
-void RenderGirlShared::ReleaseDevice()
+bool RenderGirlShared::IsFrameReady()
+{
+	if (m_frameEvent == NULL)
+		return true;
+
+	cl_int status = CL_COMPLETE;
+	if (clGetEventInfo(m_frameEvent, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(cl_int), &status, NULL) != CL_SUCCESS)
+		status = CL_COMPLETE;
+	if (status > CL_COMPLETE)
+		return false; // still queued or running
+
+	{
+		std::lock_guard<std::mutex> lock(m_callbackMutex);
+		if (m_callbackPending)
+			return false; // the callback is still using the frame
+	}
+
+	/* done, or failed, FinishFrame reports the error */
+	return this->FinishFrame();
+}
+
+bool RenderGirlShared::FinishFrame()
+{
+	if (m_frameEvent == NULL)
+		return true;
+
+	cl_int error;
+	{
+		TraceSpan span("Wait for frame", "frame");
+		error = clWaitForEvents(1, &m_frameEvent);
+
+		/* the event completes before its callback is called, the frame is still in use until it returns */
+		std::unique_lock<std::mutex> lock(m_callbackMutex);
+		while (m_callbackPending)
+			m_callbackDone.wait(lock);
+	}
+	clReleaseEvent(m_frameEvent);
+	m_frameEvent = NULL;
+	bool renderPending = m_renderPending;
+	m_renderPending = false;
+
+	this->CollectFrameTiming(m_frameProfiledCommands);
+	m_frameProfiledCommands = 0;
+	if (error != CL_SUCCESS)
+	{
+		Log::Error("Failed to render the frame on the device " + m_selectedDevice->GetName());
+		return false;
+	}
+
+	if (m_efficiencyInfo)
+		this->SumEfficiencyCounters();
+	if (renderPending)
+		this->LogFrameInfo();
+
+	return true;
+}
+
+bool RenderGirlShared::BeginSequence(const int buffers)
+{
+	assert(m_selectedDevice != NULL && "You must have a working context to call this");
+	assert(buffers > 0 && "A sequence needs at least one buffer");
+
+	if (!m_sequenceSlots.empty())
+		this->EndSequence();
+
+	OCLContext* context = m_selectedDevice->GetContext();
+	cl_bool error = false;
+
+	if (!this->CreateFrameBuffers())
+		return false;
+
+	/* the frame buffers are created by the first frame, they depend on the resolution */
+	for (int b = 0; b < buffers; b++)
+	{
+		SequenceSlot slot;
+		slot.frame = NULL;
+		slot.event = NULL;
+		slot.profiledCommands = 0;
+
+		slot.sceneInfo = context->CreateMemoryObject<SceneInformation>(1, ReadOnly, &error);
+		if (error)
+			return false;
+		slot.sceneInfo->SetData(new SceneInformation[1], false);
+
+		slot.camera = context->CreateMemoryObject<Camera>(1, ReadOnly, &error);
+		if (error)
+			return false;
+		slot.camera->SetData(new Camera[1], false);
+
+		slot.light = context->CreateMemoryObject<Light>(1, ReadOnly, &error);
+		if (error)
+			return false;
+		slot.light->SetData(new Light[1], false);
+
+		m_sequenceSlots.push_back(slot);
+	}
+
+	/* a frame of RenderAsync left on the device is done before the sequence, it reported its own error */
+	this->FinishFrame();
+
+	/* the efficiency counters add up the whole sequence */
+	if (m_efficiencyInfo)
+	{
+		if (!m_countersMem->FillDeviceMemory(s_noCounters) || !context->ExecuteCommands())
+			return false;
+	}
+
+	/* the frames of the sequence collect their commands from the front of the profiled ones, so nothing
+	 * profiled before them can be left there */
+	FrameTiming discarded;
+	context->CollectProfiling(discarded);
+
+	m_sequenceFirst = 0;
+	m_sequenceQueued = 0;
+	m_sequenceFrames = 0;
+	m_sequenceProfiledCommands = 0;
+	m_sequenceStart = std::chrono::high_resolution_clock::now();
+
+	return true;
+}
+
+bool RenderGirlShared::QueueSequenceFrame(int width, int height, Camera &camera, Light &light, AntiAliasingMethod AAOption)
+{
+	assert(m_selectedDevice != NULL && "You must have a working context to call this");
+	assert(!m_sequenceSlots.empty() && "Call BeginSequence first");
+	TraceSpan span("QueueSequenceFrame", "frame");
+
+	if (m_sequenceQueued == (int)m_sequenceSlots.size())
+	{
+		Log::Error("All the buffers of the sequence are in use, finish a frame before queueing another one");
+		return false;
+	}
+
+	OCLContext* context = m_selectedDevice->GetContext();
+	cl_bool error = false;
+
+	/* scene changes are uploaded from copies of the host memory, queued after the frames already on the device,
+	 * everything else of the frame goes on its own buffers */
+	if (!this->PrepareFrameScene(width, height))
+		return false;
+
+	SequenceSlot& slot = m_sequenceSlots[(m_sequenceFirst + m_sequenceQueued) % m_sequenceSlots.size()];
+
+	int pixelCount = width * height;
+	if (slot.frame != NULL && slot.frame->GetSize() != pixelCount)
+	{
+		context->DeleteMemoryObject<cl_uchar4>(slot.frame);
+		slot.frame = NULL;
+	}
+	if (slot.frame == NULL)
+	{
+		slot.frame = context->CreateMemoryObject<cl_uchar4>(pixelCount, WriteOnly, &error);
+		if (error)
+			return false;
+		slot.frame->SetData(new cl_uchar4[pixelCount], false);
+		slot.frame->MarkClean(); /* only written by the device */
+	}
+
+	/* the host memory of the slot is left alone until its frame is finished, so the uploads don't block */
+	(*slot.sceneInfo)[0] = m_scene;
+	(*slot.light)[0] = light;
+	PrepareCamera(camera);
+	(*slot.camera)[0] = camera;
+	if (!slot.sceneInfo->SyncHostToDevice(NULL) || !slot.camera->SyncHostToDevice(NULL) || !slot.light->SyncHostToDevice(NULL))
+		return false;
+
+	if (AAOption != noAA)
+	{
+		if (!PrepareAntiAliasing(pixelCount))
+			return false;
+	}
+
+	m_kernel->SetArgument(6, slot.sceneInfo);
+	m_kernel->SetArgument(7, slot.frame);
+	m_kernel->SetArgument(8, slot.camera);
+	m_kernel->SetArgument(9, slot.light);
+	if (!this->SetTraceRange(m_kernel, width, height))
+		return false;
+	/* the traversal cost of the frames of a sequence is not read */
+	if (!this->SetTraversalCostArgument(pixelCount))
+		return false;
+
+	if (!m_kernel->EnqueueExecution())
+		return false;
+
+	if (AAOption != noAA)
+	{
+		if (!ExecuteAntiAliasing(slot.frame, width, height))
+			return false;
+	}
+
+	/* upload, trace and FXAA of the frame run in order on the main queue, the read waits only for them on the 
+	 * transfer queue, so it isn't held behind the commands of the next frame */
+	cl_event traced;
+	if (!context->EnqueueMarker(&traced))
+		return false;
+	bool read = slot.frame->SyncDeviceToHost(traced, &slot.event);
+	clReleaseEvent(traced);
+	if (!read)
+		return false;
+	if (!context->FlushCommands())
+		return false;
+
+	/* the commands profiled before belong to the frames queued before */
+	slot.profiledCommands = context->GetProfiledCommands() - m_sequenceProfiledCommands;
+	m_sequenceProfiledCommands += slot.profiledCommands;
+	m_sequenceQueued++;
+	return true;
+}
+
+const cl_uchar4* RenderGirlShared::FinishSequenceFrame()
+{
+	if (m_sequenceQueued == 0)
+		return NULL;
+
+	SequenceSlot& slot = m_sequenceSlots[m_sequenceFirst];
+	m_sequenceFirst = (m_sequenceFirst + 1) % m_sequenceSlots.size();
+	m_sequenceQueued--;
+
+	cl_int error;
+	{
+		TraceSpan span("Wait for frame", "frame");
+		error = clWaitForEvents(1, &slot.event);
+	}
+	clReleaseEvent(slot.event);
+	slot.event = NULL;
+
+	this->CollectFrameTiming(slot.profiledCommands);
+	m_sequenceProfiledCommands -= slot.profiledCommands;
+	if (error != CL_SUCCESS)
+	{
+		Log::Error("Failed to render a frame of the sequence on the device " + m_selectedDevice->GetName());
+		return NULL;
+	}
+
+	m_sequenceFrames++;
+	return slot.frame->GetData();
+}
+
+void RenderGirlShared::EndSequence()
 {
 	assert(m_selectedDevice != NULL);
 
-	Log::Message("Freeing resources on device " + m_selectedDevice->GetName());
+	while (m_sequenceQueued > 0)
+		this->FinishSequenceFrame();
 
-	SceneManager& manager = SceneManager::GetSharedManager();
-	manager.SetContext(NULL); /* update context reference of the manager */
+	auto postime = std::chrono::high_resolution_clock::now();
+	std::chrono::nanoseconds ns = std::chrono::duration_cast<std::chrono::nanoseconds>(postime - m_sequenceStart);
+	float seconds = ns.count() / 1000000000.0f;
+	Log::Message("Rendered " + std::to_string(m_sequenceFrames) + " frames of the sequence in " + std::to_string(seconds) + 
+		" seconds, " + std::to_string(seconds > 0.0f ? m_sequenceFrames / seconds : 0.0f) + " frames per second.");
 
-	if (m_kernel != NULL)
+	if (m_efficiencyInfo && m_sequenceFrames > 0)
 	{
-		delete m_kernel;
-		m_kernel = NULL;
+		if (m_countersMem->SyncDeviceToHost())
+		{
+			this->SumEfficiencyCounters();
+			this->LogEfficiencyInfo();
+		}
+	}
 
+	/* the read of the counters is not part of the next frame */
+	OCLContext* context = m_selectedDevice->GetContext();
+	FrameTiming discarded;
+	context->CollectProfiling(discarded);
+
+	for (unsigned int b = 0; b < m_sequenceSlots.size(); b++)
+	{
+		if (m_sequenceSlots[b].frame != NULL)
+			context->DeleteMemoryObject<cl_uchar4>(m_sequenceSlots[b].frame);
+		context->DeleteMemoryObject<SceneInformation>(m_sequenceSlots[b].sceneInfo);
+		context->DeleteMemoryObject<Camera>(m_sequenceSlots[b].camera);
+		context->DeleteMemoryObject<Light>(m_sequenceSlots[b].light);
 	}
-	if (m_kernel_AA != NULL)
+	m_sequenceSlots.clear();
+	m_sequenceFirst = 0;
+	m_sequenceQueued = 0;
+}
+
+void RenderGirlShared::SetProfiling(const bool profiling)
+{
+	m_profiling = profiling;
+	if (m_selectedDevice != NULL && m_selectedDevice->IsReady())
+		m_selectedDevice->GetContext()->SetProfiling(profiling);
+}
+
+void RenderGirlShared::SetTileSize(const int width, const int height)
+{
+	assert(width >= 0 && height >= 0);
+	if (width == 0 || height == 0)
 	{
-		delete m_kernel_AA;
-		m_kernel_AA = NULL;
+		m_tileWidth = m_tileHeight = 0;
 	}
-	if (m_program != NULL)
+	else
 	{
-		delete m_program;
-		m_program = NULL;
+		m_tileWidth = width;
+		m_tileHeight = height;
 	}
+}
+
+bool RenderGirlShared::TuneTileSize(int width, int height, Camera &camera, Light &light)
+{
+	assert(m_selectedDevice != NULL && m_kernel != NULL);
+
+	static const int candidates[][2] = { { 0, 0 }, { 4, 4 }, { 8, 4 }, { 8, 8 }, { 16, 4 }, { 16, 8 }, { 8, 16 }, { 32, 4 }, { 16, 16 }, { 32, 8 } };
+	static const int candidatesAmount = sizeof(candidates) / sizeof(candidates[0]);
+	static const int rendersPerCandidate = 3;
+
+	/* the first render prepares the scene and the buffers, so it's not measured */
+	Camera renderCamera = camera;
+	if (!this->Render(width, height, renderCamera, light))
+		return false;
+
+	int bestWidth = m_tileWidth;
+	int bestHeight = m_tileHeight;
+	long long bestTime = -1;
+	for (int c = 0; c < candidatesAmount; c++)
+	{
+		if (candidates[c][0] * candidates[c][1] > m_kernel->GetMaxWorkGroupSize())
+			continue;
+
+		this->SetTileSize(candidates[c][0], candidates[c][1]);
+
+		/* the fastest of a few renders, to filter out noise from the rest of the system */
+		long long time = -1;
+		for (int r = 0; r < rendersPerCandidate; r++)
+		{
+			renderCamera = camera;
+			auto pretime = std::chrono::high_resolution_clock::now();
+			if (!this->Render(width, height, renderCamera, light))
+				return false;
+			long long ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::high_resolution_clock::now() - pretime).count();
+			if (time < 0 || ns < time)
+				time = ns;
+		}
+
+		Log::Message("Tile size " + std::to_string(candidates[c][0]) + "x" + std::to_string(candidates[c][1]) + 
+			" rendered in " + std::to_string(time / 1000000.0f) + "ms");
+		if (bestTime < 0 || time < bestTime)
+		{
+			bestTime = time;
+			bestWidth = candidates[c][0];
+			bestHeight = candidates[c][1];
+		}
+	}
+
+	this->SetTileSize(bestWidth, bestHeight);
+	m_tunedTileSizes[m_selectedDevice->GetName()] = std::make_pair(bestWidth, bestHeight);
+	Log::Message("Best tile size for " + m_selectedDevice->GetName() + " is " + std::to_string(bestWidth) + "x" + std::to_string(bestHeight));
+
+	return true;
+}
+
+void RenderGirlShared::ReleaseDevice()
+{
+	assert(m_selectedDevice != NULL);
+
+	Log::Message("Freeing resources on device " + m_selectedDevice->GetName());
+
+	this->FinishFrame();
+	if (!m_sequenceSlots.empty())
+		this->EndSequence();
+
+	SceneManager& manager = SceneManager::GetSharedManager();
+	manager.SetContext(NULL); /* update context reference of the manager */
+
+	/* every program built on this device, including the current one */
+	std::map<std::string, ProgramVariant>::iterator it;
+	for (it = m_programVariants.begin(); it != m_programVariants.end(); it++)
+		ReleaseProgramVariant(it->second);
+	m_programVariants.clear();
+	m_variantUses = 0;
+	m_kernel = NULL;
+	m_kernel_AA = NULL;
+	m_kernel_progressive = NULL;
+	m_kernel_resolve = NULL;
+	m_program = NULL;
 	if (m_frame != NULL)
 	{
 		/* this will get deallocated anyway on ReleaseContext so there's no need to delete it here
@@ -459,6 +1364,17 @@ void RenderGirlShared::ReleaseDevice()
 		m_frame_AA = NULL;
 	}
 
+	/* same for the buffers rewritten on every render */
+	m_sceneInfoMem = NULL;
+	m_cameraMem = NULL;
+	m_lightMem = NULL;
+	m_countersMem = NULL;
+	m_traversalCostMem = NULL;
+	m_widthMem = NULL;
+	m_heightMem = NULL;
+	m_accumulation = NULL;
+	m_sampleCount = 0;
+
 	m_selectedDevice->ReleaseContext();
 	m_selectedDevice = NULL;
 }
\ No newline at end of file
@@ -21,6 +21,10 @@
 
 #include <assert.h>
 #include <string>
+#include <map>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
 
 #include "CL\cl.h"
 #include "Log.h"
@@ -28,6 +32,7 @@
 #include "OCLDevice.h"
 #include "OCLKernel.h"
 #include "CLStructs.h"
+#include "BVH.h"
 #include "SceneManager.h"
 
 enum AntiAliasingMethod
@@ -35,6 +40,14 @@ enum AntiAliasingMethod
 	noAA,
 	FXAA
 };
+
+/* Function called when a frame of RenderAsync is on the host memory. It runs on a thread of the OpenCL implementation,
+	so it must not call RenderGirl back, only hand the frame over to the thread that rendered it. 
+	The frame is the same memory returned by GetFrame, the next frame is read into it, so it's only valid until the
+	next call to RenderAsync, AddSamples or FinishFrame. Those wait for the callback to return, it should copy the
+	frame instead of keeping the pointer */
+typedef void (*FrameReadyCallback)(const cl_uchar4* frame, int width, int height, void* userData);
+
 /* Singleton class encapsules the OpenCL status and the renderer status.*/
 class RenderGirlShared
 {
@@ -66,8 +79,55 @@ public:
 
 	/* PrepareRaytracer function prepare the OpenCL raytracer to work on the selected device.
 		efficiency controls if RenderGirl should show efficiency information on the log
+		layout selects the format of the BVH nodes the kernel is compiled for
+		shadows controls if a shadow ray is traced towards the light from every point hit
 		You got to have a selected device to call this. Return FALSE if there's an error with the device. */
-	bool PrepareRaytracer(const bool efficiency = false);
+	bool PrepareRaytracer(const bool efficiency = false, const BVHLayout layout = StacklessLayout, const bool shadows = false);
+
+	/* Build kernels specialized on the resolution and on the scene, receiving them as compile time constants
+		instead of reading them from memory on every pixel. Each configuration is built once on the first render
+		using it and kept until the device is released, and its binary is cached on disk like any other program.
+		Useful for batch renders at a fixed resolution, disabled by default */
+	inline void SetSpecializedKernels(const bool specialized)
+	{
+		m_specializedKernels = specialized;
+	}
+
+	/* Set the size of the tiles of pixels traced by each work-group, neighbour rays tend to visit the same BVH nodes
+		so they are kept together. 8x8 by default, 0x0 lets the OpenCL implementation choose.
+		Tiles with more pixels than the kernel supports on the selected device fall back to 0x0 */
+	void SetTileSize(const int width, const int height);
+
+	/* Time every command sent to the device for each frame, the uploads, the kernels and the readback, through
+		the profiling of the command queue. The times of the last frame finished are on GetFrameTiming and on the log.
+		Disabled by default */
+	void SetProfiling(const bool profiling);
+
+	/* Return the timing of each stage of the last frame finished while profiling, see SetProfiling */
+	inline const FrameTiming& GetFrameTiming()const
+	{
+		return m_frameTiming;
+	}
+
+	/* Return the efficiency metrics of the last frame or sequence finished, they are only counted when 
+		PrepareRaytracer was called with efficiency */
+	inline const EfficiencyCounters& GetEfficiencyCounters()const
+	{
+		return m_efficiencyCounters;
+	}
+
+	/* Diagnostic mode writing the traversal cost of each pixel on the frames of Render and RenderAsync, the nodes 
+		visited on x and the faces tested on y, including the shadow ray. Useful to find the regions of the scene where
+		the BVH is poor. The kernels are built again with it, disabled by default */
+	void SetTraversalCost(const bool cost);
+
+	/* Return the traversal cost of each pixel of the last frame finished, NULL if SetTraversalCost is disabled */
+	const cl_uint2* GetTraversalCost()const;
+
+	/* Render the current scene with a set of candidate tile sizes and keep the fastest one. The result is remembered
+		for the selected device, so selecting it again restores it. This renders the scene several times, and 
+		frames are the same for any tile size. Return FALSE for an error */
+	bool TuneTileSize(int width, int height, Camera &camera, Light &light);
 
 	/* Render a frame. You should only call this with a kernel ready and a 3D scene.
 		This is a blocking call.
@@ -75,6 +135,82 @@ public:
 		Return FALSE for an error */
 	bool Render(int width, int height, Camera &camera, Light &light, AntiAliasingMethod AAOption = noAA);
 
+	/* Same as Render, but it only prepares the scene and sends the frame to the device, without waiting for it.
+		The frame is ready once IsFrameReady returns TRUE or FinishFrame returns, and callback is called with 
+		userData as soon as it is on the host memory, see FrameReadyCallback. One of them must still be called to 
+		finish the frame. The scene can be changed for the next frame while the device renders this one, and the
+		next call prepares it before waiting for this frame, so the frame is only valid until then.
+		Return FALSE for an error */
+	bool RenderAsync(int width, int height, Camera &camera, Light &light, AntiAliasingMethod AAOption = noAA,
+		FrameReadyCallback callback = NULL, void* userData = NULL);
+
+	/* Progressive rendering. Each call traces more samples of every pixel, jittered inside it, and averages them
+		with the ones traced before into the frame, so it gets smoother on every call. The first sample is the same 
+		one traced by Render, so a usable frame is ready right after it. Changes to the scene, the resolution, the
+		camera or the light start over from the first sample.
+		This is a non-blocking call like RenderAsync, the frame is ready once IsFrameReady returns TRUE or FinishFrame
+		returns. Return FALSE for an error */
+	bool AddSamples(int width, int height, Camera &camera, Light &light, const int samples = 1);
+
+	/* Return TRUE if the frame sent to the device by RenderAsync or AddSamples is on the host memory, finishing it,
+		also when there's no frame on the device */
+	bool IsFrameReady();
+
+	/* Wait for the frame sent to the device by RenderAsync or AddSamples. Return FALSE for an error */
+	bool FinishFrame();
+
+	/* Return TRUE while the frame of RenderAsync or AddSamples wasn't finished yet, so a FALSE from IsFrameReady 
+		means an error once this returns FALSE */
+	inline bool IsFrameOnDevice()const
+	{
+		return m_frameEvent != NULL;
+	}
+
+	/* Return the amount of samples averaged on the frame by the progressive rendering */
+	inline int GetSampleCount()const
+	{
+		return m_sampleCount;
+	}
+
+	/* Start the progressive rendering over from the first sample on the next call to AddSamples */
+	inline void ResetSamples()
+	{
+		m_sampleCount = 0;
+	}
+
+	/* Animation sequences. Each frame of the sequence has its own frame, camera, light and scene information
+		buffers, up to the amount of buffers given, so the host queues the next frames while the caller uses the
+		ones before them. The read of each frame goes on the transfer queue of the context, waiting only for the 
+		trace of its own frame, so it runs while the device traces the next one.
+		Start a sequence with BeginSequence, then queue the frames with QueueSequenceFrame and take them back in 
+		the same order with FinishSequenceFrame. Return FALSE for an error */
+	bool BeginSequence(const int buffers = 2);
+
+	/* Send the next frame of the sequence to the device without waiting for it. The scene can be changed between
+		frames, those changes are queued after the frames sent before. The resolution can change too, but with the
+		efficiency info on it can't need more work-groups than the first frame, their counters add up the whole
+		sequence. Return FALSE for an error, also when all the buffers of the sequence are in use */
+	bool QueueSequenceFrame(int width, int height, Camera &camera, Light &light, AntiAliasingMethod AAOption = noAA);
+
+	/* Wait for the oldest frame queued on the sequence and return it. This memory belongs to the renderer and it's
+		valid until the buffer is used again by a later frame. Return NULL for an error or no frame queued */
+	const cl_uchar4* FinishSequenceFrame();
+
+	/* Finish all the frames left on the sequence, log its frame rate and release its buffers */
+	void EndSequence();
+
+	/* Return the amount of frames of the sequence on the device */
+	inline int GetSequenceFramesQueued()const
+	{
+		return m_sequenceQueued;
+	}
+
+	/* Return the amount of buffers of the sequence, 0 when there's no sequence */
+	inline int GetSequenceBuffers()const
+	{
+		return m_sequenceSlots.size();
+	}
+
 	/* Release the selected device from use, deallocing all memory used */
 	void ReleaseDevice();
 
@@ -102,11 +238,70 @@ public:
 		return m_platforms.size();
 	}
 
+	/* Return the amount of memory objects created on the selected device so far. Rendering the same scene
+		again at the same resolution reuses every buffer, so it must not change between those renders */
+	inline int GetAllocationCount()
+	{
+		assert(m_selectedDevice != NULL);
+		return m_selectedDevice->GetContext()->GetAllocationCount();
+	}
+
+	/* Return the amount of bytes uploaded to the device on the last frame rendered, including scene changes */
+	inline size_t GetFrameBytesToDevice()const
+	{
+		return m_frameBytesToDevice;
+	}
+
+	/* Return the amount of bytes read back from the device on the last frame rendered */
+	inline size_t GetFrameBytesToHost()const
+	{
+		return m_frameBytesToHost;
+	}
+
 private:
 	RenderGirlShared();
 
-	bool PrepareAntiAliasing();
-	bool ExecuteAntiAliasing(int width, int height);
+	bool PrepareAntiAliasing(const int pixelCount);
+	/* anti-alias the frame given, the result is copied back to it */
+	bool ExecuteAntiAliasing(OCLMemoryObject<cl_uchar4>* frame, int width, int height);
+	bool PrepareProgressive();
+
+	/* Prepare the scene for a frame and the program for it, uploading what changed, and fill the scene information.
+		Return FALSE for an error */
+	bool PrepareFrameScene(int width, int height);
+
+	/* Prepare everything a frame needs before tracing it: the scene, the program for it, the frame buffer, the scene
+		information, the camera and the light, uploading what changed. Return FALSE for an error */
+	bool PrepareFrame(int width, int height, Camera &camera, Light &light);
+
+	/* Create the buffers rewritten on every frame, once */
+	bool CreateFrameBuffers();
+
+	/* Set the range of work-items of a kernel tracing the frame, a tile of pixels on each work-group, and the
+		arguments of the efficiency counters, which need one partial sum for each work-group. Return FALSE for an error */
+	bool SetTraceRange(OCLKernel* kernel, const int width, const int height);
+
+	/* Set the buffer of the traversal cost on the Raytrace kernel, one element for each pixel when it's 
+		enabled. Return FALSE for an error */
+	bool SetTraversalCostArgument(const int pixelCount);
+
+	/* Add up the partial sums of the efficiency counters read from the device into m_efficiencyCounters */
+	void SumEfficiencyCounters();
+
+	/* Log the information of the frame of RenderAsync once it's done */
+	void LogFrameInfo();
+	void LogEfficiencyInfo();
+	void LogFrameTiming();
+
+	/* Read the times of the commands of the frame just finished, the first amount of commands profiled */
+	void CollectFrameTiming(const int amount);
+
+	/* Called by the OpenCL implementation when the frame is on the host memory */
+	static void CL_CALLBACK OnFrameReady(cl_event event, cl_int status, void* data);
+
+	/* Make the program built with the given options the current one, building it on the first call.
+		Return FALSE if there was an error building it */
+	bool SelectProgramVariant(const std::string& options);
 	// prevent copy by not implementing this methods
 	RenderGirlShared(RenderGirlShared const&);
 	void operator=(RenderGirlShared const&);
@@ -120,13 +315,104 @@ private:
 	OCLProgram* m_program;
 	OCLKernel* m_kernel;
 	OCLKernel* m_kernel_AA;
+	OCLKernel* m_kernel_progressive;
+	OCLKernel* m_kernel_resolve;
 	SceneInformation m_scene;
 
+	/* a program built with a given set of options and its kernels, the anti-aliasing and the progressive ones
+		are created on demand */
+	struct ProgramVariant
+	{
+		OCLProgram* program;
+		OCLKernel* kernel;
+		OCLKernel* kernel_AA;
+		OCLKernel* kernel_progressive;
+		OCLKernel* kernel_resolve;
+		// value of m_variantUses when it was last selected
+		unsigned int lastUse;
+	};
+
+	/* Delete the kernels and the program of a variant */
+	void ReleaseProgramVariant(ProgramVariant& variant);
+
+	/* the programs built on the selected device by their options, up to a few of the most recently used ones.
+		The current one is on m_program */
+	std::map<std::string, ProgramVariant> m_programVariants;
+	unsigned int m_variantUses;
+	// options given by PrepareRaytracer and the ones of the current program, which may include the specialization
+	std::string m_programOptions;
+	std::string m_variantOptions;
+	bool m_specializedKernels;
+
+	// size of the tiles of pixels of each work-group, and the best ones found by TuneTileSize by device name
+	int m_tileWidth;
+	int m_tileHeight;
+	std::map<std::string, std::pair<int, int> > m_tunedTileSizes;
+
 	OCLMemoryObject<cl_uchar4>* m_frame;
 	OCLMemoryObject<cl_uchar4>* m_frame_AA;
 
+	/* sum of the samples of each pixel traced by the progressive rendering, only used by the device */
+	OCLMemoryObject<cl_float4>* m_accumulation;
+	// samples on the accumulation buffer, including the ones not done yet
+	int m_sampleCount;
+	// read of the frame sent to the device, NULL once it's done
+	cl_event m_frameEvent;
+	// if the callback of the frame of RenderAsync didn't return yet, FinishFrame waits for it
+	bool m_callbackPending;
+	std::mutex m_callbackMutex;
+	std::condition_variable m_callbackDone;
+	// if the frame on the device comes from RenderAsync, and when it started
+	bool m_renderPending;
+	std::chrono::high_resolution_clock::time_point m_renderStart;
+	// set by PrepareFrame when something changed since the last frame
+	bool m_frameChanged;
+
+	bool m_profiling;
+	FrameTiming m_frameTiming;
+	// amount of commands profiled for the frame on the device
+	int m_frameProfiledCommands;
+
+	/* buffers of a frame of an animation sequence, event is the read of the frame, NULL when it's not queued */
+	struct SequenceSlot
+	{
+		OCLMemoryObject<cl_uchar4>* frame;
+		OCLMemoryObject<SceneInformation>* sceneInfo;
+		OCLMemoryObject<Camera>* camera;
+		OCLMemoryObject<Light>* light;
+		cl_event event;
+		int profiledCommands;
+	};
+	std::vector<SequenceSlot> m_sequenceSlots;
+	// slot of the oldest frame queued, amount of frames queued and finished, and when the sequence started
+	int m_sequenceFirst;
+	int m_sequenceQueued;
+	int m_sequenceFrames;
+	// commands profiled for the frames queued on the sequence
+	int m_sequenceProfiledCommands;
+	std::chrono::high_resolution_clock::time_point m_sequenceStart;
+
+	/* buffers rewritten on every render, they are created on the first render and kept until the device is released */
+	OCLMemoryObject<SceneInformation>* m_sceneInfoMem;
+	OCLMemoryObject<Camera>* m_cameraMem;
+	OCLMemoryObject<Light>* m_lightMem;
+	// partial sums of the efficiency counters, one for each work-group of the frame
+	OCLMemoryObject<EfficiencyCounters>* m_countersMem;
+	OCLMemoryObject<cl_int>* m_widthMem; // arguments of the anti-aliasing kernel
+	OCLMemoryObject<cl_int>* m_heightMem;
+
 	// bool to control if kernel is compiled with efficiency metrics
 	bool m_efficiencyInfo;
+	// sum of the efficiency counters of the last frame or sequence finished
+	EfficiencyCounters m_efficiencyCounters;
+
+	// if the Raytrace kernel writes the traversal cost of each pixel, and where
+	bool m_traversalCost;
+	OCLMemoryObject<cl_uint2>* m_traversalCostMem;
+
+	// transfers between host and device on the last frame
+	size_t m_frameBytesToDevice;
+	size_t m_frameBytesToHost;
 };
 
 
@@ -0,0 +1,498 @@
+/*
+	RenderGirl - OpenCL raytracer renderer
+	Copyright (c) 2016, Henrique Jung, All rights reserved.
+
+	This library is free software; you can redistribute it and/or
+	modify it under the terms of the GNU Lesser General Public
+	License as published by the Free Software Foundation; either
+	version 3.0 of the License, or any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+	Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public
+	License along with this library.
+*/
+
+#include "SceneGenerator.h"
+#include "SceneManager.h"
+#include "Trace.h"
+#include <vector>
+#include <cmath>
+#include <string.h>
+#include <algorithm>
+
+static const float s_pi = 3.14159265359f;
+
+/* the most faces of a generated group, bigger scenes are split on several groups so their BVHs
+	are built in parallel and no single build holds the whole scene */
+static const int s_maxGroupFaces = 1 << 20;
+
+/* in the order of StressScene */
+static const char* s_stressSceneNames[StressSceneCount] = { "spheres", "plane", "box", "slivers", "layers" };
+
+const char* GetStressSceneName(const StressScene scene)
+{
+	if (scene < 0 || scene >= StressSceneCount)
+		return "unknown";
+	return s_stressSceneNames[scene];
+}
+
+bool FindStressScene(const std::string &name, StressScene &scene)
+{
+	for (int s = 0; s < StressSceneCount; s++)
+	{
+		if (name == s_stressSceneNames[s])
+		{
+			scene = (StressScene)s;
+			return true;
+		}
+	}
+	return false;
+}
+
+/* xorshift with a fixed seed, rand() isn't the same on every platform and a scene must be */
+class SceneRandom
+{
+public:
+	SceneRandom(const unsigned int seed) : m_state(seed) {}
+
+	/* a number on [min, max) */
+	float Range(const float min, const float max)
+	{
+		m_state ^= m_state << 13;
+		m_state ^= m_state >> 17;
+		m_state ^= m_state << 5;
+		return min + (max - min) * ((m_state >> 8) / 16777216.0f);
+	}
+
+private:
+	unsigned int m_state;
+};
+
+/* Collects the faces of a generated scene, creating a new group every time the current one is full */
+class GroupBuilder
+{
+public:
+	GroupBuilder(const std::string &name, const Material &material)
+		: m_name(name), m_material(material), m_groupCount(0), m_faceCount(0) {}
+
+	/* Start an object with the amount of faces given, return the index its vertices start at.
+		The faces of an object are never split between groups */
+	int BeginObject(const int faces)
+	{
+		if (!m_faces.empty() && (int)m_faces.size() + faces > s_maxGroupFaces)
+			this->Flush();
+		return (int)m_vertices.size();
+	}
+
+	void AddVertex(const float x, const float y, const float z)
+	{
+		cl_float3 vertex = { { x, y, z } };
+		m_vertices.push_back(vertex);
+	}
+
+	void AddFace(const int a, const int b, const int c)
+	{
+		cl_int3 face = { { a, b, c } };
+		m_faces.push_back(face);
+	}
+
+	/* Create a group with the faces collected so far, NULL if there's none */
+	SceneGroup* Flush()
+	{
+		if (m_faces.empty())
+			return NULL;
+
+		SceneManager& manager = SceneManager::GetSharedManager();
+		SceneGroup* group = manager.CreateSceneGroup(m_name + " " + std::to_string(m_groupCount));
+		group->SetVertices(m_vertices.data(), (int)m_vertices.size());
+		group->SetFaces(m_faces.data(), (int)m_faces.size());
+		group->SetMaterial(m_material);
+
+		m_groupCount++;
+		m_faceCount += m_faces.size();
+		// keep the memory for the next group
+		m_vertices.clear();
+		m_faces.clear();
+		return group;
+	}
+
+	inline int GetGroupCount() const
+	{
+		return m_groupCount;
+	}
+
+	inline long long GetFaceCount() const
+	{
+		return m_faceCount;
+	}
+
+private:
+	std::string m_name;
+	Material m_material;
+	std::vector<cl_float3> m_vertices;
+	std::vector<cl_int3> m_faces;
+	int m_groupCount;
+	long long m_faceCount;
+};
+
+static Material MakeMaterial(const float r, const float g, const float b)
+{
+	Material material = s_defaultMaterial;
+	material.diffuseColor.s[0] = r;
+	material.diffuseColor.s[1] = g;
+	material.diffuseColor.s[2] = b;
+	return material;
+}
+
+/* faces of a sphere added by AddSphere */
+static int SphereFaces(const int segments)
+{
+	return 2 * segments * (segments - 1);
+}
+
+/* UV sphere, without the degenerated faces around the poles. The faces of all the shapes are wound so their
+	normal faces where they are seen from, the kernel only lights that side */
+static void AddSphere(GroupBuilder &builder, const float x, const float y, const float z, const float radius, const int segments)
+{
+	int base = builder.BeginObject(SphereFaces(segments));
+	for (int i = 0; i <= segments; i++)
+	{
+		float theta = s_pi * i / segments;
+		for (int j = 0; j <= segments; j++)
+		{
+			float phi = 2.0f * s_pi * j / segments;
+			builder.AddVertex(x + radius * sinf(theta) * cosf(phi), y + radius * cosf(theta), z + radius * sinf(theta) * sinf(phi));
+		}
+	}
+
+	for (int i = 0; i < segments; i++)
+	{
+		for (int j = 0; j < segments; j++)
+		{
+			int a = base + i * (segments + 1) + j;
+			int b = a + segments + 1;
+			if (i != 0)
+				builder.AddFace(a, a + 1, b);
+			if (i != segments - 1)
+				builder.AddFace(a + 1, b + 1, b);
+		}
+	}
+}
+
+/* Open cylinder standing on (x, y, z), split into rings along its height */
+static void AddColumn(GroupBuilder &builder, const float x, const float y, const float z, const float radius, const float height,
+	const int segments, const int rings)
+{
+	int base = builder.BeginObject(2 * segments * rings);
+	for (int i = 0; i <= rings; i++)
+	{
+		for (int j = 0; j <= segments; j++)
+		{
+			float phi = 2.0f * s_pi * j / segments;
+			builder.AddVertex(x + radius * cosf(phi), y + height * i / rings, z + radius * sinf(phi));
+		}
+	}
+
+	for (int i = 0; i < rings; i++)
+	{
+		for (int j = 0; j < segments; j++)
+		{
+			int a = base + i * (segments + 1) + j;
+			int b = a + segments + 1;
+			builder.AddFace(a, b, a + 1);
+			builder.AddFace(a + 1, b, b + 1);
+		}
+	}
+}
+
+/* Parallelogram from origin along the edges u and v, subdivided nu by nv times. Its normal is v x u */
+static void AddSheet(GroupBuilder &builder, const cl_float3 &origin, const cl_float3 &u, const cl_float3 &v, const int nu, const int nv)
+{
+	int base = builder.BeginObject(2 * nu * nv);
+	for (int i = 0; i <= nv; i++)
+	{
+		for (int j = 0; j <= nu; j++)
+		{
+			float fu = (float)j / nu;
+			float fv = (float)i / nv;
+			builder.AddVertex(origin.s[0] + u.s[0] * fu + v.s[0] * fv, origin.s[1] + u.s[1] * fu + v.s[1] * fv,
+				origin.s[2] + u.s[2] * fu + v.s[2] * fv);
+		}
+	}
+
+	for (int i = 0; i < nv; i++)
+	{
+		for (int j = 0; j < nu; j++)
+		{
+			int a = base + i * (nu + 1) + j;
+			int b = a + nu + 1;
+			builder.AddFace(a, b, a + 1);
+			builder.AddFace(a + 1, b, b + 1);
+		}
+	}
+}
+
+static cl_float3 MakeVector(const float x, const float y, const float z)
+{
+	cl_float3 vector = { { x, y, z } };
+	return vector;
+}
+
+/* A camera at pos looking at lookAt, and a white light */
+static void SetView(Camera &camera, Light &light, const cl_float3 &pos, const cl_float3 &lookAt, const cl_float3 &lightPos)
+{
+	memset(&camera, 0, sizeof(Camera));
+	camera.pos = pos;
+	camera.lookAt = lookAt;
+	camera.up.s[1] = 1.0f;
+	camera.from_lookAt = true;
+
+	memset(&light, 0, sizeof(Light));
+	light.pos = lightPos;
+	light.color.s[0] = light.color.s[1] = light.color.s[2] = 1.0f;
+	light.Ks = 0.2f;
+	light.Ka = 0.0f;
+}
+
+/* One sphere placed size times by instances on a cube, with a little of random offset, rotation and scale.
+	The group is built once, only the object level BVH grows with the size */
+static long long GenerateInstancedSpheres(const int size, Camera &camera, Light &light, int &groupCount)
+{
+	SceneManager& manager = SceneManager::GetSharedManager();
+	SceneRandom random(0x9E3779B9);
+
+	GroupBuilder builder("Sphere", MakeMaterial(0.8f, 0.3f, 0.2f));
+	AddSphere(builder, 0.0f, 0.0f, 0.0f, 1.0f, 24);
+	SceneGroup* sphere = builder.Flush();
+	groupCount = builder.GetGroupCount();
+
+	int side = (int)std::ceil(std::pow((double)size, 1.0 / 3.0));
+	while ((long long)side * side * side < size)
+		side++;
+	const float spacing = 3.0f;
+	float start = -(side - 1) * spacing / 2.0f;
+
+	for (int i = 0; i < size; i++)
+	{
+		SceneInstance* instance = manager.CreateSceneInstance(sphere);
+		instance->SetPosition(MakeVector(start + (i % side) * spacing + random.Range(-0.5f, 0.5f),
+			start + ((i / side) % side) * spacing + random.Range(-0.5f, 0.5f),
+			start + (i / (side * side)) * spacing + random.Range(-0.5f, 0.5f)));
+		instance->SetRotation(MakeVector(random.Range(0.0f, 2.0f * s_pi), random.Range(0.0f, 2.0f * s_pi), 0.0f));
+		float scale = random.Range(0.5f, 1.0f);
+		instance->SetScale(MakeVector(scale, scale, scale));
+	}
+
+	float extent = side * spacing / 2.0f;
+	SetView(camera, light, MakeVector(extent * 1.2f, extent * 0.9f, -extent * 2.5f), MakeVector(0.0f, 0.0f, 0.0f),
+		MakeVector(extent * 2.0f, extent * 3.0f, -extent * 2.0f));
+	return builder.GetFaceCount() * size;
+}
+
+/* A 20x20 plane with gentle waves, each group a strip of its rows */
+static long long GenerateSubdividedPlane(const int size, Camera &camera, Light &light, int &groupCount)
+{
+	int cells = std::max(1, (int)std::ceil(std::sqrt(size / 2.0)));
+	int rowsPerStrip = std::max(1, s_maxGroupFaces / (2 * cells));
+	const float extent = 10.0f;
+	float step = 2.0f * extent / cells;
+
+	GroupBuilder builder("Plane", MakeMaterial(0.4f, 0.6f, 0.3f));
+	for (int row = 0; row < cells; row += rowsPerStrip)
+	{
+		int rows = std::min(rowsPerStrip, cells - row);
+		int base = builder.BeginObject(2 * cells * rows);
+		for (int i = 0; i <= rows; i++)
+		{
+			float z = -extent + (row + i) * step;
+			for (int j = 0; j <= cells; j++)
+			{
+				float x = -extent + j * step;
+				builder.AddVertex(x, 0.4f * sinf(x * 0.8f) * cosf(z * 0.6f), z);
+			}
+		}
+
+		for (int i = 0; i < rows; i++)
+		{
+			for (int j = 0; j < cells; j++)
+			{
+				int a = base + i * (cells + 1) + j;
+				int b = a + cells + 1;
+				builder.AddFace(a, b, a + 1);
+				builder.AddFace(a + 1, b, b + 1);
+			}
+		}
+	}
+	builder.Flush();
+	groupCount = builder.GetGroupCount();
+
+	SetView(camera, light, MakeVector(0.0f, 9.0f, -16.0f), MakeVector(0.0f, 0.0f, 0.0f), MakeVector(5.0f, 15.0f, -10.0f));
+	return builder.GetFaceCount();
+}
+
+/* An open roofed hall of 16x14x40 crowded with thin columns, each with a sheet hanging from its top.
+	The columns get thinner as they get more, so they never touch and the hall is never full */
+static long long GenerateThinObjectsBox(const int size, Camera &camera, Light &light, int &groupCount)
+{
+	SceneRandom random(0x2545F491);
+	const float halfWidth = 8.0f;
+	const float height = 14.0f;
+	const float halfLength = 20.0f;
+
+	GroupBuilder hall("Hall", MakeMaterial(0.7f, 0.65f, 0.55f));
+	AddSheet(hall, MakeVector(-halfWidth, 0.0f, -halfLength), MakeVector(2.0f * halfWidth, 0.0f, 0.0f), MakeVector(0.0f, 0.0f, 2.0f * halfLength), 8, 8);
+	AddSheet(hall, MakeVector(-halfWidth, 0.0f, -halfLength), MakeVector(0.0f, 0.0f, 2.0f * halfLength), MakeVector(0.0f, height, 0.0f), 8, 8);
+	AddSheet(hall, MakeVector(halfWidth, 0.0f, -halfLength), MakeVector(0.0f, height, 0.0f), MakeVector(0.0f, 0.0f, 2.0f * halfLength), 8, 8);
+	AddSheet(hall, MakeVector(-halfWidth, 0.0f, halfLength), MakeVector(2.0f * halfWidth, 0.0f, 0.0f), MakeVector(0.0f, height, 0.0f), 8, 8);
+	AddSheet(hall, MakeVector(-halfWidth, 0.0f, -halfLength), MakeVector(0.0f, height, 0.0f), MakeVector(2.0f * halfWidth, 0.0f, 0.0f), 8, 8);
+	hall.Flush();
+
+	const int columnSegments = 8;
+	const int columnRings = 16;
+	const int sheetColumns = 4;
+	const int sheetRows = 16;
+	int objectFaces = 2 * columnSegments * columnRings + 2 * sheetColumns * sheetRows;
+	int objects = std::max(1, (int)((size - hall.GetFaceCount()) / objectFaces));
+
+	/* a grid over the floor, keeping one unit away from the walls */
+	float floorWidth = 2.0f * halfWidth - 2.0f;
+	float floorLength = 2.0f * halfLength - 2.0f;
+	int gridColumns = std::max(1, (int)(std::sqrt(objects * floorWidth / floorLength) + 0.5f));
+	int gridRows = (objects + gridColumns - 1) / gridColumns;
+	float cellWidth = floorWidth / gridColumns;
+	float cellLength = floorLength / gridRows;
+	float cell = std::min(cellWidth, cellLength);
+	float radius = std::min(0.25f, cell * 0.2f);
+	float sheetWidth = std::min(1.5f, cell * 0.6f);
+
+	GroupBuilder columns("Column", MakeMaterial(0.75f, 0.75f, 0.7f));
+	GroupBuilder sheets("Sheet", MakeMaterial(0.7f, 0.1f, 0.1f));
+	for (int i = 0; i < objects; i++)
+	{
+		float x = -halfWidth + 1.0f + ((i % gridColumns) + 0.5f + random.Range(-0.2f, 0.2f)) * cellWidth;
+		float z = -halfLength + 1.0f + ((i / gridColumns) + 0.5f + random.Range(-0.2f, 0.2f)) * cellLength;
+		float top = random.Range(6.0f, 13.0f);
+		AddColumn(columns, x, 0.0f, z, radius, top, columnSegments, columnRings);
+
+		/* the sheet hangs from the side of the column, on a random direction */
+		float angle = random.Range(0.0f, 2.0f * s_pi);
+		float dx = cosf(angle);
+		float dz = sinf(angle);
+		AddSheet(sheets, MakeVector(x - dz * radius * 1.5f, top, z + dx * radius * 1.5f), MakeVector(dx * sheetWidth, 0.0f, dz * sheetWidth),
+			MakeVector(0.0f, -top * 0.4f, 0.0f), sheetColumns, sheetRows);
+	}
+	columns.Flush();
+	sheets.Flush();
+	groupCount = hall.GetGroupCount() + columns.GetGroupCount() + sheets.GetGroupCount();
+
+	SetView(camera, light, MakeVector(0.0f, 4.0f, -19.0f), MakeVector(0.0f, 6.0f, halfLength), MakeVector(2.0f, 30.0f, -5.0f));
+	return hall.GetFaceCount() + columns.GetFaceCount() + sheets.GetFaceCount();
+}
+
+/* Long thin triangles of 10 units crossing a unit around the center on random directions, every AABB
+	overlaps all the others so no split of the BVH separates them */
+static long long GenerateOverlappingSlivers(const int size, Camera &camera, Light &light, int &groupCount)
+{
+	SceneRandom random(0x1B873593);
+	GroupBuilder builder("Sliver", MakeMaterial(0.2f, 0.4f, 0.8f));
+
+	for (int i = 0; i < size; i++)
+	{
+		float dx, dy, dz, length;
+		do
+		{
+			dx = random.Range(-1.0f, 1.0f);
+			dy = random.Range(-1.0f, 1.0f);
+			dz = random.Range(-1.0f, 1.0f);
+			length = std::sqrt(dx * dx + dy * dy + dz * dz);
+		} while (length < 0.1f || length > 1.0f);
+		dx *= 5.0f / length;
+		dy *= 5.0f / length;
+		dz *= 5.0f / length;
+
+		float cx = random.Range(-0.5f, 0.5f);
+		float cy = random.Range(-0.5f, 0.5f);
+		float cz = random.Range(-0.5f, 0.5f);
+		int base = builder.BeginObject(1);
+		builder.AddVertex(cx - dx, cy - dy, cz - dz);
+		builder.AddVertex(cx + dx, cy + dy, cz + dz);
+		builder.AddVertex(cx + dx + random.Range(-0.05f, 0.05f), cy + dy + random.Range(-0.05f, 0.05f), cz + dz + random.Range(-0.05f, 0.05f));
+		builder.AddFace(base, base + 1, base + 2);
+	}
+	builder.Flush();
+	groupCount = builder.GetGroupCount();
+
+	SetView(camera, light, MakeVector(0.0f, 2.0f, -14.0f), MakeVector(0.0f, 0.0f, 0.0f), MakeVector(3.0f, 8.0f, -10.0f));
+	return builder.GetFaceCount();
+}
+
+/* Squares of 8x8 facing the camera, stacked at depths only 1e-5 apart and slightly displaced, so the AABBs
+	are all almost the same and every ray tests the whole stack */
+static long long GenerateCoincidentLayers(const int size, Camera &camera, Light &light, int &groupCount)
+{
+	SceneRandom random(0x85EBCA6B);
+	GroupBuilder builder("Layer", MakeMaterial(0.6f, 0.6f, 0.2f));
+
+	int layers = std::max(1, (size + 1) / 2);
+	for (int i = 0; i < layers; i++)
+	{
+		float z = i * 1e-5f;
+		int base = builder.BeginObject(2);
+		for (int c = 0; c < 4; c++)
+		{
+			float x = (c & 1) ? 4.0f : -4.0f;
+			float y = (c & 2) ? 4.0f : -4.0f;
+			builder.AddVertex(x + random.Range(-0.01f, 0.01f), y + random.Range(-0.01f, 0.01f), z);
+		}
+		builder.AddFace(base, base + 2, base + 1);
+		builder.AddFace(base + 1, base + 2, base + 3);
+	}
+	builder.Flush();
+	groupCount = builder.GetGroupCount();
+
+	SetView(camera, light, MakeVector(2.0f, 1.5f, -12.0f), MakeVector(0.0f, 0.0f, 0.0f), MakeVector(3.0f, 5.0f, -10.0f));
+	return builder.GetFaceCount();
+}
+
+bool GenerateStressScene(const StressScene scene, const int size, Camera &camera, Light &light)
+{
+	TraceSpan span("Generate scene", "scene");
+	if (size < 1)
+	{
+		Log::Error("The size of a generated scene must be at least 1");
+		return false;
+	}
+
+	long long faces = 0;
+	int groupCount = 0;
+	switch (scene)
+	{
+	case InstancedSpheres:
+		faces = GenerateInstancedSpheres(size, camera, light, groupCount);
+		break;
+	case SubdividedPlane:
+		faces = GenerateSubdividedPlane(size, camera, light, groupCount);
+		break;
+	case ThinObjectsBox:
+		faces = GenerateThinObjectsBox(size, camera, light, groupCount);
+		break;
+	case OverlappingSlivers:
+		faces = GenerateOverlappingSlivers(size, camera, light, groupCount);
+		break;
+	case CoincidentLayers:
+		faces = GenerateCoincidentLayers(size, camera, light, groupCount);
+		break;
+	default:
+		Log::Error("Unknown generated scene");
+		return false;
+	}
+
+	SceneManager::GetSharedManager().SetOutadatedGeometry();
+	Log::Message("Generated the scene " + std::string(GetStressSceneName(scene)) + " of size " + std::to_string(size) + ": " +
+		std::to_string(faces) + " faces on " + std::to_string(groupCount) + " groups");
+	return true;
+}
@@ -0,0 +1,53 @@
+/*
+	RenderGirl - OpenCL raytracer renderer
+	Copyright (c) 2016, Henrique Jung, All rights reserved.
+
+	This library is free software; you can redistribute it and/or
+	modify it under the terms of the GNU Lesser General Public
+	License as published by the Free Software Foundation; either
+	version 3.0 of the License, or any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+	Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public
+	License along with this library.
+*/
+
+#ifndef __SCENEGENERATOR__
+#define __SCENEGENERATOR__
+
+#include <string>
+#include "CLStructs.h"
+
+/* Procedural scenes made to stress the renderer at scale, without loading any file. The size of each scene
+	is given as a parameter, and the same size always generates the same scene */
+enum StressScene
+{
+	/* size instances of a single sphere of about 1000 faces on a 3D grid */
+	InstancedSpheres,
+	/* a wavy plane subdivided into size faces */
+	SubdividedPlane,
+	/* an open box like the atrium of Sponza, filled with thin columns and hanging sheets up to size faces */
+	ThinObjectsBox,
+	/* size long slivers crossing the center of the scene, the boxes of all of them overlap */
+	OverlappingSlivers,
+	/* size faces stacked at almost the same depth, the boxes of all of them are the same */
+	CoincidentLayers,
+	StressSceneCount
+};
+
+/* Return the short name of a stress scene, such as "spheres" */
+const char* GetStressSceneName(const StressScene scene);
+
+/* Find the stress scene of a short name, return FALSE if there's none */
+bool FindStressScene(const std::string &name, StressScene &scene);
+
+/* Add a stress scene to the scene of the SceneManager, its faces split into groups of a bounded size.
+	camera and light are set to a view of the whole scene that depends only on the scene and its size.
+	Return FALSE for an error */
+bool GenerateStressScene(const StressScene scene, const int size, Camera &camera, Light &light);
+
+#endif // __SCENEGENERATOR__
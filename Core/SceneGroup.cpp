@@ -19,12 +19,34 @@
 
 #include "SceneGroup.h"
 #include "SceneManager.h"
+#include "BVH.h"
+#include "Trace.h"
 
 #include "glm/glm/mat4x4.hpp"
 #include "glm/glm/gtc/matrix_transform.hpp"
 #include "glm/glm/gtx/transform.hpp"
 #include "glm/glm/gtx/quaternion.hpp"
 
+/* maximum amount of faces stored on each leaf of the triangle level BVH */
+static const int s_maxFacesPerLeaf = 4;
+
+glm::mat4x4 BuildTransformation(const cl_float3& pos, const cl_float3& rotation, const cl_float3& scale)
+{
+	glm::mat4x4 scale_matrix = glm::scale(glm::vec3(scale.s[0], scale.s[1], scale.s[2]));
+	// rotation using quaternions
+	glm::quat rot(glm::vec3(rotation.s[0], rotation.s[1], rotation.s[2]));
+	glm::mat4x4 translation = glm::translate(glm::vec3(pos.s[0], pos.s[1], pos.s[2]));
+
+	return translation * glm::mat4x4(rot) * scale_matrix;
+}
+
+static cl_float3 TransformVertex(const glm::mat4x4& transform, const cl_float3& vertex)
+{
+	glm::vec4 transformed = transform * glm::vec4(vertex.s[0], vertex.s[1], vertex.s[2], 1.0f /* identity */);
+	cl_float3 result = { { transformed.x, transformed.y, transformed.z } };
+	return result;
+}
+
 SceneGroup::SceneGroup(const std::string& name)
 {
 	m_material = s_defaultMaterial;
@@ -36,22 +58,35 @@ SceneGroup::SceneGroup(const std::string& name)
 	m_rotation = { { 0.0f, 0.0f, 0.0f } };
 
 	m_local_vertices = true;
-	m_aabb == nullptr;
+	m_outdated_transform = false;
+	m_outdated_geometry = false;
+	m_outdated_faces = false;
+	m_outdated_material = true;
+	m_aabb = nullptr;
+	m_bvh = nullptr;
 }
 
 SceneGroup::~SceneGroup()
+{
+	this->ClearBoundingVolumes();
+}
+
+void SceneGroup::ClearBoundingVolumes()
 {
 	if (m_aabb)
 		delete m_aabb;
+	if (m_bvh)
+		delete m_bvh;
+
+	m_aabb = nullptr;
+	m_bvh = nullptr;
 }
 
 void SceneGroup::SetFaces(const cl_int3* faces, const int size)
 {
-	SceneManager& manager = SceneManager::GetSharedManager();
-	manager.SetOutadatedGeometry();
-
 	m_faces.assign(faces, faces + size);
-	m_local_vertices = true;
+	m_outdated_faces = true;
+	this->SetOutdatedGeometry();
 }
 
 
@@ -61,29 +96,78 @@ void SceneGroup::AddFace(const cl_int3& face)
 	manager.SetOutadatedGeometry();
 
 	m_faces.push_back(face);
+	this->ClearBoundingVolumes();
 }
 
 void SceneGroup::AddVertex(const cl_float3& vertex)
 {
-	assert(m_local_vertices == true && "You can't add new vertices to a geometry in global space");
 	SceneManager& manager = SceneManager::GetSharedManager();
 	manager.SetOutadatedGeometry();
 
-	m_vertices.push_back(vertex);
-	if (m_aabb)
-		delete m_aabb;
+	if (m_local_vertices)
+		m_vertices.push_back(vertex);
+	else
+	{
+		/* both arrays grow together, later transformations go through m_original_vertices */
+		m_original_vertices.push_back(vertex);
+		m_vertices.push_back(TransformVertex(BuildTransformation(m_pos, m_rotation, m_scale), vertex));
+	}
+	this->ClearBoundingVolumes();
 }
 
 
 void SceneGroup::SetVertices(const cl_float3* vertices, const int size)
 {
-	SceneManager& manager = SceneManager::GetSharedManager();
-	manager.SetOutadatedGeometry();
-
 	m_vertices.assign(vertices, vertices + size);
 	m_local_vertices = true;
-	if (m_aabb)
-		delete m_aabb;
+	this->SetOutdatedGeometry();
+}
+
+void SceneGroup::SetOutdatedGeometry()
+{
+	m_outdated_geometry = true;
+	this->ClearBoundingVolumes();
+
+	SceneManager& manager = SceneManager::GetSharedManager();
+	manager.SetOutdatedGroupsGeometry();
+}
+
+void SceneGroup::SetMaterial(const Material &material)
+{
+	m_material = material;
+	m_outdated_material = true;
+
+	SceneManager& manager = SceneManager::GetSharedManager();
+	manager.SetOutdatedMaterials();
+}
+
+void SceneGroup::SetPosition(const cl_float3& pos)
+{
+	m_pos = pos;
+	this->SetOutdatedTransform();
+}
+
+void SceneGroup::SetRotation(const cl_float3& rot)
+{
+	m_rotation = rot;
+	this->SetOutdatedTransform();
+}
+
+void SceneGroup::SetScale(const cl_float3& scale)
+{
+	m_scale = scale;
+	this->SetOutdatedTransform();
+}
+
+void SceneGroup::SetOutdatedTransform()
+{
+	/* while in local space the transformations will be applied on the next scene build anyway */
+	if (m_local_vertices)
+		return;
+
+	m_outdated_transform = true;
+	SceneManager& manager = SceneManager::GetSharedManager();
+	manager.SetOutdatedTransformations();
 }
 
 AABB SceneGroup::GetAABB()
@@ -97,6 +181,44 @@ AABB SceneGroup::GetAABB()
 	return *m_aabb;
 }
 
+const BVH* SceneGroup::GetBVH()
+{
+	if (m_bvh) { return m_bvh; }
+
+	assert(!m_faces.empty() && "SceneGroup must have a geometry loaded");
+	TraceSpan span("BVH build", "bvh");
+
+	/* each face is a primitive of the BVH */
+	int facesAmount = m_faces.size();
+	std::vector<AABB> primitives;
+	std::vector<int> primitives_index;
+	primitives.reserve(facesAmount);
+	primitives_index.reserve(facesAmount);
+	for (int i = 0; i < facesAmount; i++)
+	{
+		primitives.push_back(AABB(m_vertices[m_faces[i].s[0]],
+			m_vertices[m_faces[i].s[1]],
+			m_vertices[m_faces[i].s[2]]));
+		primitives_index.push_back(i);
+	}
+
+	SceneManager& manager = SceneManager::GetSharedManager();
+	m_bvh = new BVH();
+	m_bvh->Create(primitives, primitives_index, 0, facesAmount, s_maxFacesPerLeaf, manager.GetBVHBuildMethod());
+
+	/* leaves of the BVH point to contiguous ranges of primitives_index,
+	 * so the faces are reordered to follow it */
+	std::vector<cl_int3> sortedFaces;
+	sortedFaces.reserve(facesAmount);
+	for (int i = 0; i < facesAmount; i++)
+	{
+		sortedFaces.push_back(m_faces[primitives_index[i]]);
+	}
+	m_faces.swap(sortedFaces);
+
+	return m_bvh;
+}
+
 bool SceneGroup::CheckCorruptedFaces()
 {
 	int facesAmount = m_faces.size();
@@ -117,6 +239,7 @@ bool SceneGroup::CheckCorruptedFaces()
 void SceneGroup::TransformLocalToGlobalVertices()
 {
 	assert(m_local_vertices == true && "Vertices already in global space");
+	TraceSpan span("TransformLocalToGlobalVertices", "scene");
 
 	/****************************************************************************************
 	* Apply all transformations vertex buffer, this will convert all local
@@ -125,30 +248,41 @@ void SceneGroup::TransformLocalToGlobalVertices()
 	* This code can reduce a lot when there's native support for OpenCL types on GLM
 	******************************************************************************************/
 
-	/* build transformation matrix to apply to vertex data, starting with scaling */
-	glm::mat4x4 scale = glm::scale(glm::vec3(m_scale.s[0], m_scale.s[1], m_scale.s[2]));
-	// rotation using quaternions
-	glm::quat rot(glm::vec3(m_rotation.s[0], m_rotation.s[1], m_rotation.s[2]));
-	// translation
-	glm::mat4x4 translation = glm::translate(glm::vec3(m_pos.s[0], m_pos.s[1], m_pos.s[2]));
+	/* local vertices are kept, they are the source of any later transformation */
+	m_original_vertices = m_vertices;
+	this->ApplyTransformations();
 
-	// build transformation matrix
-	glm::mat4x4 transform = translation * glm::mat4x4(rot) * scale;
+	m_local_vertices = false;
+	m_outdated_transform = false;
+	this->ClearBoundingVolumes();
+}
 
-	/* apply object transformations on vertex data */
-	for (int i = 0; i < m_vertices.size(); i++)
-	{
-		/* vertex to be transformed */
-		glm::vec4 temp(m_vertices[i].s[0],
-				m_vertices[i].s[1],
-				m_vertices[i].s[2],
-				1.0f /* identity */);
-
-		glm::vec4 translated_vertex = transform * temp;
-		m_vertices[i] = { { translated_vertex.x, translated_vertex.y, translated_vertex.z } };
-	}
+void SceneGroup::UpdateGlobalVertices()
+{
+	assert(m_local_vertices == false && "Vertices are still in local space");
 
-	m_local_vertices = false;
-	if (m_aabb)
-		delete m_aabb;
+	this->ApplyTransformations();
+
+	m_outdated_transform = false;
+	/* the cached BVH no longer fits the vertices, the refitted one lives only on the traversal array */
+	this->ClearBoundingVolumes();
+}
+
+void SceneGroup::RevertToLocalVertices()
+{
+	assert(m_local_vertices == false && "Vertices already in local space");
+
+	m_vertices = m_original_vertices;
+	m_local_vertices = true;
+	m_outdated_transform = false;
+	this->ClearBoundingVolumes();
+}
+
+void SceneGroup::ApplyTransformations()
+{
+	glm::mat4x4 transform = BuildTransformation(m_pos, m_rotation, m_scale);
+
+	/* apply object transformations on vertex data */
+	for (int i = 0; i < m_original_vertices.size(); i++)
+		m_vertices[i] = TransformVertex(transform, m_original_vertices[i]);
 }
@@ -25,10 +25,13 @@
 #include "CL\cl.h"
 #include "Log.h"
 #include "AABB.h"
+#include "glm\glm\mat4x4.hpp"
 #include <string.h>
 #include <string>
 #include <vector>
 
+class BVH;
+
 /* SceneGroup class handles a given portion of geometry (an object, for instance) and
 	can share vertices between faces. Each group can be assotiated with a material */
 class SceneGroup
@@ -38,19 +41,22 @@ public:
 	/* Set faces on this object. Size is the amount of faces.
 		Each face is described as an three int values acting as indexes in the
 		vertices array. Data will be copied, so you are free to use the memory afterwards.
-		Peivous loaded data will be deleted. */
+		Peivous loaded data will be deleted. New faces need a new BVH for this group, so replacing them 
+		on a group already on the device builds the scene again. */
 	void SetFaces(const cl_int3* faces, const int size);
 
 	/* add a face to this group. Must be a combination of three integer pointing to somewhere in the vertex array */
 	void AddFace(const cl_int3& face);
 
-	/* add a vertex do this group. */
+	/* add a vertex do this group, in local space. On a group already transformed to global space
+		the vertex is transformed too. */
 	void AddVertex(const cl_float3& vertex);
 
 	/* Set vertices on this object. Size is the amount of vertices.
 	Each vertice is described as an three floating point values that should be referenced in the faces array.
 	Data will be copied, so you are free to use the memory afterwards.
-	Peivous loaded data will be deleted. */
+	Peivous loaded data will be deleted. Replacing the vertices of a group already on the device with the same
+	amount of vertices updates only this group, instead of building the whole scene again. */
 	void SetVertices(const cl_float3* vertices, const int size);
 
 	/* 
@@ -59,11 +65,19 @@ public:
 	*/
 	AABB GetAABB();
 
-	/* Set position on this scene group. It will be applied to all geometry prior rendering. */
-	inline void SetPosition(const cl_float3& pos)
-	{
-		m_pos = pos;
-	}
+	/*
+		Get the triangle level BVH of this object. It will be generated on the first call
+		and cached for the following calls. Building the BVH reorders the faces of this group,
+		so the faces of each leaf are contiguous. The vertices should be in global space
+		by the time this is called, since the BVH is not updated by TransformLocalToGlobalVertices.
+		Groups with instances are the exception, their BVH is built in object space.
+	*/
+	const BVH* GetBVH();
+
+	/* Set position on this scene group. It will be applied to all geometry prior rendering.
+		Transformations changed after the geometry is on the device don't rebuild the scene,
+		the vertices are transformed again and the BVH is refitted instead */
+	void SetPosition(const cl_float3& pos);
 
 	/* Get position of this SceneGroup */
 	inline cl_float3 GetPosision()const
@@ -72,10 +86,7 @@ public:
 	}
 
 	/* Set rotation of this scene group in radians. It will be applied to all geometry prior rendering. */
-	inline void SetRotation(const cl_float3& rot)
-	{
-		m_rotation = rot;
-	}
+	void SetRotation(const cl_float3& rot);
 
 	/* Get rotation of this SceneGroup */
 	inline cl_float3 GetRotation()const
@@ -84,10 +95,7 @@ public:
 	}
 
 	/* Set scale on a 0-1 scale on this scene group. It will be applied to all geometry prior rendering. */
-	inline void SetScale(const cl_float3& scale)
-	{
-		m_scale = scale;
-	}
+	void SetScale(const cl_float3& scale);
 
 	/* Get scale of this SceneGroup */
 	inline cl_float3 GetScale()const
@@ -100,11 +108,8 @@ public:
 		return m_name;
 	}
 
-	/* set material on this group */
-	inline void SetMaterial(const Material &material)
-	{
-		m_material = material;
-	}
+	/* set material on this group, only the materials that changed are uploaded on the next rendering */
+	void SetMaterial(const Material &material);
 
 	/* get material associated with this group */
 	inline Material GetMaterial()
@@ -130,6 +135,10 @@ public:
 	/* Apply the scale, position and transform operations on the geometry of this SceneGroup. */
 	void TransformLocalToGlobalVertices();
 
+	/* Apply the scale, position and transform operations again on geometry already in global space, 
+		used when only the transformations changed. The faces are kept untouched. */
+	void UpdateGlobalVertices();
+
 	/* Return true if the vertices are in local space.*/
 	inline bool AreVerticesInLocalSpace()
 	{
@@ -165,9 +174,47 @@ private:
 		In other words, if the vertices are in local space or global space. */
 	bool m_local_vertices;
 
+	/* copy of the vertices in local space, kept once they are converted to global space,
+		so the transformations can be applied again without rebuilding the scene */
+	std::vector<cl_float3> m_original_vertices;
+
+	/* tells if the transformations changed after the vertices were converted to global space */
+	bool m_outdated_transform;
+
+	/* tells if the vertices or the faces were replaced after the scene was built */
+	bool m_outdated_geometry;
+
+	/* tells if the faces were replaced after the scene was built, the BVH of the group must be built again */
+	bool m_outdated_faces;
+
+	/* tells if the material changed after it was uploaded */
+	bool m_outdated_material;
+
+	/* called by the transformation setters */
+	void SetOutdatedTransform();
+
+	/* called by SetFaces and SetVertices */
+	void SetOutdatedGeometry();
+
+	/* transform m_original_vertices into m_vertices */
+	void ApplyTransformations();
+
+	/* bring back the vertices to local space, used when a group gets instances */
+	void RevertToLocalVertices();
+
 	/* The AABB of this object which all vertices lie, generated on demand only */
 	AABB* m_aabb;
+
+	/* The BVH partitioning the faces of this object, generated on demand only */
+	BVH* m_bvh;
+
+	/* delete the AABB and the BVH, called when the geometry changes */
+	void ClearBoundingVolumes();
 };
 
+/* build the local to global matrix of a transformation: scale, then rotation, then translation.
+	Shared by the groups and their instances, so both place the same geometry at the same spot */
+glm::mat4x4 BuildTransformation(const cl_float3& pos, const cl_float3& rotation, const cl_float3& scale);
+
 
 #endif //__SCENEGROUPCLASS__
\ No newline at end of file
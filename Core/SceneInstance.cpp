@@ -0,0 +1,101 @@
+/*
+	RenderGirl - OpenCL raytracer renderer
+	Copyright (c) 2016, Henrique Jung, All rights reserved.
+
+	This library is free software; you can redistribute it and/or
+	modify it under the terms of the GNU Lesser General Public
+	License as published by the Free Software Foundation; either
+	version 3.0 of the License, or any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+	Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public
+	License along with this library.
+*/
+
+#include "SceneInstance.h"
+#include "SceneGroup.h"
+#include "SceneManager.h"
+
+#include "glm/glm/mat4x4.hpp"
+#include "glm/glm/gtc/matrix_transform.hpp"
+#include "glm/glm/gtx/transform.hpp"
+#include "glm/glm/gtx/quaternion.hpp"
+
+SceneInstance::SceneInstance(SceneGroup* group)
+{
+	assert(group != nullptr && "An instance must point to a group");
+
+	m_group = group;
+
+	/* Default transformation matrix */
+	m_pos = { { 0.0f, 0.0f, 0.0f } };
+	m_scale = { { 1.0f, 1.0f, 1.0f } };
+	m_rotation = { { 0.0f, 0.0f, 0.0f } };
+
+	m_outdated_transform = false;
+}
+
+SceneInstance::~SceneInstance()
+{
+}
+
+void SceneInstance::SetPosition(const cl_float3& pos)
+{
+	m_pos = pos;
+	m_outdated_transform = true;
+	SceneManager::GetSharedManager().SetOutdatedTransformations();
+}
+
+void SceneInstance::SetRotation(const cl_float3& rot)
+{
+	m_rotation = rot;
+	m_outdated_transform = true;
+	SceneManager::GetSharedManager().SetOutdatedTransformations();
+}
+
+void SceneInstance::SetScale(const cl_float3& scale)
+{
+	m_scale = scale;
+	m_outdated_transform = true;
+	SceneManager::GetSharedManager().SetOutdatedTransformations();
+}
+
+void SceneInstance::FillInstanceStruct(InstanceStruct& instance)const
+{
+	glm::mat4x4 world_to_object = glm::inverse(BuildTransformation(m_pos, m_rotation, m_scale));
+
+	/* glm matrices are column major, the device wants the rows */
+	for (int row = 0; row < 3; row++)
+	{
+		instance.world_to_object[row] = { { world_to_object[0][row], world_to_object[1][row],
+			world_to_object[2][row], world_to_object[3][row] } };
+	}
+}
+
+AABB SceneInstance::ComputeAABB()const
+{
+	glm::mat4x4 object_to_world = BuildTransformation(m_pos, m_rotation, m_scale);
+	AABB local_aabb = m_group->GetAABB();
+	cl_float3 point_min = local_aabb.GetMinPoint();
+	cl_float3 point_max = local_aabb.GetMaxPoint();
+
+	/* the corners of the AABB in object space are transformed to world space */
+	std::vector<cl_float3> corners;
+	corners.reserve(8);
+	for (int i = 0; i < 8; i++)
+	{
+		glm::vec4 corner(i & 1 ? point_max.s[0] : point_min.s[0],
+			i & 2 ? point_max.s[1] : point_min.s[1],
+			i & 4 ? point_max.s[2] : point_min.s[2],
+			1.0f);
+
+		glm::vec4 transformed = object_to_world * corner;
+		corners.push_back({ { transformed.x, transformed.y, transformed.z } });
+	}
+
+	return AABB(corners);
+}
@@ -0,0 +1,101 @@
+/*
+	RenderGirl - OpenCL raytracer renderer
+	Copyright (c) 2016, Henrique Jung, All rights reserved.
+
+	This library is free software; you can redistribute it and/or
+	modify it under the terms of the GNU Lesser General Public
+	License as published by the Free Software Foundation; either
+	version 3.0 of the License, or any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+	Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public
+	License along with this library.
+*/
+
+#ifndef __SCENEINSTANCECLASS__
+#define __SCENEINSTANCECLASS__
+
+#include "CL\cl.h"
+#include "AABB.h"
+#include "CLStructs.h"
+
+class SceneGroup;
+
+/* SceneInstance class places a copy of a SceneGroup in the scene with its own transformation.
+	The geometry and the BVH of the group are stored only once on the device, no matter 
+	how many instances it has. A group with at least one instance is only rendered through its
+	instances, and its own position, rotation and scale are ignored. 
+	Instances are created and deleted by the SceneManager */
+class SceneInstance
+{
+public:
+
+	/* Return the group which this is an instance of */
+	inline SceneGroup* GetGroup()const
+	{
+		return m_group;
+	}
+
+	/* Set position of this instance. Changing the transformations of an instance 
+		after the scene is on the device only refits the object level BVH */
+	void SetPosition(const cl_float3& pos);
+
+	/* Get position of this instance */
+	inline cl_float3 GetPosition()const
+	{
+		return m_pos;
+	}
+
+	/* Set rotation of this instance in radians */
+	void SetRotation(const cl_float3& rot);
+
+	/* Get rotation of this instance */
+	inline cl_float3 GetRotation()const
+	{
+		return m_rotation;
+	}
+
+	/* Set scale on a 0-1 scale of this instance */
+	void SetScale(const cl_float3& scale);
+
+	/* Get scale of this instance */
+	inline cl_float3 GetScale()const
+	{
+		return m_scale;
+	}
+
+private:
+
+	SceneInstance(SceneGroup* group);
+	~SceneInstance();
+
+	/* prevent copy by not implementing this */
+	SceneInstance(SceneInstance const&);
+	void operator=(SceneInstance const&);
+
+	friend class SceneManager;
+
+	/* Fill the matrix of instance, the BVH range is filled by the SceneManager */
+	void FillInstanceStruct(InstanceStruct& instance)const;
+
+	/* AABB of this instance in world space, computed from the AABB of the group in object space */
+	AABB ComputeAABB()const;
+
+	/* group which this is an instance of */
+	SceneGroup* m_group;
+
+	/* transformations of this instance */
+	cl_float3 m_pos;
+	cl_float3 m_scale;
+	cl_float3 m_rotation;
+
+	/* tells if the transformations changed after the scene was sent to the device */
+	bool m_outdated_transform;
+};
+
+
+#endif //__SCENEINSTANCECLASS__
@@ -17,19 +17,29 @@
 	*/
 
 #include "SceneManager.h"
-#include "BVH.h"
+#include "Trace.h"
 
 
 SceneManager::SceneManager()
 {
 	m_geometryUpdated = false;
 	m_materialsUpdated = false;
+	m_transformationsUpdated = true;
+	m_groupsGeometryUpdated = true;
 
 	m_facesBuffer = nullptr;
 	m_groupsBuffer = nullptr;
 	m_verticesBuffer = nullptr;
 	m_materials = nullptr;
 	m_bvhTreeNodes = nullptr;
+	m_bvhWideNodes = nullptr;
+	m_bvhCompressedNodes = nullptr;
+	m_instancesBuffer = nullptr;
+	m_bvhTopLevelSize = 0;
+
+	m_bvhBuildMethod = MedianSplit;
+	m_bvhLayout = StacklessLayout;
+	memset(&m_bvhStatistics, 0, sizeof(BVHStatistics));
 
 	m_context = nullptr;
 }
@@ -49,6 +59,14 @@ void SceneManager::ClearScene()
 	}
 	m_groups.clear();
 
+	/* and all instances of them */
+	std::vector<SceneInstance*>::iterator instance;
+	for (instance = m_instances.begin(); instance != m_instances.end(); instance++)
+	{
+		delete *instance;
+	}
+	m_instances.clear();
+
 	if (m_context != nullptr)
 	{
 		if (m_facesBuffer != nullptr)
@@ -61,6 +79,12 @@ void SceneManager::ClearScene()
 			m_context->DeleteMemoryObject(m_materials);
 		if (m_bvhTreeNodes != nullptr)
 			m_context->DeleteMemoryObject(m_bvhTreeNodes);
+		if (m_bvhWideNodes != nullptr)
+			m_context->DeleteMemoryObject(m_bvhWideNodes);
+		if (m_bvhCompressedNodes != nullptr)
+			m_context->DeleteMemoryObject(m_bvhCompressedNodes);
+		if (m_instancesBuffer != nullptr)
+			m_context->DeleteMemoryObject(m_instancesBuffer);
 			
 	}
 
@@ -69,9 +93,14 @@ void SceneManager::ClearScene()
 	m_groupsBuffer = nullptr;
 	m_materials = nullptr;
 	m_bvhTreeNodes = nullptr;
+	m_bvhWideNodes = nullptr;
+	m_bvhCompressedNodes = nullptr;
+	m_instancesBuffer = nullptr;
 
 	m_geometryUpdated = false;
 	m_materialsUpdated = false;
+	m_transformationsUpdated = true;
+	m_groupsGeometryUpdated = true;
 
 }
 
@@ -89,9 +118,44 @@ void SceneManager::DeleteSceneGroup(SceneGroup* group)
 	assert((std::find(m_groups.begin(), m_groups.end(), group) != m_groups.end())
 	&& "This scene group is not part of this scene!");
 
+	/* instances can't outlive their group */
+	for (int i = 0; i < m_instances.size(); i++)
+	{
+		if (m_instances[i]->GetGroup() == group)
+		{
+			delete m_instances[i];
+			m_instances.erase(m_instances.begin() + i);
+			i--;
+		}
+	}
+
 	delete group;
 	m_groups.erase(std::remove(m_groups.begin(), m_groups.end(), group),m_groups.end());
+	m_geometryUpdated = false;
+}
 
+SceneInstance* SceneManager::CreateSceneInstance(SceneGroup* group)
+{
+	// check if the memory belongs to this context
+	assert((std::find(m_groups.begin(), m_groups.end(), group) != m_groups.end())
+		&& "This scene group is not part of this scene!");
+
+	SceneInstance* newInstance = new SceneInstance(group);
+	m_instances.push_back(newInstance);
+	m_geometryUpdated = false;
+
+	return newInstance;
+}
+
+void SceneManager::DeleteSceneInstance(SceneInstance* instance)
+{
+	// check if the memory belongs to this context
+	assert((std::find(m_instances.begin(), m_instances.end(), instance) != m_instances.end())
+		&& "This scene instance is not part of this scene!");
+
+	delete instance;
+	m_instances.erase(std::remove(m_instances.begin(), m_instances.end(), instance), m_instances.end());
+	m_geometryUpdated = false;
 }
 
 void SceneManager::SetContext(const OCLContext* context)
@@ -102,28 +166,76 @@ void SceneManager::SetContext(const OCLContext* context)
 	m_groupsBuffer = nullptr;
 	m_materials = nullptr;
 	m_bvhTreeNodes = nullptr;
+	m_bvhWideNodes = nullptr;
+	m_bvhCompressedNodes = nullptr;
+	m_instancesBuffer = nullptr;
 	m_geometryUpdated = false;
 	m_materialsUpdated = false;
+	m_transformationsUpdated = true;
+	m_groupsGeometryUpdated = true;
 
 	m_context = const_cast<OCLContext*>(context);
 }
 
+void SceneManager::SetBVHBuildMethod(const BVHBuildMethod method)
+{
+	if (method == m_bvhBuildMethod)
+		return;
+
+	m_bvhBuildMethod = method;
+
+	/* BVHs are cached by the groups, they must be discarded */
+	std::vector<SceneGroup*>::iterator it;
+	for (it = m_groups.begin(); it != m_groups.end(); it++)
+	{
+		(*it)->ClearBoundingVolumes();
+	}
+	m_geometryUpdated = false;
+}
+
+void SceneManager::SetBVHLayout(const BVHLayout layout)
+{
+	if (layout == m_bvhLayout)
+		return;
+
+	/* the BVHs of the groups are still valid, only the traversal array must be rebuilt */
+	m_bvhLayout = layout;
+	m_geometryUpdated = false;
+}
+
 bool SceneManager::LoadSceneFromOBJ(const std::string& path)
 {
 	return LoadOBJ(path.c_str());
 }
 
+bool SceneManager::GenerateScene(const StressScene scene, const int size, Camera &camera, Light &light)
+{
+	return GenerateStressScene(scene, size, camera, light);
+}
+
 bool SceneManager::PrepareScene(OCLKernel* kernel)
 {
 	assert(m_context != NULL && "Context must be set");
 	assert(kernel->GetOk() && "Kernel must be ready");
+	TraceSpan span("PrepareScene", "scene");
 
 	/* we have to setup  the 4 first arguments of the kernel: vertices, faces, groups and materials */
 	std::vector<SceneGroup*>::iterator it;
 	int groupCount = 0;
+	/* groups that can't be written over their own range of the buffers need a full build */
+	if (m_geometryUpdated && !m_groupsGeometryUpdated && !this->CanUpdateGroupsInPlace())
+		m_geometryUpdated = false;
+
 	/* check if we need to check the groups for chances in the geometry */
 	if (!m_geometryUpdated)
 	{
+		/* groups may have been added, removed or reordered, every material is written again */
+		m_materialsUpdated = false;
+		for (it = m_groups.begin(); it != m_groups.end(); it++)
+		{
+			(*it)->m_outdated_material = true;
+		}
+
 		if (m_facesBuffer != nullptr)
 			m_context->DeleteMemoryObject(m_facesBuffer);
 		if (m_verticesBuffer != nullptr)
@@ -132,34 +244,109 @@ bool SceneManager::PrepareScene(OCLKernel* kernel)
 			m_context->DeleteMemoryObject(m_groupsBuffer);
 		if (m_bvhTreeNodes != nullptr)
 			m_context->DeleteMemoryObject(m_bvhTreeNodes);
+		if (m_bvhWideNodes != nullptr)
+			m_context->DeleteMemoryObject(m_bvhWideNodes);
+		if (m_bvhCompressedNodes != nullptr)
+			m_context->DeleteMemoryObject(m_bvhCompressedNodes);
+		if (m_instancesBuffer != nullptr)
+			m_context->DeleteMemoryObject(m_instancesBuffer);
+		m_bvhTreeNodes = nullptr;
+		m_bvhWideNodes = nullptr;
+		m_bvhCompressedNodes = nullptr;
+
+		/* groups with instances are shared meshes, they stay in object space and are rendered 
+		 * only through their instances. instancesGroup holds the group index of each instance */
+		std::map<SceneGroup*, int> groupsIndex;
+		for (int i = 0; i < m_groups.size(); i++)
+		{
+			groupsIndex[m_groups[i]] = i;
+		}
+		std::vector<bool> instancedGroups(m_groups.size(), false);
+		std::vector<int> instancesGroup(m_instances.size());
+		for (int i = 0; i < m_instances.size(); i++)
+		{
+			instancesGroup[i] = groupsIndex[m_instances[i]->GetGroup()];
+			instancedGroups[instancesGroup[i]] = true;
+		}
 
 		int facesCount = 0;
 		int vertexCount = 0;
-		/* covert geometry to global space and query for vertex number and faces number */
-		for (it = m_groups.begin(); it != m_groups.end(); it++)
+		/* covert geometry to global space and build the triangle level BVH of each group.
+		 * Groups are independent from each other, so each one is a task on the pool */
+		TaskPool& pool = TaskPool::GetSharedPool();
+		TaskGroup groupsTasks;
+		for (int i = 0; i < m_groups.size(); i++)
 		{
-			if ((*it)->AreVerticesInLocalSpace())
+			SceneGroup* group = m_groups[i];
+			bool instanced = instancedGroups[i];
+			pool.Run(groupsTasks, [group, instanced]()
 			{
-				(*it)->TransformLocalToGlobalVertices();
-			}
+				if (instanced)
+				{
+					if (!group->AreVerticesInLocalSpace())
+					{
+						group->RevertToLocalVertices();
+					}
+				}
+				else if (group->AreVerticesInLocalSpace())
+				{
+					group->TransformLocalToGlobalVertices();
+				}
+				else if (group->m_outdated_transform)
+				{
+					group->UpdateGlobalVertices();
+				}
+				group->m_outdated_geometry = false;
+				group->m_outdated_faces = false;
+				group->GetBVH();
+			});
+		}
+		pool.Wait(groupsTasks);
 
-			/* query the groups for face count and vertex count */
+		/* query the groups for face count and vertex count */
+		for (it = m_groups.begin(); it != m_groups.end(); it++)
+		{
 			vertexCount += (*it)->GetVerticesNumber();
 			facesCount += (*it)->GetFaceNumber();
 		}
 
-		/* create the BVHs */
+		/* create the BVHs, starting with the object level BVH */
 		std::vector<int> objects_index;
-		objects_index.reserve(m_groups.size());
+		objects_index.reserve(m_groups.size() + m_instances.size());
 		for (int i = 0; i < m_groups.size(); i++)
 		{
 			/* at the root node, the list of indexes contains 
 			 * to the whole list of objects in the scene */
-			objects_index.push_back(i);
+			if (!instancedGroups[i])
+				objects_index.push_back(i);
+		}
+
+		std::vector<AABB> instancesAABB;
+		instancesAABB.reserve(m_instances.size());
+		for (int i = 0; i < m_instances.size(); i++)
+		{
+			instancesAABB.push_back(m_instances[i]->ComputeAABB());
+			objects_index.push_back(m_groups.size() + i);
 		}
 
 		BVH root_bvh;
-		root_bvh.Create(m_groups, objects_index);
+		{
+			TraceSpan bvhSpan("BVH build (object level)", "bvh");
+			root_bvh.Create(m_groups, instancesAABB, objects_index, m_bvhBuildMethod);
+		}
+
+		/* the leaves of the object level BVH are replaced by the triangle level BVH
+		 * of each group, that were already built above. Leaves of instances are kept, and the
+		 * BVH of each instanced group is stored once after the object level BVH */
+		int topLevelSize = root_bvh.GetNodesAmount() - root_bvh.GetLeavesAmount() + m_instances.size();
+		int bvhNodesCount = topLevelSize;
+		for (int i = 0; i < m_groups.size(); i++)
+		{
+			int groupNodes = m_groups[i]->GetBVH()->GetNodesAmount();
+			bvhNodesCount += groupNodes;
+			if (!instancedGroups[i])
+				topLevelSize += groupNodes;
+		}
 
 		/* alloc enought memory */
 		cl_bool error;
@@ -176,18 +363,17 @@ bool SceneManager::PrepareScene(OCLKernel* kernel)
 		if (error)
 			return false;
 
-		m_bvhTreeNodes = m_context->CreateMemoryObject<BVHTreeNode>(root_bvh.GetNodesAmount(), ReadOnly, &error);
+		/* memory objects can't be empty, a scene without instances gets an unused one */
+		m_instancesBuffer = m_context->CreateMemoryObject<InstanceStruct>(std::max<int>(m_instances.size(), 1), ReadOnly, &error);
 		if (error)
 			return false;
 
 		cl_int3* facesRaw = new cl_int3[facesCount];
 		cl_float3* vertexRaw = new cl_float3[vertexCount];
 		SceneGroupStruct* groupsRaw = new SceneGroupStruct[m_groups.size()];
-		BVHTreeNode* bvhTreeNodesRaw = new BVHTreeNode[root_bvh.GetNodesAmount()];
-
-		/* build  traversal array, used for traversal within OpenCL device */
-		int offset_traversal = 0;
-		root_bvh.BuildTraversal(bvhTreeNodesRaw,offset_traversal);
+		BVHTreeNode* bvhTreeNodesRaw = new BVHTreeNode[bvhNodesCount];
+		InstanceStruct* instancesRaw = new InstanceStruct[m_instancesBuffer->GetSize()];
+		memset(instancesRaw, 0, m_instancesBuffer->GetSize() * sizeof(InstanceStruct));
 
 		int facesOffset = 0;
 		int vertexOffset = 0;
@@ -203,6 +389,8 @@ bool SceneManager::PrepareScene(OCLKernel* kernel)
 				facesRaw[facesOffset + p].s[0] = (*it)->m_faces[p].s[0] + vertexOffset;
 				facesRaw[facesOffset + p].s[1] = (*it)->m_faces[p].s[1] + vertexOffset;
 				facesRaw[facesOffset + p].s[2] = (*it)->m_faces[p].s[2] + vertexOffset;
+				/* the group of the face, compressed BVH nodes don't store it on their leaves */
+				facesRaw[facesOffset + p].s[3] = groupCount;
 			}
 
 			/* fill the buffers */
@@ -219,48 +407,469 @@ bool SceneManager::PrepareScene(OCLKernel* kernel)
 
 		}
 
+		/* build  traversal array, used for traversal within OpenCL device. 
+		 * The leaves of the triangle level BVHs point inside the global faces buffer,
+		 * so this must be done after groupsRaw is filled */
+		int offset_traversal = 0;
+		std::vector<cl_int2> groupsBVHRange(m_groups.size());
+		{
+			TraceSpan traversalSpan("BuildTraversal", "bvh");
+			root_bvh.BuildTraversal(bvhTreeNodesRaw, offset_traversal, m_groups, groupsRaw, instancesGroup);
+			assert(offset_traversal == topLevelSize && "Object level BVH size mismatch");
+
+			/* BVHs of the instanced groups, in object space */
+			for (int i = 0; i < m_groups.size(); i++)
+			{
+				if (!instancedGroups[i])
+					continue;
+
+				groupsBVHRange[i].s[0] = offset_traversal;
+				m_groups[i]->GetBVH()->BuildTraversal(bvhTreeNodesRaw, offset_traversal, groupsRaw[i].facesStart, i);
+				groupsBVHRange[i].s[1] = offset_traversal;
+			}
+		}
+		assert(offset_traversal == bvhNodesCount && "Traversal array was not completely filled");
+
+		/* report the quality of the BVH, useful to compare the build methods */
+		m_bvhStatistics = BVH::ComputeStatistics(bvhTreeNodesRaw, topLevelSize);
+		Log::Message("BVH built with " + std::to_string(m_bvhStatistics.nodes) + " nodes, " +
+			std::to_string(m_bvhStatistics.leaves) + " leaves and depth " + std::to_string(m_bvhStatistics.depth));
+		Log::Message("BVH expected cost per ray: traversal " + std::to_string(m_bvhStatistics.traversal_cost) +
+			", intersection " + std::to_string(m_bvhStatistics.intersection_cost));
+
+		if (m_bvhLayout == OrderedLayout)
+		{
+			/* the entries below an instance are kept while its group BVH is traversed */
+			int stackSize = BVH::ComputeOrderedStackSize(bvhTreeNodesRaw, 0, topLevelSize);
+			int groupsStackSize = 0;
+			for (int i = 0; i < m_groups.size(); i++)
+			{
+				if (instancedGroups[i])
+					groupsStackSize = std::max(groupsStackSize, 
+						BVH::ComputeOrderedStackSize(bvhTreeNodesRaw, groupsBVHRange[i].s[0], groupsBVHRange[i].s[1]));
+			}
+
+			if (stackSize + groupsStackSize > BVH_ORDERED_STACK_SIZE)
+			{
+				Log::Error("The BVH is too deep for the ordered traversal, it needs " + std::to_string(stackSize + groupsStackSize) +
+					" stack entries. Use the stackless layout for this scene");
+				delete[] bvhTreeNodesRaw;
+				delete[] facesRaw;
+				delete[] vertexRaw;
+				delete[] groupsRaw;
+				delete[] instancesRaw;
+				return false;
+			}
+		}
+
+		if (m_bvhLayout == StacklessLayout || m_bvhLayout == OrderedLayout)
+		{
+			m_bvhTopLevelSize = topLevelSize;
+			m_bvhTreeNodes = m_context->CreateMemoryObject<BVHTreeNode>(bvhNodesCount, ReadOnly, &error);
+			if (error)
+				return false;
+			m_bvhTreeNodes->SetData(bvhTreeNodesRaw, false);
+		}
+		else
+		{
+			/* the binary array is collapsed into wide nodes, the object level first and then 
+			 * the BVH of each instanced group, so the ranges of the instances must be translated */
+			TraceSpan wideSpan("BuildWideTraversal", "bvh");
+			std::vector<BVH4Node> wideNodes;
+			int stackSize = BVH::BuildWideTraversal(bvhTreeNodesRaw, 0, wideNodes);
+			m_bvhTopLevelSize = wideNodes.size();
+
+			int groupsStackSize = 0;
+			for (int i = 0; i < m_groups.size(); i++)
+			{
+				if (!instancedGroups[i])
+					continue;
+
+				int binaryStart = groupsBVHRange[i].s[0];
+				groupsBVHRange[i].s[0] = wideNodes.size();
+				groupsStackSize = std::max(groupsStackSize, BVH::BuildWideTraversal(bvhTreeNodesRaw, binaryStart, wideNodes));
+				groupsBVHRange[i].s[1] = wideNodes.size();
+			}
+			delete[] bvhTreeNodesRaw;
+
+			/* the entries below an instance are kept while its group BVH is traversed */
+			if (stackSize + groupsStackSize > BVH_WIDE_STACK_SIZE)
+			{
+				Log::Error("The BVH is too deep for the wide traversal, it needs " + std::to_string(stackSize + groupsStackSize) +
+					" stack entries. Use the stackless layout for this scene");
+				delete[] facesRaw;
+				delete[] vertexRaw;
+				delete[] groupsRaw;
+				delete[] instancesRaw;
+				return false;
+			}
+
+			if (m_bvhLayout == WideLayout)
+			{
+				m_bvhWideNodes = m_context->CreateMemoryObject<BVH4Node>(wideNodes.size(), ReadOnly, &error);
+				if (error)
+					return false;
+				m_bvhWideNodes->SetData(&wideNodes[0]);
+				Log::Message("Wide BVH built with " + std::to_string(wideNodes.size()) + " nodes");
+			}
+			else
+			{
+				/* the object level keeps its exact AABBs on the host for refitting, the nodes of the
+				 * object level never point to the BVHs of the instanced groups */
+				m_bvhCompressedNodes = m_context->CreateMemoryObject<BVH4QNode>(wideNodes.size(), ReadOnly, &error);
+				if (error)
+					return false;
+				BVH4QNode* compressedNodesRaw = new BVH4QNode[wideNodes.size()];
+				BVH::CompressWideTraversal(&wideNodes[0], 0, wideNodes.size(), compressedNodesRaw);
+				m_bvhCompressedNodes->SetData(compressedNodesRaw, false);
+				m_bvhTopLevelWideNodes.assign(wideNodes.begin(), wideNodes.begin() + m_bvhTopLevelSize);
+				Log::Message("Compressed BVH built with " + std::to_string(wideNodes.size()) + " nodes, " +
+					std::to_string(wideNodes.size() * sizeof(BVH4QNode)) + " bytes");
+			}
+		}
+
+		/* a refit walks up only from the leaves of the groups and instances that changed */
+		if (m_bvhLayout == StacklessLayout || m_bvhLayout == OrderedLayout)
+			this->FindTopLevelLeaves(m_bvhTreeNodes->GetData());
+		else if (m_bvhLayout == WideLayout)
+			this->FindTopLevelLeaves(m_bvhWideNodes->GetData());
+		else
+			this->FindTopLevelLeaves(&m_bvhTopLevelWideNodes[0]);
+
+		for (int i = 0; i < m_instances.size(); i++)
+		{
+			m_instances[i]->FillInstanceStruct(instancesRaw[i]);
+			instancesRaw[i].bvhStart = groupsBVHRange[instancesGroup[i]].s[0];
+			instancesRaw[i].bvhEnd = groupsBVHRange[instancesGroup[i]].s[1];
+			m_instances[i]->m_outdated_transform = false;
+		}
+
 		// set date on memory objects
 		m_verticesBuffer->SetData(vertexRaw, false);
 		m_facesBuffer->SetData(facesRaw, false);
 		m_groupsBuffer->SetData(groupsRaw, false);
-		m_bvhTreeNodes->SetData(bvhTreeNodesRaw, false);
+		m_instancesBuffer->SetData(instancesRaw, false);
+
+		TraceSpan uploadSpan("Scene upload", "upload");
+		if (!m_verticesBuffer->SyncHostToDevice() || !m_facesBuffer->SyncHostToDevice() ||
+			!m_groupsBuffer->SyncHostToDevice() || !m_instancesBuffer->SyncHostToDevice())
+			return false;
+
+		if ((m_bvhLayout == StacklessLayout || m_bvhLayout == OrderedLayout) && !m_bvhTreeNodes->SyncHostToDevice())
+			return false;
+		if (m_bvhLayout == WideLayout && !m_bvhWideNodes->SyncHostToDevice())
+			return false;
+		if (m_bvhLayout == CompressedLayout && !m_bvhCompressedNodes->SyncHostToDevice())
+			return false;
+
+		/* a full build also applies every transformation and every change on the groups */
+		m_transformationsUpdated = true;
+		m_groupsGeometryUpdated = true;
+	}
+	else if (!m_transformationsUpdated || !m_groupsGeometryUpdated)
+	{
+		if (!this->RefitScene())
+			return false;
 	}
 
-	if (m_materials != NULL)
+	/* the materials buffer is kept while the amount of groups doesn't change */
+	if (m_materials != nullptr && m_materials->GetSize() != m_groups.size())
+	{
 		m_context->DeleteMemoryObject(m_materials);
-	/* alloc memory dedicated to the materials */
-	m_materials = m_context->CreateMemoryObject<Material>(m_groups.size(), ReadOnly);
-
-	// TODO: make the scenemanager be warned in changes in the materials, preventing redundant transfers
-	// build material array
-	groupCount = 0;
-	Material* materials = new Material[m_groups.size()];
-	for (it = m_groups.begin(); it != m_groups.end(); it++, groupCount++)
+		m_materials = nullptr;
+	}
+	if (m_materials == nullptr)
 	{
-		materials[groupCount] = (*it)->GetMaterial();
+		/* alloc memory dedicated to the materials */
+		m_materials = m_context->CreateMemoryObject<Material>(m_groups.size(), ReadOnly);
+		m_materials->SetData(new Material[m_groups.size()], false);
+		for (it = m_groups.begin(); it != m_groups.end(); it++)
+		{
+			(*it)->m_outdated_material = true;
+		}
+		m_materialsUpdated = false;
 	}
 
-	m_materials->SetData(materials, false);
+	/* groups warn the scene manager when their material changes, only those are written and uploaded.
+	 * Each run of consecutive changed groups is uploaded on its own, the dirty range of the buffer would
+	 * otherwise cover every material between two changed groups far apart */
+	if (!m_materialsUpdated)
+	{
+		int runStart = -1;
+		for (int i = 0; i <= (int)m_groups.size(); i++)
+		{
+			if (i < (int)m_groups.size() && m_groups[i]->m_outdated_material)
+			{
+				(*m_materials)[i] = m_groups[i]->GetMaterial();
+				m_groups[i]->m_outdated_material = false;
+				if (runStart < 0)
+					runStart = i;
+			}
+			else if (runStart >= 0)
+			{
+				m_materials->MarkDirty(runStart, i - runStart);
+				if (!m_materials->SyncDirtyHostToDevice())
+					return false;
+				runStart = -1;
+			}
+		}
+		m_materialsUpdated = true;
+	}
 
 	/* all done, now setup kernel arguments */
 	kernel->SetArgument(0, m_verticesBuffer);
 	kernel->SetArgument(1, m_facesBuffer);
 	kernel->SetArgument(2, m_groupsBuffer);
 	kernel->SetArgument(3, m_materials);
-	kernel->SetArgument(4, m_bvhTreeNodes);
+	if (m_bvhLayout == StacklessLayout || m_bvhLayout == OrderedLayout)
+		kernel->SetArgument(4, m_bvhTreeNodes);
+	else if (m_bvhLayout == WideLayout)
+		kernel->SetArgument(4, m_bvhWideNodes);
+	else
+		kernel->SetArgument(4, m_bvhCompressedNodes);
+	kernel->SetArgument(5, m_instancesBuffer);
 
-	m_context->SyncAllMemoryHostToDevice();
 	m_geometryUpdated = true;
 
 	return true;
 }
 
+/* Upload the nodes of the object level BVH recomputed by a refit, which are only the paths leading to 
+	the groups that changed. nodes is sorted by position, contiguous nodes are sent in a single write */
+template <class T>
+static bool SyncRefittedNodes(OCLMemoryObject<T>* buffer, const std::vector<int>& nodes)
+{
+	int size = nodes.size();
+	for (int i = 0; i < size; i++)
+	{
+		int start = i;
+		while (i + 1 < size && nodes[i + 1] == nodes[i] + 1)
+			i++;
+
+		if (!buffer->SyncHostToDevice(nodes[start], nodes[i] - nodes[start] + 1))
+			return false;
+	}
+
+	return true;
+}
+
+bool SceneManager::RefitScene()
+{
+	assert(m_geometryUpdated && "Refit requires the scene to be on the device");
+	TraceSpan span("RefitScene", "scene");
+
+	/* 
+	 * Only the transformations of some groups or instances changed, so the faces and the topology of the BVH
+	 * are still valid. The vertices of those groups are transformed again and written over their 
+	 * range of the vertices buffer, then the AABBs of their leaves and of the nodes above them are recomputed.
+	 * Groups whose vertices were replaced by the same amount are handled the same way, their faces are kept
+	 * in the order of the leaves. New faces need a new BVH for the group, they never get here.
+	 * The quality of the BVH degrades if the groups move or change too much, a full build restores it.
+	 */
+	const SceneGroupStruct* groupsRaw = m_groupsBuffer->GetData();
+	std::vector<bool> refitGroups(m_groups.size(), false);
+	std::vector<int> leaves;
+	int vertexOffset = 0;
+	int updatedGroups = 0;
+	for (int i = 0; i < m_groups.size(); i++)
+	{
+		SceneGroup* group = m_groups[i];
+		if (group->m_outdated_geometry)
+		{
+			assert(!group->m_outdated_faces && "New faces require a full build");
+			if (group->AreVerticesInLocalSpace())
+				group->TransformLocalToGlobalVertices();
+			else if (group->m_outdated_transform)
+				group->UpdateGlobalVertices();
+
+			group->m_outdated_geometry = false;
+			updatedGroups++;
+		}
+		else if (group->m_outdated_transform)
+		{
+			group->UpdateGlobalVertices();
+		}
+		else
+		{
+			vertexOffset += groupsRaw[i].vertexSize;
+			continue;
+		}
+
+		memcpy(&(*m_verticesBuffer)[vertexOffset], &(group->m_vertices[0]), 
+			group->GetVerticesNumber() * sizeof(cl_float3));
+
+		if (!m_verticesBuffer->SyncHostToDevice(vertexOffset, group->GetVerticesNumber()))
+			return false;
+
+		refitGroups[i] = true;
+		leaves.insert(leaves.end(), m_groupsLeafNodes[i].begin(), m_groupsLeafNodes[i].end());
+		vertexOffset += groupsRaw[i].vertexSize;
+	}
+
+	if (updatedGroups > 0)
+		Log::Message("Geometry of " + std::to_string(updatedGroups) + " groups updated without rebuilding the scene");
+
+	/* moved instances get a new matrix and a new AABB on their leaf */
+	std::vector<int> movedInstances;
+	for (int i = 0; i < m_instances.size(); i++)
+	{
+		if (m_instances[i]->m_outdated_transform)
+		{
+			m_instances[i]->FillInstanceStruct((*m_instancesBuffer)[i]);
+			movedInstances.push_back(i);
+			leaves.push_back(m_instancesLeafNode[i]);
+		}
+	}
+
+	if (!movedInstances.empty() && !m_instancesBuffer->SyncHostToDevice())
+		return false;
+
+	/* the BVHs of the instanced groups are not affected, only the object level is refitted */
+	std::vector<int> refittedNodes;
+	if (m_bvhLayout == StacklessLayout || m_bvhLayout == OrderedLayout)
+	{
+		for (int i = 0; i < movedInstances.size(); i++)
+		{
+			BVHTreeNode& node = (*m_bvhTreeNodes)[m_instancesLeafNode[movedInstances[i]]];
+			AABB aabb = m_instances[movedInstances[i]]->ComputeAABB();
+			node.aabb.point_min = aabb.GetMinPoint();
+			node.aabb.point_max = aabb.GetMaxPoint();
+		}
+
+		BVH::Refit(&(*m_bvhTreeNodes)[0], m_bvhTopLevelParents, leaves, m_facesBuffer->GetData(),
+			m_verticesBuffer->GetData(), refitGroups, refittedNodes);
+
+		if (!SyncRefittedNodes(m_bvhTreeNodes, refittedNodes))
+			return false;
+	}
+	else
+	{
+		BVH4Node* wideNodes = m_bvhLayout == WideLayout ? &(*m_bvhWideNodes)[0] : &m_bvhTopLevelWideNodes[0];
+		for (int i = 0; i < movedInstances.size(); i++)
+		{
+			BVH4Node& node = wideNodes[m_instancesLeafNode[movedInstances[i]]];
+			for (int c = 0; c < 4; c++)
+			{
+				if (node.count.s[c] == -1 && node.child.s[c] == movedInstances[i])
+				{
+					AABB aabb = m_instances[movedInstances[i]]->ComputeAABB();
+					node.min_x.s[c] = aabb.GetMinPoint().s[0];
+					node.min_y.s[c] = aabb.GetMinPoint().s[1];
+					node.min_z.s[c] = aabb.GetMinPoint().s[2];
+					node.max_x.s[c] = aabb.GetMaxPoint().s[0];
+					node.max_y.s[c] = aabb.GetMaxPoint().s[1];
+					node.max_z.s[c] = aabb.GetMaxPoint().s[2];
+				}
+			}
+		}
+
+		BVH::RefitWide(wideNodes, m_bvhTopLevelParents, leaves, m_facesBuffer->GetData(),
+			m_verticesBuffer->GetData(), refitGroups, refittedNodes);
+
+		if (m_bvhLayout == WideLayout)
+		{
+			if (!SyncRefittedNodes(m_bvhWideNodes, refittedNodes))
+				return false;
+		}
+		else
+		{
+			for (int i = 0; i < refittedNodes.size(); i++)
+				BVH::CompressWideTraversal(wideNodes, refittedNodes[i], refittedNodes[i] + 1, &(*m_bvhCompressedNodes)[0]);
+			if (!SyncRefittedNodes(m_bvhCompressedNodes, refittedNodes))
+				return false;
+		}
+	}
+
+	for (int i = 0; i < m_instances.size(); i++)
+	{
+		m_instances[i]->m_outdated_transform = false;
+	}
+
+	m_transformationsUpdated = true;
+	m_groupsGeometryUpdated = true;
+	return true;
+}
+
+bool SceneManager::CanUpdateGroupsInPlace()
+{
+	/* groups created after the last build have no range on the buffers yet */
+	if (m_groupsBuffer->GetSize() != m_groups.size())
+		return false;
+
+	const SceneGroupStruct* groupsRaw = m_groupsBuffer->GetData();
+	for (int i = 0; i < m_groups.size(); i++)
+	{
+		SceneGroup* group = m_groups[i];
+		if (!group->m_outdated_geometry)
+			continue;
+
+		/* the faces are sorted by the BVH of the group, new ones need a new BVH */
+		if (group->m_outdated_faces || group->GetVerticesNumber() != groupsRaw[i].vertexSize)
+			return false;
+
+		/* the BVH of an instanced group is shared by all of its instances */
+		for (int p = 0; p < m_instances.size(); p++)
+		{
+			if (m_instances[p]->GetGroup() == group)
+				return false;
+		}
+	}
+
+	return true;
+}
+
+void SceneManager::FindTopLevelLeaves(const BVHTreeNode* nodes)
+{
+	BVH::FindParents(nodes, m_bvhTopLevelSize, m_bvhTopLevelParents);
+	m_groupsLeafNodes.assign(m_groups.size(), std::vector<int>());
+	m_instancesLeafNode.assign(m_instances.size(), -1);
+	for (int i = 0; i < m_bvhTopLevelSize; i++)
+	{
+		if (nodes[i].packet_indexes.s[1] == -1)
+			continue; // middle node
+
+		if (nodes[i].leaf_info.s[0] < 0)
+			m_instancesLeafNode[nodes[i].packet_indexes.s[1]] = i;
+		else
+			m_groupsLeafNodes[nodes[i].leaf_info.s[1]].push_back(i);
+	}
+}
+
+void SceneManager::FindTopLevelLeaves(const BVH4Node* nodes)
+{
+	BVH::FindParents(nodes, m_bvhTopLevelSize, m_bvhTopLevelParents);
+	m_groupsLeafNodes.assign(m_groups.size(), std::vector<int>());
+	m_instancesLeafNode.assign(m_instances.size(), -1);
+	for (int i = 0; i < m_bvhTopLevelSize; i++)
+	{
+		for (int c = 0; c < 4; c++)
+		{
+			if (nodes[i].child.s[c] == -1 || nodes[i].count.s[c] == 0)
+				continue; // empty slot or middle child
+
+			if (nodes[i].count.s[c] < 0)
+				m_instancesLeafNode[nodes[i].child.s[c]] = i;
+			else if (m_groupsLeafNodes[nodes[i].group.s[c]].empty() || m_groupsLeafNodes[nodes[i].group.s[c]].back() != i)
+				m_groupsLeafNodes[nodes[i].group.s[c]].push_back(i);
+		}
+	}
+}
+
 void SceneManager::RemoveEmptyGroups()
 {
 	for (int i = 0; i < m_groups.size(); i++)
 	{
 		if (m_groups[i]->GetVerticesNumber() == 0 || m_groups[i]->GetFaceNumber() == 0)
 		{
+			for (int p = 0; p < m_instances.size(); p++)
+			{
+				if (m_instances[p]->GetGroup() == m_groups[i])
+				{
+					delete m_instances[p];
+					m_instances.erase(m_instances.begin() + p);
+					p--;
+				}
+			}
 			m_groups.erase(m_groups.begin() + i);
 			i--;
 		}
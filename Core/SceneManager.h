@@ -22,7 +22,12 @@
 
 #include "RenderGirlCore.h"
 #include "OBJLoader.h"
+#include "SceneGenerator.h"
+#include "BVH.h"
+#include "SceneInstance.h"
+#include "TaskPool.h"
 #include <list>
+#include <map>
 #include <assert.h>
 
 
@@ -53,9 +58,21 @@ public:
 	/* Delete a SceneGroup inside this scene. */
 	void DeleteSceneGroup(SceneGroup* group);
 
+	/* Creates an instance of a scene group, placing a copy of its geometry in the scene without
+		duplicating it. The group is rendered only through its instances from now on. 
+		You can delete this memory using SceneManager::DeleteSceneInstance */
+	SceneInstance* CreateSceneInstance(SceneGroup* group);
+
+	/* Delete a SceneInstance inside this scene. */
+	void DeleteSceneInstance(SceneInstance* instance);
+
 	/* Load an OBJ file into the scene providing a path, return FALSE if there was an error */
 	bool LoadSceneFromOBJ(const std::string& path);
 
+	/* Generate a procedural scene to benchmark the renderer at scale, see SceneGenerator.h. camera and light
+		are set to a view of the scene, return FALSE if there was an error */
+	bool GenerateScene(const StressScene scene, const int size, Camera &camera, Light &light);
+
 	/* set the scene manager to perform an update on the geometry loaded on the device.
 		Called by SceneGroups if there's any changes */
 	inline void SetOutadatedGeometry()
@@ -63,18 +80,67 @@ public:
 		m_geometryUpdated = false;
 	}
 
-	/* Remove all the memory associeated with the scene, including all the groups */
+	/* set the scene manager to refit the geometry loaded on the device. Called by SceneGroups 
+		when only their transformations changed, so the topology of the scene is kept */
+	inline void SetOutdatedTransformations()
+	{
+		m_transformationsUpdated = false;
+	}
+
+	/* set the scene manager to upload the materials that changed. Called by SceneGroups */
+	inline void SetOutdatedMaterials()
+	{
+		m_materialsUpdated = false;
+	}
+
+	/* set the scene manager to update the geometry of some groups loaded on the device. Called by SceneGroups
+		when their vertices or faces are replaced, groups keeping their faces and their amount of vertices are 
+		written over their own range of the buffers, otherwise the whole scene is built again */
+	inline void SetOutdatedGroupsGeometry()
+	{
+		m_groupsGeometryUpdated = false;
+	}
+
+	/* Remove all the memory associeated with the scene, including all the groups and instances */
 	void ClearScene();
 
 	/* remove groups with no face or vertices */
 	void RemoveEmptyGroups();
 
+	/* Select the algorithm used to build the BVHs of the scene. Changing it will rebuild
+		the BVHs of all groups on the next rendering. Default is MedianSplit */
+	void SetBVHBuildMethod(const BVHBuildMethod method);
+
+	/* Return the algorithm used to build the BVHs of the scene */
+	inline BVHBuildMethod GetBVHBuildMethod()const
+	{
+		return m_bvhBuildMethod;
+	}
+
+	/* Return the layout of the traversal array sent to the device, chosen by RenderGirlShared::PrepareRaytracer */
+	inline BVHLayout GetBVHLayout()const
+	{
+		return m_bvhLayout;
+	}
+
+	/* Return the cost report of the BVH built on the last rendering */
+	inline const BVHStatistics& GetBVHStatistics()const
+	{
+		return m_bvhStatistics;
+	}
+
 	/* Return the amount of scene groups associated with the scene.
 		To render a scene, you must have at least one group loaded. */
 	inline int GetGroupsCount()const
 	{
 		return m_groups.size();
 	}
+
+	/* Return the amount of instances associated with the scene. */
+	inline int GetInstancesCount()const
+	{
+		return m_instances.size();
+	}
 	
 private:
 	
@@ -88,22 +154,64 @@ private:
 	/* set the current working context, filled by RenderGirlShared */
 	void SetContext(const OCLContext* context);
 
+	/* select the layout of the traversal array, it must match the one the kernel was compiled with.
+		Changing it rebuilds the traversal array on the next rendering */
+	void SetBVHLayout(const BVHLayout layout);
+
 	/* prepare scene for OpenCL, called by RenderGirlShared, kernel arguments are filled by SceneManager.
 		Return false for an error */
 	bool PrepareScene(OCLKernel* kernel);
 
+	/* transform again the vertices of the groups whose transformations changed, refit the BVH over the 
+		existing traversal array and upload only the BVH nodes and the changed vertices. Return false for an error */
+	bool RefitScene();
+
+	/* Return true if every group whose geometry was replaced kept its faces and its amount of vertices
+		and has no instances, so RefitScene can write it over its range of the buffers */
+	bool CanUpdateGroupsInPlace();
+
+	/* fill m_bvhTopLevelParents, m_groupsLeafNodes and m_instancesLeafNode from the object level of the
+		traversal array just built, on the binary or on the wide layout */
+	void FindTopLevelLeaves(const BVHTreeNode* nodes);
+	void FindTopLevelLeaves(const BVH4Node* nodes);
+
 	/* booleans to control if a given part of the scene is updated with the OpenCL device */
 	bool m_geometryUpdated;
 	bool m_materialsUpdated;
+	bool m_transformationsUpdated;
+	bool m_groupsGeometryUpdated;
 
 	/* buffers for this scene */
 	OCLMemoryObject<cl_int3>* m_facesBuffer;
 	OCLMemoryObject<cl_float3>* m_verticesBuffer;
 	OCLMemoryObject<SceneGroupStruct>* m_groupsBuffer;
 	OCLMemoryObject<Material>* m_materials;
-	OCLMemoryObject<BVHTreeNode>* m_bvhTreeNodes;
+	OCLMemoryObject<BVHTreeNode>* m_bvhTreeNodes; // only on the stackless layout
+	OCLMemoryObject<BVH4Node>* m_bvhWideNodes; // only on the wide layout
+	OCLMemoryObject<BVH4QNode>* m_bvhCompressedNodes; // only on the compressed layout
+	OCLMemoryObject<InstanceStruct>* m_instancesBuffer;
+
+	/* amount of nodes of the object level BVH on the traversal array, the BVHs 
+		of the instanced groups are stored after it */
+	int m_bvhTopLevelSize;
+
+	/* exact AABBs of the object level BVH on the compressed layout, refitted and quantized again 
+		when the transformations change */
+	std::vector<BVH4Node> m_bvhTopLevelWideNodes;
+
+	/* parent of each node of the object level, the nodes holding the leaves of each group on it and the one
+		holding the leaf of each instance, so RefitScene walks up only from the leaves that changed */
+	std::vector<int> m_bvhTopLevelParents;
+	std::vector<std::vector<int> > m_groupsLeafNodes;
+	std::vector<int> m_instancesLeafNode;
 
 	std::vector<SceneGroup*> m_groups;
+	std::vector<SceneInstance*> m_instances;
+
+	/* algorithm used to build the BVHs and the cost report of the last build */
+	BVHBuildMethod m_bvhBuildMethod;
+	BVHStatistics m_bvhStatistics;
+	BVHLayout m_bvhLayout;
 	
 	/* copy of context currently being used, filled by RenderGirlShared upon the first rendering */
 	OCLContext* m_context;
@@ -0,0 +1,147 @@
+/*
+	RenderGirl - OpenCL raytracer renderer
+	Copyright (c) 2016, Henrique Jung, All rights reserved.
+
+	This library is free software; you can redistribute it and/or
+	modify it under the terms of the GNU Lesser General Public
+	License as published by the Free Software Foundation; either
+	version 3.0 of the License, or any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+	Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public
+	License along with this library.
+*/
+
+#include "TaskPool.h"
+
+
+TaskPool::TaskPool()
+{
+	m_shutdown = false;
+
+	/* the thread calling Wait also executes tasks, so one worker less than the amount of cores */
+	int threads = std::thread::hardware_concurrency();
+	for (int i = 1; i < threads; i++)
+	{
+		m_workers.push_back(std::thread(&TaskPool::WorkerLoop, this));
+	}
+}
+
+TaskPool::~TaskPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_shutdown = true;
+	}
+	m_condition.notify_all();
+
+	for (int i = 0; i < m_workers.size(); i++)
+	{
+		m_workers[i].join();
+	}
+}
+
+void TaskPool::Run(TaskGroup& group, const std::function<void()>& task)
+{
+	group.m_pending++;
+
+	if (m_workers.empty())
+	{
+		/* single core machine, there's no one else to execute the task */
+		Task local_task = { task, &group };
+		this->Execute(local_task);
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		Task new_task = { task, &group };
+		m_queue.push_back(new_task);
+	}
+	m_condition.notify_one();
+}
+
+void TaskPool::Wait(TaskGroup& group)
+{
+	while (!group.IsDone())
+	{
+		Task task;
+		if (this->TryPop(task))
+		{
+			this->Execute(task);
+		}
+		else
+		{
+			/* the remaining tasks are running on other threads */
+			std::this_thread::yield();
+		}
+	}
+}
+
+void TaskPool::ParallelFor(const int begin, const int end, const int chunks,
+	const std::function<void(int, int, int)>& function)
+{
+	assert(chunks > 0 && "At least one chunk is necessary");
+
+	TaskGroup group;
+	int size = end - begin;
+	for (int chunk = 1; chunk < chunks; chunk++)
+	{
+		int chunk_begin = begin + (int)((long long)size * chunk / chunks);
+		int chunk_end = begin + (int)((long long)size * (chunk + 1) / chunks);
+		this->Run(group, [=, &function]()
+		{
+			function(chunk, chunk_begin, chunk_end);
+		});
+	}
+
+	/* the first chunk is executed by the calling thread */
+	function(0, begin, begin + size / chunks);
+	this->Wait(group);
+}
+
+void TaskPool::WorkerLoop()
+{
+	while (true)
+	{
+		Task task;
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_condition.wait(lock, [this]()
+			{
+				return m_shutdown || !m_queue.empty();
+			});
+
+			if (m_queue.empty()) // shutdown and nothing else to do
+				return;
+
+			task = m_queue.front();
+			m_queue.pop_front();
+		}
+
+		this->Execute(task);
+	}
+}
+
+bool TaskPool::TryPop(Task& task)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (m_queue.empty())
+		return false;
+
+	/* the most recent task is taken, it's usually the smallest one and the 
+	 * most likely to have its data on the cache of the waiting thread */
+	task = m_queue.back();
+	m_queue.pop_back();
+	return true;
+}
+
+void TaskPool::Execute(Task& task)
+{
+	task.function();
+	task.group->m_pending--;
+}
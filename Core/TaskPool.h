@@ -0,0 +1,124 @@
+/*
+	RenderGirl - OpenCL raytracer renderer
+	Copyright (c) 2016, Henrique Jung, All rights reserved.
+
+	This library is free software; you can redistribute it and/or
+	modify it under the terms of the GNU Lesser General Public
+	License as published by the Free Software Foundation; either
+	version 3.0 of the License, or any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+	Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public
+	License along with this library.
+*/
+
+#ifndef __TASKPOOL_CLASS__
+#define __TASKPOOL_CLASS__
+
+#include <assert.h>
+#include <vector>
+#include <deque>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <functional>
+
+
+/* TaskGroup counts the tasks spawned on the TaskPool that were not completed yet,
+	so the caller can wait for all of them to finish */
+class TaskGroup
+{
+public:
+	TaskGroup()
+	{
+		m_pending = 0;
+	}
+
+	/* Return TRUE if every task of this group was executed */
+	inline bool IsDone()const
+	{
+		return m_pending == 0;
+	}
+
+private:
+	// prevent copy by not implementing those methods
+	TaskGroup(TaskGroup const&);
+	void operator=(TaskGroup const&);
+
+	friend class TaskPool;
+
+	std::atomic<int> m_pending;
+};
+
+/* Singleton class that keeps a set of worker threads (one per core) executing tasks. 
+	Tasks may spawn new tasks, and a thread waiting for a TaskGroup will execute pending
+	tasks while it waits, so nested tasks do not deadlock the pool. */
+class TaskPool
+{
+
+/*This singleton architecture was kindly sugested by Loki Astari at
+http://stackoverflow.com/questions/270947/can-any-one-provide-me-a-sample-of-singleton-in-c/271104#271104 */
+
+public:
+	static TaskPool& GetSharedPool()
+	{
+		static TaskPool instance;
+		return instance;
+	}
+
+	~TaskPool();
+
+	/* Enqueue a task for execution on any thread of the pool, the task is associated with group */
+	void Run(TaskGroup& group, const std::function<void()>& task);
+
+	/* Block until all the tasks of group are done. The calling thread executes
+		pending tasks of the pool meanwhile */
+	void Wait(TaskGroup& group);
+
+	/* Split the range [begin, end) in the given amount of chunks with similar sizes and execute
+		function(chunk, chunk_begin, chunk_end) for each one of them in parallel. Blocks until all chunks are done */
+	void ParallelFor(const int begin, const int end, const int chunks,
+		const std::function<void(int, int, int)>& function);
+
+	/* Return the amount of threads that execute tasks, including the calling thread */
+	inline int GetThreadsAmount()const
+	{
+		return m_workers.size() + 1;
+	}
+
+private:
+	TaskPool();
+	// prevent copy by not implementing those methods
+	TaskPool(TaskPool const&);
+	void operator=(TaskPool const&);
+
+	/* a task waiting on the queue */
+	struct Task
+	{
+		std::function<void()> function;
+		TaskGroup* group;
+	};
+
+	/* main function of the worker threads */
+	void WorkerLoop();
+
+	/* take a task from the queue, return FALSE if the queue is empty */
+	bool TryPop(Task& task);
+
+	/* execute a task and mark it as done on its group */
+	void Execute(Task& task);
+
+	std::vector<std::thread> m_workers;
+	std::deque<Task> m_queue;
+	std::mutex m_mutex;
+	std::condition_variable m_condition;
+	bool m_shutdown;
+};
+
+
+#endif // __TASKPOOL_CLASS__
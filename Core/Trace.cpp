@@ -0,0 +1,143 @@
+/*
+	RenderGirl - OpenCL raytracer renderer
+	Copyright (c) 2016, Henrique Jung, All rights reserved.
+
+	This library is free software; you can redistribute it and/or
+	modify it under the terms of the GNU Lesser General Public
+	License as published by the Free Software Foundation; either
+	version 3.0 of the License, or any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+	Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public
+	License along with this library.
+*/
+
+#include <stdio.h>
+
+#include "Trace.h"
+#include "Log.h"
+
+std::atomic<bool> Trace::s_recording(false);
+std::chrono::high_resolution_clock::time_point Trace::s_origin;
+std::vector<Trace::Span> Trace::s_spans;
+std::map<std::thread::id, int> Trace::s_lanes;
+std::mutex Trace::s_mutex;
+
+void Trace::Start()
+{
+	std::lock_guard<std::mutex> lock(s_mutex);
+	s_spans.clear();
+	s_lanes.clear();
+	s_origin = std::chrono::high_resolution_clock::now();
+	s_recording = true;
+}
+
+double Trace::Now()
+{
+	/* Start may be moving the origin */
+	std::lock_guard<std::mutex> lock(s_mutex);
+	std::chrono::nanoseconds ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::high_resolution_clock::now() - s_origin);
+	return ns.count() / 1000.0;
+}
+
+int Trace::GetThreadLane()
+{
+	std::thread::id thread = std::this_thread::get_id();
+	std::map<std::thread::id, int>::iterator lane = s_lanes.find(thread);
+	if (lane != s_lanes.end())
+		return lane->second;
+
+	int newLane = s_lanes.size() + 1;
+	s_lanes[thread] = newLane;
+	return newLane;
+}
+
+void Trace::AddSpan(const std::string &name, const char* category, const double start, const double duration)
+{
+	std::lock_guard<std::mutex> lock(s_mutex);
+	if (!s_recording)
+		return;
+
+	Span span = { name, category, start, duration, GetThreadLane() };
+	s_spans.push_back(span);
+}
+
+void Trace::AddDeviceSpan(const std::string &name, const char* category, const double start, const double duration)
+{
+	std::lock_guard<std::mutex> lock(s_mutex);
+	if (!s_recording)
+		return;
+
+	Span span = { name, category, start, duration, 0 };
+	s_spans.push_back(span);
+}
+
+/* names go between quotes on the JSON file, control characters such as the new lines of a file name
+ * can't appear there as they are */
+static std::string EscapeJSON(const std::string &text)
+{
+	std::string escaped;
+	for (unsigned int c = 0; c < text.size(); c++)
+	{
+		unsigned char character = text[c];
+		if (character < 0x20)
+		{
+			char code[8];
+			sprintf(code, "\\u%04x", character);
+			escaped += code;
+			continue;
+		}
+		if (character == '"' || character == '\\')
+			escaped += '\\';
+		escaped += text[c];
+	}
+	return escaped;
+}
+
+bool Trace::Stop(const std::string &path)
+{
+	std::lock_guard<std::mutex> lock(s_mutex);
+	s_recording = false;
+
+	FILE* traceFile = fopen(path.c_str(), "w");
+	if (traceFile == NULL)
+	{
+		Log::Error("Couldn't write the trace at " + path);
+		return false;
+	}
+
+	/* the trace event format of chrome://tracing, a complete event ("X") for each span and
+	 * a metadata event ("M") naming each lane */
+	fprintf(traceFile, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	fprintf(traceFile, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"Device\"}}");
+	std::map<std::thread::id, int>::iterator lane;
+	for (lane = s_lanes.begin(); lane != s_lanes.end(); lane++)
+	{
+		fprintf(traceFile, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"Host thread %d\"}}",
+			lane->second, lane->second);
+	}
+	for (unsigned int s = 0; s < s_spans.size(); s++)
+	{
+		const Span &span = s_spans[s];
+		fprintf(traceFile, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%d}",
+			EscapeJSON(span.name).c_str(), span.category, span.start, span.duration, span.lane);
+	}
+	fprintf(traceFile, "\n]}\n");
+
+	bool ok = ferror(traceFile) == 0;
+	fclose(traceFile);
+	if (!ok)
+	{
+		Log::Error("Couldn't write the trace at " + path);
+		return false;
+	}
+
+	Log::Message("Trace with " + std::to_string(s_spans.size()) + " spans written at " + path);
+	s_spans.clear();
+	return true;
+}
@@ -0,0 +1,110 @@
+/*
+	RenderGirl - OpenCL raytracer renderer
+	Copyright (c) 2016, Henrique Jung, All rights reserved.
+
+	This library is free software; you can redistribute it and/or
+	modify it under the terms of the GNU Lesser General Public
+	License as published by the Free Software Foundation; either
+	version 3.0 of the License, or any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+	Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public
+	License along with this library.
+*/
+
+#ifndef __TRACE_CLASS__
+#define __TRACE_CLASS__
+
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <atomic>
+
+/* Static class recording a timeline of the work done by the renderer, such as loading the scene, building the BVH,
+	building the kernels and each command sent to the device. The timeline is written as a JSON file that can be
+	opened by chrome://tracing. Spans on the host are recorded with TraceSpan, each thread on its own lane. Commands
+	sent to the device are recorded on the lane of the device once their frame is finished */
+class Trace
+{
+public:
+	/* Start recording, dropping any span recorded before */
+	static void Start();
+
+	/* Stop recording and write the spans recorded at path. Return FALSE if the file couldn't be written */
+	static bool Stop(const std::string &path);
+
+	/* Return TRUE while recording */
+	static inline bool IsRecording()
+	{
+		return s_recording;
+	}
+
+	/* Return the time since the recording started in microseconds, the clock of the spans */
+	static double Now();
+
+	/* Record a span on the lane of the calling thread, start and duration in microseconds */
+	static void AddSpan(const std::string &name, const char* category, const double start, const double duration);
+
+	/* Record a span on the lane of the device, start and duration in microseconds */
+	static void AddDeviceSpan(const std::string &name, const char* category, const double start, const double duration);
+
+private:
+	Trace(){ ; };
+
+	struct Span
+	{
+		std::string name;
+		const char* category;
+		double start;
+		double duration;
+		int lane;
+	};
+
+	// lane of the calling thread, s_mutex must be locked
+	static int GetThreadLane();
+
+	static std::atomic<bool> s_recording;
+	static std::chrono::high_resolution_clock::time_point s_origin;
+	static std::vector<Span> s_spans;
+	// lane of each thread that recorded a span, the device is on lane 0
+	static std::map<std::thread::id, int> s_lanes;
+	// spans are recorded from the threads of the TaskPool too
+	static std::mutex s_mutex;
+};
+
+/* Record a span on the calling thread from the creation of this object until it goes out of scope,
+	nothing when the trace is not recording. The name must outlive this object */
+class TraceSpan
+{
+public:
+	TraceSpan(const char* name, const char* category)
+	{
+		m_name = name;
+		m_category = category;
+		m_start = Trace::IsRecording() ? Trace::Now() : -1.0;
+	}
+
+	~TraceSpan()
+	{
+		if (m_start >= 0.0 && Trace::IsRecording())
+			Trace::AddSpan(m_name, m_category, m_start, Trace::Now() - m_start);
+	}
+
+private:
+	// prevent copy by not implementing those methods
+	TraceSpan(TraceSpan const&);
+	void operator=(TraceSpan const&);
+
+	const char* m_name;
+	const char* m_category;
+	double m_start;
+};
+
+#endif // __TRACE_CLASS__